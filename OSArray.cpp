@@ -1,17 +1,18 @@
 #include "OSArray.h"
 #include "OSSerialize.h"
+#include "OSZone.h"
 
 #define super OSCollection
 
 OSDefineMetaClassAndStructors(OSArray, OSCollection)
 
-OSMetaClassDefineReservedUnused(OSArray, 0)
-OSMetaClassDefineReservedUnused(OSArray, 1)
-OSMetaClassDefineReservedUnused(OSArray, 2)
-OSMetaClassDefineReservedUnused(OSArray, 3)
-OSMetaClassDefineReservedUnused(OSArray, 4)
-OSMetaClassDefineReservedUnused(OSArray, 5)
-OSMetaClassDefineReservedUnused(OSArray, 6)
+OSMetaClassDefineReservedUsed(OSArray, 0)
+OSMetaClassDefineReservedUsed(OSArray, 1)
+OSMetaClassDefineReservedUsed(OSArray, 2)
+OSMetaClassDefineReservedUsed(OSArray, 3)
+OSMetaClassDefineReservedUsed(OSArray, 4)
+OSMetaClassDefineReservedUsed(OSArray, 5)
+OSMetaClassDefineReservedUsed(OSArray, 6)
 OSMetaClassDefineReservedUnused(OSArray, 7)
 
 #if OSALLOCDEBUG
@@ -26,8 +27,6 @@ extern "C" {
 #define EXT_CAST(obj) \
     reinterpret_cast<OSObject *>(const_cast<OSMetaClassBase *>(obj))
 
-#define kfree(ptr, size) kfree(ptr)
-
 bool OSArray::initWithCapacity(unsigned int inCapacity)
 {
     int size;
@@ -36,7 +35,7 @@ bool OSArray::initWithCapacity(unsigned int inCapacity)
         return false;
 
     size = sizeof(const OSMetaClassBase *) * inCapacity;
-    array = (const OSMetaClassBase **) kalloc(size);
+    array = (const OSMetaClassBase **) OSZoneAlloc(size);
     if (!array)
         return false;
 
@@ -66,17 +65,7 @@ bool OSArray::initWithObjects(const OSObject *objects[],
     if (!objects || !initWithCapacity(initCapacity))
         return false;
 
-    for ( unsigned int i = 0; i < theCount; i++ ) {
-        const OSMetaClassBase *newObject = *objects++;
-
-        if (!newObject)
-            return false;
-
-        array[count++] = newObject;
-        newObject->taggedRetain(OSTypeID(OSCollection));
-    }
-
-    return true;	
+    return setObjects((const OSMetaClassBase * const *) objects, theCount);
 }
 
 bool OSArray::initWithArray(const OSArray *anArray,
@@ -136,7 +125,7 @@ void OSArray::free()
     flushCollection();
 
     if (array) {
-        kfree(array, sizeof(const OSMetaClassBase *) * capacity);
+        OSZoneFree(array, sizeof(const OSMetaClassBase *) * capacity);
         ACCUMSIZE( -(sizeof(const OSMetaClassBase *) * capacity) );
     }
 
@@ -157,40 +146,42 @@ unsigned int OSArray::setCapacityIncrement(unsigned int increment)
 unsigned int OSArray::ensureCapacity(unsigned int newCapacity)
 {
     const OSMetaClassBase **newArray;
-    int oldSize, newSize;
+    size_t oldSize, newSize;
 
     if (newCapacity <= capacity)
         return capacity;
 
-    // round up
-    newCapacity = (((newCapacity - 1) / capacityIncrement) + 1)
-                * capacityIncrement;
+    newCapacity = growCapacity(capacity, newCapacity, capacityIncrement,
+                               sizeof(const OSMetaClassBase *));
+    if (!newCapacity)
+        return capacity;
+    oldSize = sizeof(const OSMetaClassBase *) * capacity;
     newSize = sizeof(const OSMetaClassBase *) * newCapacity;
 
-    newArray = (const OSMetaClassBase **) kalloc(newSize);
-    if (newArray) {
-        oldSize = sizeof(const OSMetaClassBase *) * capacity;
-
-        ACCUMSIZE(newSize - oldSize);
+    if (OSZoneExtend(array, oldSize, newSize))
+        newArray = array;
+    else {
+        newArray = (const OSMetaClassBase **) OSZoneAlloc(newSize);
+        if (!newArray)
+            return capacity;
 
         bcopy(array, newArray, oldSize);
-        bzero(&newArray[capacity], newSize - oldSize);
-        kfree(array, oldSize);
-        array = newArray;
-        capacity = newCapacity;
+        OSZoneFree(array, oldSize);
     }
 
+    ACCUMSIZE(newSize - oldSize);
+
+    bzero(&newArray[capacity], newSize - oldSize);
+    array = newArray;
+    capacity = newCapacity;
+
     return capacity;
 }
 
 void OSArray::flushCollection()
 {
-    unsigned int i;
-
     haveUpdated();
-    for (i = 0; i < count; i++) {
-        array[i]->taggedRelease(OSTypeID(OSCollection));
-    }
+    OSObject::taggedReleaseObjects(array, count, OSTypeID(OSCollection));
     count = 0;
 }
 
@@ -200,25 +191,46 @@ bool OSArray::setObject(const OSMetaClassBase *anObject)
 }
 
 bool OSArray::setObject(unsigned int index, const OSMetaClassBase *anObject)
+{
+    return setObjects(index, &anObject, 1);
+}
+
+bool OSArray::setObjects(const OSMetaClassBase * const *objects,
+                         unsigned int n)
+{
+    return setObjects(count, objects, n);
+}
+
+bool OSArray::setObjects(unsigned int index,
+                         const OSMetaClassBase * const *objects,
+                         unsigned int n)
 {
     unsigned int i;
-    unsigned int newCount = count + 1;
+    unsigned int newCount = count + n;
 
-    if ((index > count) || !anObject)
+    if ((index > count) || !objects || (newCount < count))
         return false;
 
+    for (i = 0; i < n; i++) {
+        if (!objects[i])
+            return false;
+    }
+    if (!n)
+        return true;
+
     // do we need more space?
     if (newCount > capacity && newCount > ensureCapacity(newCount))
         return false;
 
     haveUpdated();
     if (index != count) {
-        for (i = count; i > index; i--)
-            array[i] = array[i-1];
+        bcopy(&array[index], &array[index + n],
+              (count - index) * sizeof(const OSMetaClassBase *));
     }
-    array[index] = anObject;
-    anObject->taggedRetain(OSTypeID(OSCollection));
-    count++;
+    bcopy(objects, &array[index], n * sizeof(const OSMetaClassBase *));
+    count = newCount;
+
+    OSObject::taggedRetainObjects(&array[index], n, OSTypeID(OSCollection));
 
     return true;
 }
@@ -231,19 +243,12 @@ bool OSArray::merge(const OSArray * otherArray)
     if (!otherCount)
         return true;
 
-    // do we need more space?
-    if (newCount > capacity && newCount > ensureCapacity(newCount))
+    // grow first, otherArray may be this one
+    if (newCount < count
+     || (newCount > capacity && newCount > ensureCapacity(newCount)))
         return false;
 
-    haveUpdated();
-    for (unsigned int i = 0; i < otherCount; i++) {
-        const OSMetaClassBase *newObject = otherArray->getObject(i);
-
-        array[count++] = newObject;
-        newObject->taggedRetain(OSTypeID(OSCollection));
-    }
-
-    return true;
+    return setObjects(otherArray->array, otherCount);
 }
 
 void OSArray::
@@ -264,20 +269,70 @@ replaceObject(unsigned int index, const OSMetaClassBase *anObject)
 
 void OSArray::removeObject(unsigned int index)
 {
-    unsigned int i;
-    const OSMetaClassBase *oldObject;
+    removeObjects(index, 1);
+}
 
-    if (index >= count)
+// Objects removed in order are set aside here while the rest move down;
+// longer ranges are rotated to the end of the array instead.
+#define kRemoveStash 32
+
+static void reverseObjects(const OSMetaClassBase **objects, unsigned int n)
+{
+    if (n < 2)
         return;
 
-    haveUpdated();
-    oldObject = array[index];
+    for (unsigned int i = 0, j = n - 1; i < j; i++, j--) {
+        const OSMetaClassBase *object = objects[i];
 
-    count--;
-    for (i = index; i < count; i++)
-        array[i] = array[i+1];
+        objects[i] = objects[j];
+        objects[j] = object;
+    }
+}
 
-    oldObject->taggedRelease(OSTypeID(OSCollection));
+void OSArray::removeObjects(unsigned int index, unsigned int length,
+                            bool keepOrder)
+{
+    const OSMetaClassBase *stash[kRemoveStash];
+    const OSMetaClassBase **removed;
+    unsigned int tail;
+
+    if ((index >= count) || !length)
+        return;
+
+    if (length > count - index)
+        length = count - index;
+    tail = count - index - length;
+
+    haveUpdated();
+    if (!keepOrder) {
+        // Swap the hole with the end of the array, or with the whole tail
+        // if that is shorter; either way the removed objects end up last.
+        unsigned int moved = (tail < length) ? tail : length;
+
+        for (unsigned int i = 0; i < moved; i++) {
+            const OSMetaClassBase *object = array[index + i];
+
+            array[index + i] = array[count - moved + i];
+            array[count - moved + i] = object;
+        }
+        removed = &array[count - length];
+    }
+    else if (length <= kRemoveStash) {
+        bcopy(&array[index], stash, length * sizeof(const OSMetaClassBase *));
+        bcopy(&array[index + length], &array[index],
+              tail * sizeof(const OSMetaClassBase *));
+        removed = stash;
+    }
+    else {
+        // Rotate the range past the tail.
+        reverseObjects(&array[index], length);
+        reverseObjects(&array[index + length], tail);
+        reverseObjects(&array[index], length + tail);
+        removed = &array[count - length];
+    }
+    count -= length;
+
+    OSObject::taggedReleaseObjects(removed, length, OSTypeID(OSCollection));
 }
 
 bool OSArray::isEqualTo(const OSArray *anArray) const
@@ -335,6 +390,288 @@ unsigned int OSArray::getNextIndexOfObject(const OSMetaClassBase * anObject,
     return index;
 }
 
+/*
+ * Sorting.
+ *
+ * sortUsingFunction is an introsort: median of three quicksort, down to
+ * insertion sort for short runs, with heapsort taking over any range
+ * that recurses deeper than twice log2 of the array.  The parallel sort
+ * introsorts one run per task and merges them pairwise through a buffer,
+ * a round of tasks at a time.
+ */
+#define kSortShortRun   16          // insertion sort at or below this
+#define kSortMinTaskRun 1024        // fewer objects per task aren't worth a task
+
+typedef const OSMetaClassBase * SortObject;
+
+typedef struct {
+    OSArray::OSOrderFunction  comparator;
+    void                     *context;
+} SortOrder;
+
+static inline bool sortBefore(const SortOrder *order, SortObject a, SortObject b)
+{
+    return (*order->comparator)(a, b, order->context) < 0;
+}
+
+static inline void sortSwap(SortObject *a, SortObject *b)
+{
+    SortObject object = *a;
+
+    *a = *b;
+    *b = object;
+}
+
+static void insertionSort(SortObject *objects, unsigned int n, const SortOrder *order)
+{
+    for (unsigned int i = 1; i < n; i++) {
+        SortObject object = objects[i];
+        unsigned int j;
+
+        for (j = i; j > 0 && sortBefore(order, object, objects[j - 1]); j--)
+            objects[j] = objects[j - 1];
+        objects[j] = object;
+    }
+}
+
+static void siftDown(SortObject *objects, unsigned int root, unsigned int n,
+                     const SortOrder *order)
+{
+    SortObject object = objects[root];
+    unsigned int child;
+
+    while ((child = 2 * root + 1) < n) {
+        if (child + 1 < n && sortBefore(order, objects[child], objects[child + 1]))
+            child++;
+        if (!sortBefore(order, object, objects[child]))
+            break;
+        objects[root] = objects[child];
+        root = child;
+    }
+    objects[root] = object;
+}
+
+static void heapSort(SortObject *objects, unsigned int n, const SortOrder *order)
+{
+    for (unsigned int i = n / 2; i > 0; i--)
+        siftDown(objects, i - 1, n, order);
+
+    for (unsigned int end = n - 1; end > 0; end--) {
+        sortSwap(&objects[0], &objects[end]);
+        siftDown(objects, 0, end, order);
+    }
+}
+
+static void introSort(SortObject *objects, unsigned int n, unsigned int depth,
+                      const SortOrder *order)
+{
+    while (n > kSortShortRun) {
+        unsigned int mid = (n - 1) / 2;
+        SortObject pivot;
+        long i = -1, j = n;
+
+        if (!depth--) {
+            heapSort(objects, n, order);
+            return;
+        }
+
+        // median of three, which also keeps both scans in bounds
+        if (sortBefore(order, objects[mid], objects[0]))
+            sortSwap(&objects[mid], &objects[0]);
+        if (sortBefore(order, objects[n - 1], objects[mid])) {
+            sortSwap(&objects[n - 1], &objects[mid]);
+            if (sortBefore(order, objects[mid], objects[0]))
+                sortSwap(&objects[mid], &objects[0]);
+        }
+        pivot = objects[mid];
+
+        // Hoare partition into [0, j] and (j, n), neither empty
+        for (;;) {
+            do i++; while (sortBefore(order, objects[i], pivot));
+            do j--; while (sortBefore(order, pivot, objects[j]));
+            if (i >= j)
+                break;
+            sortSwap(&objects[i], &objects[j]);
+        }
+
+        // recurse into the smaller side, loop on the larger
+        if ((unsigned int) j + 1 < n - (unsigned int) j - 1) {
+            introSort(objects, (unsigned int) j + 1, depth, order);
+            objects += j + 1;
+            n -= (unsigned int) j + 1;
+        } else {
+            introSort(&objects[j + 1], n - (unsigned int) j - 1, depth, order);
+            n = (unsigned int) j + 1;
+        }
+    }
+
+    insertionSort(objects, n, order);
+}
+
+static void sortObjects(SortObject *objects, unsigned int n, const SortOrder *order)
+{
+    unsigned int depth = 0;
+
+    for (unsigned int m = n; m > 1; m >>= 1)
+        depth += 2;
+    introSort(objects, n, depth, order);
+}
+
+typedef struct {
+    SortOrder     order;
+    SortObject   *from;
+    SortObject   *to;
+    unsigned int  count;
+    unsigned int  runs;
+    unsigned int  width;        // runs on each side of a merge
+} SortContext;
+
+static inline unsigned int runStart(const SortContext *sc, unsigned int run)
+{
+    if (run >= sc->runs)
+        return sc->count;
+    return (unsigned int) ((u_int64_t) sc->count * run / sc->runs);
+}
+
+static void sortTask(void *context, unsigned int task)
+{
+    SortContext *sc = (SortContext *) context;
+    unsigned int start = runStart(sc, task);
+
+    sortObjects(&sc->from[start], runStart(sc, task + 1) - start, &sc->order);
+}
+
+static void mergeTask(void *context, unsigned int task)
+{
+    SortContext *sc = (SortContext *) context;
+    unsigned int first = 2 * task * sc->width;
+    unsigned int i = runStart(sc, first);
+    unsigned int middle = runStart(sc, first + sc->width);
+    unsigned int end = runStart(sc, first + 2 * sc->width);
+    unsigned int j = middle, k = i;
+
+    // left first on ties
+    while (i < middle && j < end) {
+        if (sortBefore(&sc->order, sc->from[j], sc->from[i]))
+            sc->to[k++] = sc->from[j++];
+        else
+            sc->to[k++] = sc->from[i++];
+    }
+    bcopy(&sc->from[i], &sc->to[k], (middle - i) * sizeof(SortObject));
+    k += middle - i;
+    bcopy(&sc->from[j], &sc->to[k], (end - j) * sizeof(SortObject));
+}
+
+static void runTasks(OSCollectionExecutor executor, void *ref, unsigned int count,
+                     OSCollectionWork work, SortContext *sc)
+{
+    if (executor)
+        executor(ref, count, work, sc);
+    else {
+        for (unsigned int task = 0; task < count; task++)
+            work(sc, task);
+    }
+}
+
+void OSArray::sortUsingFunction(OSOrderFunction comparator, void *context)
+{
+    SortOrder order = { comparator, context };
+
+    if (!comparator)
+        return;
+
+    haveUpdated();
+    sortObjects(array, count, &order);
+}
+
+void OSArray::sortUsingFunction(OSOrderFunction comparator, void *context,
+                                OSCollectionExecutor executor, void *ref,
+                                unsigned int taskCount)
+{
+    SortContext sc;
+    SortObject *buffer;
+
+    if (taskCount > count / kSortMinTaskRun)
+        taskCount = count / kSortMinTaskRun;
+    if (!comparator || taskCount < 2
+     || !(buffer = (SortObject *) kalloc(count * sizeof(SortObject)))) {
+        sortUsingFunction(comparator, context);
+        return;
+    }
+
+    haveUpdated();
+
+    sc.order.comparator = comparator;
+    sc.order.context = context;
+    sc.from = array;
+    sc.to = buffer;
+    sc.count = count;
+    sc.runs = taskCount;
+    runTasks(executor, ref, taskCount, sortTask, &sc);
+
+    for (sc.width = 1; sc.width < sc.runs; sc.width *= 2) {
+        SortObject *from = sc.from;
+
+        runTasks(executor, ref, (sc.runs + 2 * sc.width - 1) / (2 * sc.width),
+                 mergeTask, &sc);
+        sc.from = sc.to;
+        sc.to = from;
+    }
+
+    if (sc.from != array)
+        bcopy(sc.from, array, count * sizeof(SortObject));
+    kfree(buffer, count * sizeof(SortObject));
+}
+
+// The first index whose object doesn't come before anObject, or with
+// after set, the first that comes after it.
+static unsigned int searchSorted(SortObject *objects, unsigned int n,
+                                 SortObject anObject, const SortOrder *order,
+                                 bool after)
+{
+    unsigned int low = 0, high = n;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        int32_t result = (*order->comparator)(objects[mid], anObject, order->context);
+
+        if (result < 0 || (after && !result))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+unsigned int OSArray::getIndexOfSortedObject(const OSMetaClassBase *anObject,
+                                             OSOrderFunction comparator,
+                                             void *context) const
+{
+    SortOrder order = { comparator, context };
+    unsigned int index;
+
+    if (!anObject || !comparator)
+        return (unsigned int) -1;
+
+    index = searchSorted(array, count, anObject, &order, false);
+    if (index < count && !(*comparator)(array[index], anObject, context))
+        return index;
+
+    return (unsigned int) -1;
+}
+
+bool OSArray::setSortedObject(const OSMetaClassBase *anObject,
+                              OSOrderFunction comparator, void *context)
+{
+    SortOrder order = { comparator, context };
+
+    if (!anObject || !comparator)
+        return false;
+
+    return setObject(searchSorted(array, count, anObject, &order, true), anObject);
+}
+
 unsigned int OSArray::iteratorSize() const
 {
     return sizeof(unsigned int);
@@ -366,6 +703,16 @@ bool OSArray::getNextObjectForIterator(void *inIterator, OSObject **ret) const
 bool OSArray::serialize(OSSerialize *s) const
 {
     if (s->previouslySerialized(this)) return true;
+    if (s->cacheCollection(this)) return s->addCachedCollection(this);
+
+    if (s->isBinary()) {
+        if (!s->addBinaryObject(kOSSerializeArray, count, 0)) return false;
+
+        for (unsigned i = 0; i < count; i++) {
+            if (!s->addBinaryMember(array[i], i + 1 == count)) return false;
+        }
+        return true;
+    }
     
     if (!s->addXMLStartTag(this, "array")) return false;
 	
@@ -58,6 +58,26 @@ protected:
     virtual bool getNextObjectForIterator(void * iterator, OSObject ** ret) const;
 	
 public:
+   /*!
+    * @typedef OSOrderFunction
+    *
+    * @abstract
+    * The comparator used to sort an OSArray,
+    * of the same type as OSOrderedSet's.
+    *
+    * @param obj1     An object from the array.
+    * @param obj2     Another object, or the one being looked for.
+    * @param context  The context given with the function.
+    *
+    * @result
+    * A negative value if <code>obj1</code> should come before
+    * <code>obj2</code>, a positive value if after,
+    * and 0 if they are equivalent.
+    */
+    typedef int32_t (*OSOrderFunction)(const OSMetaClassBase * obj1,
+                                      const OSMetaClassBase * obj2,
+                                      void * context);
+
     static OSArray * withCapacity(unsigned int capacity);
     static OSArray * withObjects(
 								 const OSObject * objects[],
@@ -106,13 +126,185 @@ public:
 
     OSCollection * copyCollection(OSDictionary * cycleDict = 0);
 	
-    OSMetaClassDeclareReservedUnused(OSArray, 0);
-    OSMetaClassDeclareReservedUnused(OSArray, 1);
-    OSMetaClassDeclareReservedUnused(OSArray, 2);
-    OSMetaClassDeclareReservedUnused(OSArray, 3);
-    OSMetaClassDeclareReservedUnused(OSArray, 4);
-    OSMetaClassDeclareReservedUnused(OSArray, 5);
-    OSMetaClassDeclareReservedUnused(OSArray, 6);
+    OSMetaClassDeclareReservedUsed(OSArray, 0);
+
+   /*!
+    * @function setObjects
+    *
+    * @abstract
+    * Adds objects to the end of the array.
+    *
+    * @param objects  The objects to add, none of them <code>NULL</code>.
+    * @param count    The number of objects.
+    *
+    * @result
+    * <code>true</code> if all were added, <code>false</code> otherwise,
+    * in which case the array is unchanged.
+    *
+    * @discussion
+    * Equivalent to calling <code>setObject</code> for each object,
+    * but the array is grown at most once and reported updated once.
+    * The objects are retained.
+    */
+    virtual bool setObjects(
+        const OSMetaClassBase * const * objects,
+        unsigned int                    count);
+
+    OSMetaClassDeclareReservedUsed(OSArray, 1);
+
+   /*!
+    * @function setObjects
+    *
+    * @abstract
+    * Inserts objects at a given index.
+    *
+    * @param index    Where the first object goes, at most
+    *                 <code>getCount()</code>.
+    * @param objects  The objects to insert, none of them <code>NULL</code>.
+    * @param count    The number of objects.
+    *
+    * @result
+    * <code>true</code> if all were inserted, <code>false</code> otherwise,
+    * in which case the array is unchanged.
+    *
+    * @discussion
+    * The objects at and after <code>index</code> move up by
+    * <code>count</code> in one block move.
+    * <code>objects</code> may point into the array itself
+    * only when inserting at the end.
+    */
+    virtual bool setObjects(
+        unsigned int                    index,
+        const OSMetaClassBase * const * objects,
+        unsigned int                    count);
+
+    OSMetaClassDeclareReservedUsed(OSArray, 2);
+
+   /*!
+    * @function removeObjects
+    *
+    * @abstract
+    * Removes a range of objects from the array.
+    *
+    * @param index      The index of the first object to remove.
+    * @param length     The number of objects to remove;
+    *                   the range is cut short at the end of the array.
+    * @param keepOrder  If <code>false</code>, the hole is filled with
+    *                   objects from the end of the array instead of
+    *                   moving everything after it down.
+    *
+    * @discussion
+    * The objects removed are released.
+    * With <code>keepOrder</code> the objects after the range move down
+    * in one block move, so removing <i>k</i> objects costs the same
+    * as removing one.
+    * Without it, at most <code>length</code> objects move,
+    * however long the array.
+    */
+    virtual void removeObjects(
+        unsigned int index,
+        unsigned int length,
+        bool         keepOrder = true);
+
+    OSMetaClassDeclareReservedUsed(OSArray, 3);
+
+   /*!
+    * @function sortUsingFunction
+    *
+    * @abstract
+    * Sorts the array.
+    *
+    * @param comparator  Orders two objects: negative if the first
+    *                    should come before the second,
+    *                    positive if after, 0 if either will do.
+    * @param context     Passed on to <code>comparator</code>.
+    *
+    * @discussion
+    * An introsort: quicksort that falls back to heapsort
+    * if it recurses too deep, so never worse than <i>n</i> log <i>n</i>.
+    * Objects that compare equal may end up in any order.
+    */
+    virtual void sortUsingFunction(
+        OSOrderFunction   comparator,
+        void            * context);
+
+    OSMetaClassDeclareReservedUsed(OSArray, 4);
+
+   /*!
+    * @function sortUsingFunction
+    *
+    * @abstract
+    * Sorts the array, splitting the work across an executor.
+    *
+    * @param comparator  As for the other <code>sortUsingFunction</code>.
+    * @param context     Passed on to <code>comparator</code>.
+    * @param executor    Runs the tasks; <code>NULL</code> runs them in turn.
+    * @param ref         Passed on to <code>executor</code>.
+    * @param taskCount   How many runs to split the array into.
+    *
+    * @discussion
+    * Each task sorts a run of the array,
+    * then the runs are merged in pairs, a round of tasks at a time,
+    * through a buffer as large as the array.
+    * Small arrays, or a buffer that can't be had,
+    * get the single threaded sort instead.
+    * <code>comparator</code> must be safe to call on several threads
+    * at once, and the array must not change while this runs.
+    */
+    virtual void sortUsingFunction(
+        OSOrderFunction        comparator,
+        void                 * context,
+        OSCollectionExecutor   executor,
+        void                 * ref,
+        unsigned int           taskCount);
+
+    OSMetaClassDeclareReservedUsed(OSArray, 5);
+
+   /*!
+    * @function getIndexOfSortedObject
+    *
+    * @abstract
+    * Finds an object in a sorted array by binary search.
+    *
+    * @param anObject    The object to look for.
+    * @param comparator  The function the array is sorted by.
+    * @param context     Passed on to <code>comparator</code>.
+    *
+    * @result
+    * The index of the first object that compares equal to
+    * <code>anObject</code>, or -1 if there is none.
+    */
+    virtual unsigned int getIndexOfSortedObject(
+        const OSMetaClassBase * anObject,
+        OSOrderFunction         comparator,
+        void                  * context) const;
+
+    OSMetaClassDeclareReservedUsed(OSArray, 6);
+
+   /*!
+    * @function setSortedObject
+    *
+    * @abstract
+    * Adds an object to a sorted array where it belongs.
+    *
+    * @param anObject    The object to add.
+    * @param comparator  The function the array is sorted by.
+    * @param context     Passed on to <code>comparator</code>.
+    *
+    * @result
+    * <code>true</code> if the object was added,
+    * <code>false</code> otherwise.
+    *
+    * @discussion
+    * The place is found by binary search, behind any objects
+    * that compare equal, so objects added this way keep their order.
+    * The object is retained.
+    */
+    virtual bool setSortedObject(
+        const OSMetaClassBase * anObject,
+        OSOrderFunction         comparator,
+        void                  * context);
+
     OSMetaClassDeclareReservedUnused(OSArray, 7);
 };
 
@@ -28,6 +28,7 @@
 /* IOArray.h created by rsulack on Thu 11-Sep-1997 */
 
 #include "OSCollection.h"
+#include "OSSerialize.h"
 
 #define super OSObject
 
@@ -36,13 +37,22 @@ OSDefineMetaClassAndAbstractStructors(OSCollection, OSObject)
 
 OSMetaClassDefineReservedUsed(OSCollection, 0)
 OSMetaClassDefineReservedUsed(OSCollection, 1)
-OSMetaClassDefineReservedUnused(OSCollection, 2)
+OSMetaClassDefineReservedUsed(OSCollection, 2)
 OSMetaClassDefineReservedUnused(OSCollection, 3)
 OSMetaClassDefineReservedUnused(OSCollection, 4)
 OSMetaClassDefineReservedUnused(OSCollection, 5)
 OSMetaClassDefineReservedUnused(OSCollection, 6)
 OSMetaClassDefineReservedUnused(OSCollection, 7)
 
+#if OSALLOCDEBUG
+extern "C" {
+    extern int debug_container_malloc_size;
+};
+#define ACCUMSIZE(s) do { debug_container_malloc_size += (s); } while(0)
+#else
+#define ACCUMSIZE(s)
+#endif
+
 bool OSCollection::init()
 {
     if (!super::init())
@@ -62,6 +72,40 @@ void OSCollection::haveUpdated()
     updateStamp++;
 }
 
+void OSCollection::free()
+{
+    if (fReserved) {
+        flushSerializeCache();
+        kfree(fReserved, sizeof(ExpansionData));
+        ACCUMSIZE( -sizeof(ExpansionData) );
+    }
+
+    super::free();
+}
+
+void OSCollection::flushSerializeCache()
+{
+    OSSerializeFragment *fragments[2];
+
+    if (!fReserved)
+        return;
+
+    while (!OSAtomicCompareAndSwap32(0, 1, &fReserved->gate))
+        ;
+    for (unsigned int i = 0; i < 2; i++) {
+        fragments[i] = fReserved->fragments[i];
+        fReserved->fragments[i] = 0;
+    }
+    OSMemoryBarrier();
+    fReserved->gate = 0;
+
+    // a pass splicing one in holds a reference, and the last one frees it
+    for (unsigned int i = 0; i < 2; i++) {
+        if (fragments[i])
+            OSSerialize::releaseFragment(fragments[i]);
+    }
+}
+
 unsigned OSCollection::setOptions(unsigned options, unsigned mask, void *)
 {
     unsigned old = fOptions;
@@ -69,9 +113,64 @@ unsigned OSCollection::setOptions(unsigned options, unsigned mask, void *)
     if (mask)
 	fOptions = (old & ~mask) | (options & mask);
 
+    // a copy taken while immutable is as good as stale once it is not
+    if (old & ~fOptions & (kImmutable | kCacheSerialization))
+        flushSerializeCache();
+
+    if ((fOptions & kCacheSerialization) && !fReserved) {
+        fReserved = (ExpansionData *) kalloc(sizeof(ExpansionData));
+        if (fReserved) {
+            bzero(fReserved, sizeof(ExpansionData));
+            ACCUMSIZE(sizeof(ExpansionData));
+        }
+    }
+
     return old;
 }
 
+bool OSCollection::setGrowthPolicy(unsigned int policy, unsigned int percent)
+{
+    switch (policy) {
+    case kGrowthLinear:
+        fGrowthPercent = 0;
+        return true;
+    case kGrowthGeometric:
+        if (percent <= 100)
+            return false;
+        fGrowthPercent = percent;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * The capacity ensureCapacity() should grow to, from current to at least
+ * wanted elements, or 0 if that many would not fit in memory.
+ */
+unsigned int OSCollection::growCapacity(unsigned int current, unsigned int wanted,
+                                        unsigned int increment, size_t elementSize) const
+{
+    u_int64_t limit = ((unsigned int) -1) / elementSize;
+    u_int64_t grown = wanted;
+
+    if (fGrowthPercent) {
+        u_int64_t scaled = (u_int64_t) current * fGrowthPercent / 100;
+
+        if (scaled > grown)
+            grown = scaled;
+    }
+
+    if (!increment)
+        increment = 1;
+    grown = ((grown + increment - 1) / increment) * increment;
+
+    if (grown > limit)
+        grown = limit;
+
+    return (grown >= wanted) ? (unsigned int) grown : 0;
+}
+
 OSCollection *  OSCollection::copyCollection(OSDictionary *cycleDict)
 {
     panic("%s", __FUNCTION__);
@@ -4,20 +4,64 @@
 #include "OSObject.h"
 
 class OSDictionary;
+struct OSSerializeFragment;
+
+/*!
+ * @typedef OSCollectionWork
+ *
+ * @abstract
+ * One of the tasks an
+ * @link OSCollectionExecutor OSCollectionExecutor@/link runs.
+ *
+ * @param context The context passed to the executor.
+ * @param index   Which task to run.
+ */
+typedef void (*OSCollectionWork)(void * context, unsigned int index);
+
+/*!
+ * @typedef OSCollectionExecutor
+ *
+ * @abstract
+ * Runs the tasks of an operation split across threads,
+ * such as a parallel sort or serialization.
+ *
+ * @param ref     The reference the caller passed with the executor.
+ * @param count   The number of tasks.
+ * @param work    The function to call for each task.
+ * @param context Passed on to <code>work</code>.
+ *
+ * @discussion
+ * The executor calls <code>work(context, i)</code>
+ * for every <code>i</code> below <code>count</code>,
+ * in any order and on any threads,
+ * and returns once all of the calls have returned.
+ */
+typedef void (*OSCollectionExecutor)(
+    void             * ref,
+    unsigned int       count,
+    OSCollectionWork   work,
+    void             * context);
 
 class OSCollection : public OSObject
 {
     friend class OSCollectionIterator;
+    friend class OSSerialize;
 
     OSDeclareAbstractStructors(OSCollection)
 
-    struct ExpansionData { };
+    struct ExpansionData {
+        // cached serializations, XML and binary, owned by OSSerialize
+        OSSerializeFragment * volatile fragments[2];
+        volatile u_int32_t  gate;   // held to swap or take a reference to one
+    };
     
 protected:
     unsigned int updateStamp;
 
 private:
     unsigned int fOptions;
+    ExpansionData * fReserved;
+    unsigned int fGrowthPercent;    // 0 for linear growth
 
 protected:
     virtual unsigned int iteratorSize() const = 0;
@@ -27,13 +71,51 @@ protected:
         OSObject ** nextObject) const = 0;
 
     virtual bool init();
+    virtual void free();
+    void flushSerializeCache();
+    unsigned int growCapacity(
+        unsigned int current,
+        unsigned int wanted,
+        unsigned int increment,
+        size_t       elementSize) const;
 
 public:
+   /*!
+    * @enum _OSCollectionFlags
+    *
+    * @constant kImmutable
+    * The collection may not change; <code>haveUpdated</code> panics.
+    *
+    * @constant kCacheSerialization
+    * While the collection is also immutable, OSSerialize keeps a copy
+    * of its serialized form and splices that in
+    * instead of walking the collection again.
+    * The copy is dropped once either flag is cleared.
+    */
     typedef enum {
-        kImmutable  = 0x00000001,
-        kMASK       = (unsigned) -1
+        kImmutable          = 0x00000001,
+        kCacheSerialization = 0x00000002,
+        kMASK               = (unsigned) -1
     } _OSCollectionFlags;
 
+   /*!
+    * @enum _OSCollectionGrowth
+    *
+    * @constant kGrowthLinear
+    * <code>ensureCapacity</code> rounds up to the next multiple
+    * of the capacity increment, so appending n objects one at a time
+    * copies O(n<sup>2</sup> / increment) pointers.  The default.
+    *
+    * @constant kGrowthGeometric
+    * <code>ensureCapacity</code> grows the capacity by a factor
+    * and then rounds up as for <code>kGrowthLinear</code>,
+    * so appending n objects copies O(n) pointers.
+    */
+    typedef enum {
+        kGrowthLinear    = 0,
+        kGrowthGeometric = 1
+    } _OSCollectionGrowth;
+
     void haveUpdated();
     virtual unsigned int getCount() const = 0;
     virtual unsigned int getCapacity() const = 0;
@@ -51,7 +133,28 @@ public:
     OSMetaClassDeclareReservedUsed(OSCollection, 1)
 
 
-    OSMetaClassDeclareReservedUnused(OSCollection, 2);
+    OSMetaClassDeclareReservedUsed(OSCollection, 2);
+
+   /*!
+    * @function setGrowthPolicy
+    *
+    * @abstract
+    * Selects how the collection grows its storage.
+    *
+    * @param policy  <code>kGrowthLinear</code> or <code>kGrowthGeometric</code>.
+    * @param percent For <code>kGrowthGeometric</code>,
+    *                the new capacity as a percentage of the old one;
+    *                more than 100.
+    *
+    * @result
+    * <code>true</code> if the policy is valid and now in effect.
+    *
+    * @discussion
+    * Either way, growing first tries to extend the storage in place,
+    * which the zone allocator can do while the new size
+    * stays within the same size class.
+    */
+    virtual bool setGrowthPolicy(unsigned int policy, unsigned int percent = 200);
     OSMetaClassDeclareReservedUnused(OSCollection, 3);
     OSMetaClassDeclareReservedUnused(OSCollection, 4);
     OSMetaClassDeclareReservedUnused(OSCollection, 5);
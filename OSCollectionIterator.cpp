@@ -30,6 +30,7 @@
 #include "OSCollectionIterator.h"
 #include "OSArray.h"
 #include "OSCollection.h"
+#include "OSZone.h"
 
 #define super OSIterator
 
@@ -75,7 +76,7 @@ OSCollectionIterator::withCollection(const OSCollection *inColl)
 void OSCollectionIterator::free()
 {
     if (collIterator) {
-        kfree(collIterator, collection->iteratorSize());
+        OSZoneFree(collIterator, collection->iteratorSize());
 	ACCUMSIZE(-(collection->iteratorSize()));
         collIterator = 0;
     }
@@ -93,7 +94,7 @@ void OSCollectionIterator::reset()
     valid = false;
 
     if (!collIterator) {
-        collIterator = (void *)kalloc(collection->iteratorSize());
+        collIterator = (void *)OSZoneAlloc(collection->iteratorSize());
 	ACCUMSIZE(collection->iteratorSize());
         if (!collIterator)
             return;
@@ -109,7 +110,7 @@ void OSCollectionIterator::reset()
 bool OSCollectionIterator::isValid()
 {
     if (!collIterator) {
-        collIterator = (void *)kalloc(collection->iteratorSize());
+        collIterator = (void *)OSZoneAlloc(collection->iteratorSize());
 	ACCUMSIZE(collection->iteratorSize());
         if (!collection->initIterator(collIterator))
             return false;
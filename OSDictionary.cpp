@@ -34,6 +34,8 @@
 #include "OSString.h"
 #include "OSSymbol.h"
 #include "OSCollectionIterator.h"
+#include "OSSerialize.h"
+#include "OSZone.h"
 
 #define super OSCollection
 
@@ -59,6 +61,179 @@ extern "C" {
 #define EXT_CAST(obj) \
     reinterpret_cast<OSObject *>(const_cast<OSMetaClassBase *>(obj))
 
+// A dictEntry is a key and a value pointer, so count entries can be
+// handed to the batch retain and release as 2 * count objects.
+#define entryObjects(entries) \
+    ((const OSMetaClassBase * const *) (const void *) (entries))
+
+/*
+ * Hashed index.
+ *
+ * Dictionaries with fewer than kHashIndexThreshold keys are searched
+ * linearly.  Past that an open-addressed table, keyed on the OSSymbol
+ * pointer and probed linearly, maps keys to their slot in dictionary[].
+ * dictionary[] stays the authoritative store so iteration order is
+ * untouched.  The table is kept at most half full.  removeObject deletes
+ * the key's slot by shifting the run after it back, then renumbers the
+ * slots of the entries it shifts down in dictionary[], so a removal costs
+ * the shift it already did rather than a pass over the whole table.
+ */
+#define HASH_INDEX_MIN_SIZE (2 * kHashIndexThreshold)
+
+static inline unsigned int hashKeyPointer(const OSSymbol *aKey)
+{
+    u_int64_t h = (u_int64_t) (uintptr_t) aKey;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (unsigned int) h;
+}
+
+unsigned int OSDictionary::findEntry(const OSSymbol *aKey) const
+{
+    if (reserved && reserved->hashIndex) {
+        const unsigned int *index = reserved->hashIndex;
+        unsigned int mask = reserved->hashIndexSize - 1;
+        unsigned int slot = hashKeyPointer(aKey) & mask;
+        unsigned int entry;
+
+        while ( (entry = index[slot]) ) {
+            if (aKey == dictionary[entry - 1].key)
+                return entry - 1;
+            slot = (slot + 1) & mask;
+        }
+        return (unsigned int) -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+        if (aKey == dictionary[i].key)
+            return i;
+
+    return (unsigned int) -1;
+}
+
+void OSDictionary::addHashEntry(unsigned int entryIndex)
+{
+    if (!reserved || !reserved->hashIndex) {
+        if (count >= kHashIndexThreshold)
+            rebuildHashIndex();
+        return;
+    }
+
+    if (count * 2 > reserved->hashIndexSize) {
+        rebuildHashIndex();
+        return;
+    }
+
+    unsigned int *index = reserved->hashIndex;
+    unsigned int mask = reserved->hashIndexSize - 1;
+    unsigned int slot = hashKeyPointer(dictionary[entryIndex].key) & mask;
+
+    while (index[slot])
+        slot = (slot + 1) & mask;
+    index[slot] = entryIndex + 1;
+}
+
+/*
+ * Empties the slot of dictionary[entryIndex], moving back any later slot
+ * in its run that would otherwise no longer be found from its home slot.
+ */
+void OSDictionary::removeHashEntry(unsigned int entryIndex)
+{
+    unsigned int *index = reserved->hashIndex;
+    unsigned int mask = reserved->hashIndexSize - 1;
+    unsigned int slot = hashKeyPointer(dictionary[entryIndex].key) & mask;
+    unsigned int next;
+
+    while (index[slot] != entryIndex + 1)
+        slot = (slot + 1) & mask;
+    index[slot] = 0;
+
+    for (next = (slot + 1) & mask; index[next]; next = (next + 1) & mask) {
+        unsigned int home = hashKeyPointer(dictionary[index[next] - 1].key) & mask;
+
+        // leave it if its home is in (slot, next], wrapping around
+        if ((slot < next) ? (slot < home && home <= next)
+                          : (slot < home || home <= next))
+            continue;
+
+        index[slot] = index[next];
+        index[next] = 0;
+        slot = next;
+    }
+}
+
+/*
+ * Points the slot of the entry that was at dictionary[from], and is now
+ * at dictionary[to], at its new place.
+ */
+void OSDictionary::moveHashEntry(unsigned int from, unsigned int to)
+{
+    unsigned int *index = reserved->hashIndex;
+    unsigned int mask = reserved->hashIndexSize - 1;
+    unsigned int slot = hashKeyPointer(dictionary[to].key) & mask;
+
+    while (index[slot] != from + 1)
+        slot = (slot + 1) & mask;
+    index[slot] = to + 1;
+}
+
+void OSDictionary::rebuildHashIndex()
+{
+    unsigned int newSize = HASH_INDEX_MIN_SIZE;
+    unsigned int *index;
+    unsigned int mask;
+
+    while (newSize < count * 2)
+        newSize <<= 1;
+
+    if (!reserved) {
+        reserved = (ExpansionData *) OSZoneAlloc(sizeof(ExpansionData));
+        if (!reserved)
+            return;
+        bzero(reserved, sizeof(ExpansionData));
+        ACCUMSIZE(sizeof(ExpansionData));
+    }
+
+    // Reuse the current table unless it is too small or far too big.
+    if (reserved->hashIndex
+    &&  (newSize > reserved->hashIndexSize
+      || newSize * 4 < reserved->hashIndexSize))
+        freeHashIndex();
+
+    if (!reserved->hashIndex) {
+        reserved->hashIndex = (unsigned int *) OSZoneAlloc(newSize * sizeof(unsigned int));
+        if (!reserved->hashIndex)
+            return;	// stay linear
+        ACCUMSIZE(newSize * sizeof(unsigned int));
+        reserved->hashIndexSize = newSize;
+    }
+
+    index = reserved->hashIndex;
+    mask = reserved->hashIndexSize - 1;
+    bzero(index, reserved->hashIndexSize * sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int slot = hashKeyPointer(dictionary[i].key) & mask;
+
+        while (index[slot])
+            slot = (slot + 1) & mask;
+        index[slot] = i + 1;
+    }
+}
+
+void OSDictionary::freeHashIndex()
+{
+    if (reserved && reserved->hashIndex) {
+        OSZoneFree(reserved->hashIndex, reserved->hashIndexSize * sizeof(unsigned int));
+        ACCUMSIZE(-(reserved->hashIndexSize * sizeof(unsigned int)));
+        reserved->hashIndex = 0;
+        reserved->hashIndexSize = 0;
+    }
+}
+
 bool OSDictionary::initWithCapacity(unsigned int inCapacity)
 {
     if (!super::init())
@@ -66,7 +241,7 @@ bool OSDictionary::initWithCapacity(unsigned int inCapacity)
 
     int size = inCapacity * sizeof(dictEntry);
 
-    dictionary = (dictEntry *) kalloc(size);
+    dictionary = (dictEntry *) OSZoneAlloc(size);
     if (!dictionary)
         return false;
 
@@ -170,10 +345,11 @@ bool OSDictionary::initWithDictionary(const OSDictionary *dict,
 
     count = dict->count;
     bcopy(dict->dictionary, dictionary, count * sizeof(dictEntry));
-    for (unsigned int i = 0; i < count; i++) {
-        dictionary[i].key->taggedRetain(OSTypeID(OSCollection));
-        dictionary[i].value->taggedRetain(OSTypeID(OSCollection));
-    }
+    OSObject::taggedRetainObjects(entryObjects(dictionary), 2 * count,
+                                  OSTypeID(OSCollection));
+
+    if (count >= kHashIndexThreshold)
+        rebuildHashIndex();
 
     return true;
 }
@@ -238,9 +414,13 @@ void OSDictionary::free()
     (void) super::setOptions(0, kImmutable);
     flushCollection();
     if (dictionary) {
-        kfree(dictionary, capacity * sizeof(dictEntry));
+        OSZoneFree(dictionary, capacity * sizeof(dictEntry));
         ACCUMSIZE( -(capacity * sizeof(dictEntry)) );
     }
+    if (reserved) {
+        OSZoneFree(reserved, sizeof(ExpansionData));
+        ACCUMSIZE( -sizeof(ExpansionData) );
+    }
 
     super::free();
 }
@@ -263,29 +443,35 @@ unsigned int OSDictionary::setCapacityIncrement(unsigned int increment)
 unsigned int OSDictionary::ensureCapacity(unsigned int newCapacity)
 {
     dictEntry *newDict;
-    int oldSize, newSize;
+    size_t oldSize, newSize;
 
     if (newCapacity <= capacity)
         return capacity;
 
-    // round up
-    newCapacity = (((newCapacity - 1) / capacityIncrement) + 1)
-                * capacityIncrement;
+    newCapacity = growCapacity(capacity, newCapacity, capacityIncrement,
+                               sizeof(dictEntry));
+    if (!newCapacity)
+        return capacity;
+    oldSize = sizeof(dictEntry) * capacity;
     newSize = sizeof(dictEntry) * newCapacity;
 
-    newDict = (dictEntry *) kalloc(newSize);
-    if (newDict) {
-        oldSize = sizeof(dictEntry) * capacity;
+    if (OSZoneExtend(dictionary, oldSize, newSize))
+        newDict = dictionary;
+    else {
+        newDict = (dictEntry *) OSZoneAlloc(newSize);
+        if (!newDict)
+            return capacity;
 
         bcopy(dictionary, newDict, oldSize);
-        bzero(&newDict[capacity], newSize - oldSize);
+        OSZoneFree(dictionary, oldSize);
+    }
 
-        ACCUMSIZE(newSize - oldSize);
-        kfree(dictionary, oldSize);
+    bzero(&newDict[capacity], newSize - oldSize);
 
-        dictionary = newDict;
-        capacity = newCapacity;
-    }
+    ACCUMSIZE(newSize - oldSize);
+
+    dictionary = newDict;
+    capacity = newCapacity;
 
     return capacity;
 }
@@ -294,33 +480,33 @@ void OSDictionary::flushCollection()
 {
     haveUpdated();
 
-    for (unsigned int i = 0; i < count; i++) {
-        dictionary[i].key->taggedRelease(OSTypeID(OSCollection));
-        dictionary[i].value->taggedRelease(OSTypeID(OSCollection));
-    }
+    OSObject::taggedReleaseObjects(entryObjects(dictionary), 2 * count,
+                                   OSTypeID(OSCollection));
     count = 0;
+    freeHashIndex();
 }
 
 
 bool OSDictionary::
 setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject)
 {
+    unsigned int i;
+
     if (!anObject || !aKey)
         return false;
 
     // if the key exists, replace the object
-    for (unsigned int i = 0; i < count; i++) {
-        if (aKey == dictionary[i].key) {
-            const OSMetaClassBase *oldObject = dictionary[i].value;
+    i = findEntry(aKey);
+    if (i < count) {
+        const OSMetaClassBase *oldObject = dictionary[i].value;
 
-            haveUpdated();
+        haveUpdated();
 
-            anObject->taggedRetain(OSTypeID(OSCollection));
-            dictionary[i].value = anObject;
+        anObject->taggedRetain(OSTypeID(OSCollection));
+        dictionary[i].value = anObject;
 
-            oldObject->taggedRelease(OSTypeID(OSCollection));
-            return true;
-        }
+        oldObject->taggedRelease(OSTypeID(OSCollection));
+        return true;
     }
 
     // add new key, possibly extending our capacity
@@ -334,30 +520,44 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject)
     dictionary[count].key = aKey;
     dictionary[count].value = anObject;
     count++;
+    addHashEntry(count - 1);
 
     return true;
 }
 
 void OSDictionary::removeObject(const OSSymbol *aKey)
 {
+    unsigned int i;
+
     if (!aKey)
         return;
 
     // if the key exists, remove the object
-    for (unsigned int i = 0; i < count; i++)
-        if (aKey == dictionary[i].key) {
-            dictEntry oldEntry = dictionary[i];
-
-            haveUpdated();
-
-            count--;
-            for (; i < count; i++)
-                dictionary[i] = dictionary[i+1];
-
-            oldEntry.key->taggedRelease(OSTypeID(OSCollection));
-            oldEntry.value->taggedRelease(OSTypeID(OSCollection));
-            return;
+    i = findEntry(aKey);
+    if (i < count) {
+        dictEntry oldEntry = dictionary[i];
+
+        bool hashed;
+
+        haveUpdated();
+
+        // too few keys left to be worth the table
+        if (reserved && reserved->hashIndex && count - 1 < kHashIndexThreshold / 2)
+            freeHashIndex();
+        hashed = reserved && reserved->hashIndex;
+        if (hashed)
+            removeHashEntry(i);
+
+        count--;
+        for (; i < count; i++) {
+            dictionary[i] = dictionary[i+1];
+            if (hashed)
+                moveHashEntry(i + 1, i);
         }
+
+        oldEntry.key->taggedRelease(OSTypeID(OSCollection));
+        oldEntry.value->taggedRelease(OSTypeID(OSCollection));
+    }
 }
 
 
@@ -390,13 +590,15 @@ bool OSDictionary::merge(const OSDictionary *srcDict)
 
 OSObject *OSDictionary::getObject(const OSSymbol *aKey) const
 {
+    unsigned int i;
+
     if (!aKey)
         return 0;
 
-    // if the key exists, remove the object
-    for (unsigned int i = 0; i < count; i++)
-        if (aKey == dictionary[i].key)
-            return (const_cast<OSObject *> ((const OSObject *)dictionary[i].value));
+    // if the key exists, return the object
+    i = findEntry(aKey);
+    if (i < count)
+        return (const_cast<OSObject *> ((const OSObject *)dictionary[i].value));
 
     return 0;
 }
@@ -545,7 +747,32 @@ bool OSDictionary::getNextObjectForIterator(void *inIterator, OSObject **ret) co
 
 bool OSDictionary::serialize(OSSerialize *s) const
 {
-    return false;
+    if (s->previouslySerialized(this)) return true;
+    if (s->cacheCollection(this)) return s->addCachedCollection(this);
+
+    if (s->isBinary()) {
+        if (!s->addBinaryObject(kOSSerializeDictionary, count, 0)) return false;
+
+        for (unsigned i = 0; i < count; i++) {
+            if (!s->addBinaryMember(dictionary[i].key, false)) return false;
+            if (!s->addBinaryMember(dictionary[i].value, i + 1 == count)) return false;
+        }
+        return true;
+    }
+
+    if (!s->addXMLStartTag(this, "dict")) return false;
+
+    for (unsigned i = 0; i < count; i++) {
+        const OSSymbol *key = dictionary[i].key;
+
+        if (!s->addStringN("<key>", 5)) return false;
+        if (!s->addXMLString(key->getCStringNoCopy(), key->getLength())) return false;
+        if (!s->addXMLEndTag("key")) return false;
+
+        if (!dictionary[i].value->serialize(s)) return false;
+    }
+
+    return s->addXMLEndTag("dict");
 }
 
 unsigned OSDictionary::setOptions(unsigned options, unsigned mask, void *)
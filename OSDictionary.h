@@ -91,9 +91,12 @@ class OSString;
  * An OSDictionary also grows as necessary to accommodate new key/value pairs,
  * <i>unlike</i> Core Foundation collections (it does not, however, shrink).
  *
- * <b>Note:</b> OSDictionary currently uses a linear search algorithm,
- * and is not designed for high-performance access of many values.
- * It is intended as a simple associative-storage mechanism only.
+ * <b>Note:</b> small dictionaries use a linear search algorithm.
+ * Once a dictionary holds <code>kHashIndexThreshold</code> keys or more,
+ * an open-addressed hash index keyed on the OSSymbol pointer is kept
+ * alongside the key/value array, so lookups stay constant-time.
+ * The index does not affect iteration order,
+ * which is always the order in which keys were first added.
  *
  * <b>Use Restrictions</b>
  *
@@ -124,9 +127,12 @@ protected:
     unsigned int   capacity;
     unsigned int   capacityIncrement;
 
-    struct ExpansionData { };
+    struct ExpansionData {
+        unsigned int * hashIndex;       // slot holds entry index + 1, 0 is empty
+        unsigned int   hashIndexSize;   // power of two, 0 while linear
+    };
 
-   /* Reserved for future use.  (Internal use only)  */
+   /* Hash index, allocated once the dictionary grows.  (Internal use only)  */
     ExpansionData * reserved;
 
     // Member functions used by the OSCollectionIterator class.
@@ -134,6 +140,17 @@ protected:
     virtual bool initIterator(void * iterator) const;
     virtual bool getNextObjectForIterator(void * iterator, OSObject ** ret) const;
 
+private:
+    // Hashed index over dictionary[], see OSDictionary.cpp.
+    enum { kHashIndexThreshold = 16 };
+
+    unsigned int findEntry(const OSSymbol * aKey) const;
+    void         addHashEntry(unsigned int entryIndex);
+    void         removeHashEntry(unsigned int entryIndex);
+    void         moveHashEntry(unsigned int from, unsigned int to);
+    void         rebuildHashIndex();
+    void         freeHashIndex();
+
 public:
 
    /*!
@@ -2,6 +2,7 @@
 #include "OSString.h"
 #include "OSSymbol.h"
 #include "OSDictionary.h"
+#include "OSCollectionIterator.h"
 
 #define IOLockLock(x)
 #define IOLockUnlock(x)
@@ -9,9 +10,16 @@
 static OSDictionary * sAllClassesDict = 0;
 static bool sHasInitialized = false;
 
+/*
+ * Metaclasses constructed since the last postModLoad.  They are built by
+ * static initialisers, in no particular number, so the pool grows on
+ * demand; classInitPoolResult remembers a class that didn't fit.
+ */
 #define INIT_POOL_SIZE 32
-static OSMetaClass* classInitPool[INIT_POOL_SIZE] = {0};
+static OSMetaClass** classInitPool = 0;
 static int classInitPoolCount = 0;
+static int classInitPoolCapacity = 0;
+static OSReturn classInitPoolResult = kOSReturnSuccess;
 
 void OSMetaClassBase::_RESERVEDOSMetaClassBase2()
 { panic("OSMetaClassBase::_RESERVEDOSMetaClassBase%d called.", 2); }
@@ -160,6 +168,11 @@ OSMetaClass::OSMetaClass(
 {
     instanceCount = 0;
     classSize = inClassSize;
+
+    reserved = (ExpansionData *) kalloc(sizeof(ExpansionData));
+    if (reserved)
+        bzero(reserved, sizeof(ExpansionData));
+
     superClassLink = inSuperClass;
 	void** me_vt = (void**)this;
 	
@@ -169,7 +182,22 @@ OSMetaClass::OSMetaClass(
 	 */
     className = (const OSSymbol *)inClassName;
 	
-	assert(classInitPoolCount > INIT_POOL_SIZE);
+	if (classInitPoolCount >= classInitPoolCapacity) {
+		int newCapacity = (classInitPoolCapacity) ? 2 * classInitPoolCapacity : INIT_POOL_SIZE;
+		OSMetaClass** newPool = (OSMetaClass **) kalloc(newCapacity * sizeof(OSMetaClass *));
+		
+		if (!newPool) {
+			printk("%s: no memory to register class\n", inClassName);
+			classInitPoolResult = kOSMetaClassNoTempData;
+			return;
+		}
+		if (classInitPool) {
+			bcopy(classInitPool, newPool, classInitPoolCount * sizeof(OSMetaClass *));
+			kfree(classInitPool, classInitPoolCapacity * sizeof(OSMetaClass *));
+		}
+		classInitPool = newPool;
+		classInitPoolCapacity = newCapacity;
+	}
 	
 	classInitPool[classInitPoolCount] = this;
 	classInitPoolCount++;
@@ -182,6 +210,11 @@ OSMetaClass::OSMetaClass(
 OSMetaClass::~OSMetaClass()
 {
 	/* stuff */
+    if (reserved) {
+        if (reserved->display && reserved->display != reserved->displayInline)
+            kfree(reserved->display, (reserved->classDepth + 1) * sizeof(reserved->display[0]));
+        kfree(reserved, sizeof(ExpansionData));
+    }
 }
 
 /*********************************************************************
@@ -223,9 +256,18 @@ OSMetaClass::checkModLoad(void * loadHandle)
 OSReturn
 OSMetaClass::postModLoad(void * loadHandle)
 {
-	sAllClassesDict = OSDictionary::withCapacity(INIT_POOL_SIZE);
+	OSReturn result = classInitPoolResult;
 	
-	assert(sAllClassesDict);
+	/* keyed by interned name, so lookups use the dictionary's hash index */
+	if (!sAllClassesDict) {
+		sAllClassesDict = OSDictionary::withCapacity(
+			(classInitPoolCount > INIT_POOL_SIZE) ? classInitPoolCount : INIT_POOL_SIZE);
+	} else {
+		sAllClassesDict->ensureCapacity(sAllClassesDict->getCount() + classInitPoolCount);
+	}
+	
+	if (!sAllClassesDict)
+		return kOSMetaClassNoDicts;
 	printk("libkern_init0: class dict = %p\n", sAllClassesDict);
 	
 	printk("libkern_init0: initializing pool classes ...\n");
@@ -242,17 +284,76 @@ OSMetaClass::postModLoad(void * loadHandle)
 		pclass->className = OSSymbol::withCStringNoCopy((const char*)pclass->className);
 		printk("\t * fixed class name (%p)\n", pclass->className);
 		
+		if (sAllClassesDict->getObject(pclass->className)) {
+			printk("\t * duplicate class %s, not registered\n", pclass->getClassName());
+			result = kOSMetaClassDuplicateClass;
+			continue;
+		}
+		
 		sAllClassesDict->setObject(pclass->className, pclass);
 		printk("\t * inserted into class table\n");
 	}
 	
-	return 0;
+	/* every superclass is known now */
+	for (int i = 0; i < classInitPoolCount; i++)
+		classInitPool[i]->initDisplay();
+	
+	/* start over for the next load */
+	classInitPoolCount = 0;
+	classInitPoolResult = kOSReturnSuccess;
+	
+	return result;
 }
 
+/*********************************************************************
+ * Record the class's depth and its display, the array of its ancestors
+ * indexed by depth (Cohen's display technique).  Class A is then an
+ * ancestor of class B exactly when depth(A) <= depth(B) and
+ * B->display[depth(A)] == A, which is what checkMetaCast tests.
+ *********************************************************************/
+void
+OSMetaClass::initDisplay()
+{
+    const OSMetaClass  * meta;
+    const OSMetaClass ** display;
+    unsigned int         depth = 0;
+
+    if (!reserved || reserved->display)
+        return;
+
+    for (meta = superClassLink; meta; meta = meta->superClassLink)
+        depth++;
+
+    display = reserved->displayInline;
+    if (depth >= kDisplayInline) {
+        display = (const OSMetaClass **) kalloc((depth + 1) * sizeof(display[0]));
+        if (!display)
+            return;	// casts involving this class walk the chain instead
+    }
+
+    meta = this;
+    for (unsigned int i = depth + 1; i-- > 0; meta = meta->superClassLink)
+        display[i] = meta;
+
+    reserved->classDepth = depth;
+    reserved->display = display;
+}
+
+/*********************************************************************
+ * Without shards, for a class whose ExpansionData couldn't be had,
+ * instanceCount does the counting; live counts stay exact but there
+ * is no cumulative count.
+ *********************************************************************/
 void
 OSMetaClass::instanceConstructed() const
 {
+    if (reserved) {
+        InstanceShard * shard = &reserved->shards[cpu_number() & (kInstanceShards - 1)];
 
+        OSAtomicAdd64(1, &shard->constructed);
+    } else {
+        OSAtomicAdd32(1, (volatile int32_t *) &instanceCount);
+    }
 }
 
 /*********************************************************************
@@ -260,7 +361,13 @@ OSMetaClass::instanceConstructed() const
 void
 OSMetaClass::instanceDestructed() const
 {
-	
+    if (reserved) {
+        InstanceShard * shard = &reserved->shards[cpu_number() & (kInstanceShards - 1)];
+
+        OSAtomicAdd64(1, &shard->destructed);
+    } else {
+        OSAtomicAdd32(-1, (volatile int32_t *) &instanceCount);
+    }
 }
 
 /*********************************************************************
@@ -373,6 +480,9 @@ OSMetaClass::checkMetaCastWithName(
  * Check to see if the 'check' object has this object in its metaclass chain.
  * Returns check if it is indeed a kind of the current meta class, 0 otherwise.
  *
+ * Once postModLoad has built the class displays this is one bounds check
+ * and one compare; before that, it walks the superclass chain.
+ *
  * Generally this method is not invoked directly but is used to implement
  * the OSMetaClassBase::metaCast member function.
  *
@@ -382,9 +492,19 @@ OSMetaClassBase * OSMetaClass::checkMetaCast(
 											 const OSMetaClassBase * check) const
 {
     const OSMetaClass * const toMeta   = this;
-    const OSMetaClass *       fromMeta;
+    const OSMetaClass *       fromMeta = check->getMetaClass();
+    const ExpansionData *     from     = fromMeta->reserved;
 	
-    for (fromMeta = check->getMetaClass(); ; fromMeta = fromMeta->superClassLink) {
+    if (reserved && reserved->display && from && from->display) {
+        unsigned int depth = reserved->classDepth;
+        
+        if (depth <= from->classDepth && from->display[depth] == toMeta) {
+            return const_cast<OSMetaClassBase *>(check); // Discard const
+        }
+        return 0;
+    }
+	
+    for (; ; fromMeta = fromMeta->superClassLink) {
         if (toMeta == fromMeta) {
             return const_cast<OSMetaClassBase *>(check); // Discard const
         }
@@ -414,10 +534,110 @@ OSMetaClass::getSuperClass() const
     return superClassLink;
 }
 
+/*********************************************************************
+ * Objects may be freed on a different cpu than they were constructed
+ * on, so only the sum over all shards means anything.
+ *********************************************************************/
 unsigned int
 OSMetaClass::getInstanceCount() const
 {
-    return instanceCount;
+    int64_t count = (int32_t) instanceCount;
+
+    if (reserved) {
+        for (unsigned int i = 0; i < kInstanceShards; i++) {
+            count += reserved->shards[i].constructed;
+            count -= reserved->shards[i].destructed;
+        }
+    }
+
+    return (count > 0) ? (unsigned int) count : 0;
+}
+
+/*********************************************************************
+ * Instances constructed since the class was loaded, freed or not.
+ *********************************************************************/
+u_int64_t
+OSMetaClass::getConstructedCount() const
+{
+    u_int64_t count = 0;
+
+    if (reserved) {
+        for (unsigned int i = 0; i < kInstanceShards; i++)
+            count += reserved->shards[i].constructed;
+    }
+
+    return count;
+}
+
+/*********************************************************************
+ * Log every registered class with its live instances, the memory they
+ * take (classSize each, before zone rounding), the instances constructed
+ * so far and, as a churn rate, those constructed since the last call.
+ *********************************************************************/
+void
+OSMetaClass::printInstanceCounts()
+{
+    OSCollectionIterator * classes;
+    const OSSymbol       * name;
+
+    IOLockLock(sAllClassesLock);
+    if (!sAllClassesDict) {
+        IOLockUnlock(sAllClassesLock);
+        return;
+    }
+
+    classes = OSCollectionIterator::withCollection(sAllClassesDict);
+    if (!classes) {
+        IOLockUnlock(sAllClassesLock);
+        return;
+    }
+
+    while ((name = (const OSSymbol *) classes->getNextObject())) {
+        OSMetaClass * meta = (OSMetaClass *) sAllClassesDict->getObject(name);
+        unsigned int  count = meta->getInstanceCount();
+        u_int64_t     constructed = meta->getConstructedCount();
+        u_int64_t     churn = 0;
+
+        if (meta->reserved) {
+            churn = constructed - meta->reserved->reportedConstructed;
+            meta->reserved->reportedConstructed = constructed;
+        }
+
+        printk("%24s: %8u instances, %10llu bytes, %10llu constructed, %10llu since last report\n",
+               name->getCStringNoCopy(), count,
+               (unsigned long long) meta->classSize * count,
+               (unsigned long long) constructed, (unsigned long long) churn);
+    }
+
+    classes->release();
+    IOLockUnlock(sAllClassesLock);
+}
+
+/*********************************************************************
+ * This class's share of the zone its instances are allocated from.
+ * allocations, frees and inUse count the class's own instances, from
+ * the instance counts; elementSize and slabBytes are the zone's, which
+ * is shared with everything else of the same size class.
+ * Returns false for classes too big for any zone.
+ *********************************************************************/
+bool
+OSMetaClass::getZoneStatistics(OSZoneStatistics * stats) const
+{
+    u_int64_t destructed = 0;
+
+    if (!OSZoneGetStatistics(OSZoneIndexForSize(classSize), stats))
+        return false;
+
+    if (reserved) {
+        for (unsigned int i = 0; i < kInstanceShards; i++)
+            destructed += reserved->shards[i].destructed;
+    }
+
+    stats->allocations = getConstructedCount();
+    stats->frees = destructed;
+    stats->inUse = getInstanceCount();
+
+    return true;
 }
 
 /*********************************************************************
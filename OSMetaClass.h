@@ -12,6 +12,7 @@
 
 #include "runtime.h"
 #include "OSReturn.h"
+#include "OSZone.h"
 
 class OSSerialize;
 class OSMetaClass;
@@ -84,7 +85,24 @@ class OSMetaClass : private OSMetaClassBase
 {
 private:
 	static void * operator new(size_t size);
-    struct ExpansionData { };
+
+    // Instance counters, one cache line per cpu so that constructing
+    // objects on different cpus doesn't bounce a shared line.
+    enum { kInstanceShards = 32 };	// power of 2
+    struct InstanceShard {
+        volatile int64_t constructed;
+        volatile int64_t destructed;
+        int64_t          pad[6];
+    };
+    // Ancestors by depth, root first and this class last; see initDisplay().
+    enum { kDisplayInline = 8 };
+    struct ExpansionData {
+        InstanceShard        shards[kInstanceShards];
+        u_int64_t            reportedConstructed;	// as of the last printInstanceCounts()
+        unsigned int         classDepth;		// 0 for a root class
+        const OSMetaClass ** display;			// 0 until postModLoad
+        const OSMetaClass  * displayInline[kDisplayInline];
+    };
     ExpansionData *reserved;
     const OSMetaClass *superClassLink;
     const OSSymbol *className;
@@ -92,6 +110,7 @@ private:
     mutable unsigned int instanceCount;
     OSMetaClass();
     static void logError(OSReturn result);
+    void initDisplay();
 public:
     static const OSMetaClass * getMetaClassWithName(const OSSymbol * name);
 protected:
@@ -118,6 +137,7 @@ public:
     static OSReturn postModLoad(void * loadHandle);
 	static bool modHasInstance(const char * kextID);
     static void reportModInstances(const char * kextID);
+    static void printInstanceCounts();
     static void considerUnloads();
 	static OSObject * allocClassWithName(const OSSymbol * name);
     static OSObject * allocClassWithName(const OSString * name);
@@ -138,6 +158,8 @@ public:
     void instanceDestructed() const;
     OSMetaClassBase * checkMetaCast(const OSMetaClassBase * object) const;
     unsigned int getInstanceCount() const;
+    u_int64_t getConstructedCount() const;
+    bool getZoneStatistics(OSZoneStatistics * stats) const;
     const OSMetaClass * getSuperClass() const;
     const OSSymbol * getKmodName() const;
     const char * getClassName() const;
@@ -30,6 +30,7 @@
 #include "OSObject.h"
 #include "OSSerialize.h"
 #include "OSCollection.h"
+#include "OSZone.h"
 
 extern "C" bool OSAtomicCompareAndSwap32( u_int32_t __oldValue, u_int32_t __newValue, volatile u_int32_t *__theValue );
 
@@ -146,6 +147,127 @@ void OSObject::taggedRetain(const void *tag) const
     } while (!OSCompareAndSwap(origCount, newCount, const_cast<u_int32_t *>(countP)));
 }
 
+// Like taggedRetain, but fails instead of panicking if the object is
+// already on its way to being freed.  For lookup tables that hand out
+// references without holding the lock that free() takes.
+bool OSObject::taggedTryRetain(const void *tag) const
+{
+    volatile u_int32_t *countP = (volatile u_int32_t *) &retainCount;
+    u_int32_t inc = 1;
+    u_int32_t origCount;
+    u_int32_t newCount;
+
+    // Increment the collection bucket.
+    if ((const void *) OSTypeID(OSCollection) == tag)
+	inc |= (1UL<<16);
+
+    do {
+	origCount = *countP;
+        if ( ((u_int16_t) origCount | 0x1) == 0xffff ) {
+            // 0xffff: being freed, too late.  0xfffe: pegged, see above.
+            return !(origCount & 0x1);
+        }
+
+	newCount = origCount + inc;
+    } while (!OSCompareAndSwap(origCount, newCount, const_cast<u_int32_t *>(countP)));
+
+    return true;
+}
+
+// Drops a reference only if that doesn't free the object, returns false
+// and leaves the count alone otherwise.  Lets classes that must lock
+// around free() skip the lock for all but the final release.
+bool OSObject::taggedTryRelease(const void *tag, const int when) const
+{
+    volatile u_int32_t *countP = (volatile u_int32_t *) &retainCount;
+    u_int32_t dec = 1;
+    u_int32_t origCount;
+    u_int32_t actualCount;
+
+    // Decrement the collection bucket.
+    if ((const void *) OSTypeID(OSCollection) == tag)
+	dec |= (1UL<<16);
+
+    do {
+	origCount = *countP;
+
+        // Freed, pegged or about to be freed, leave it to taggedRelease.
+        if ( ((u_int16_t) origCount | 0x1) == 0xffff )
+            return false;
+	actualCount = origCount - dec;
+        if ((u_int16_t) actualCount < when)
+            return false;
+
+    } while (!OSCompareAndSwap(origCount, actualCount, const_cast<u_int32_t *>(countP)));
+
+    // See taggedRelease(const void *, const int).
+    if ((u_int16_t) actualCount < (actualCount >> 16)) {
+        panic("A kext releasing a(n) %s has corrupted the registry.",
+            getClassName(this));
+    }
+
+    return true;
+}
+
+// Adds count references in one go, or returns false without counting
+// any if the object is being freed or that would peg it; taggedRetain
+// sorts those out one reference at a time.
+bool OSObject::taggedTryRetainMany(const void *tag, unsigned int count) const
+{
+    volatile u_int32_t *countP = (volatile u_int32_t *) &retainCount;
+    u_int32_t inc = 1;
+    u_int32_t origCount;
+    u_int32_t newCount;
+
+    // Increment the collection bucket.
+    if ((const void *) OSTypeID(OSCollection) == tag)
+	inc |= (1UL<<16);
+
+    do {
+	origCount = *countP;
+        if ((u_int16_t) origCount >= 0xfffe
+         || count >= 0xfffeU - (u_int16_t) origCount)
+            return false;
+
+	newCount = origCount + inc * count;
+    } while (!OSCompareAndSwap(origCount, newCount, const_cast<u_int32_t *>(countP)));
+
+    return true;
+}
+
+// Drops count references in one go, unless that would free the object.
+bool OSObject::taggedTryReleaseMany(const void *tag, unsigned int count) const
+{
+    volatile u_int32_t *countP = (volatile u_int32_t *) &retainCount;
+    u_int32_t dec = 1;
+    u_int32_t origCount;
+    u_int32_t actualCount;
+
+    // Decrement the collection bucket.
+    if ((const void *) OSTypeID(OSCollection) == tag)
+	dec |= (1UL<<16);
+
+    do {
+	origCount = *countP;
+
+        // Freed, pegged or about to be freed, leave it to taggedRelease.
+        if ( ((u_int16_t) origCount | 0x1) == 0xffff )
+            return false;
+        if ((u_int16_t) origCount <= count)
+            return false;
+	actualCount = origCount - dec * count;
+
+    } while (!OSCompareAndSwap(origCount, actualCount, const_cast<u_int32_t *>(countP)));
+
+    // See taggedRelease(const void *, const int).
+    if ((u_int16_t) actualCount < (actualCount >> 16)) {
+        panic("A kext releasing a(n) %s has corrupted the registry.",
+            getClassName(this));
+    }
+
+    return true;
+}
+
 void OSObject::taggedRelease(const void *tag) const
 {
     taggedRelease(tag, 1);
@@ -233,9 +355,131 @@ void OSObject::release(int when) const
     taggedRelease(0, when);
 }
 
+/*
+ * Batches.
+ *
+ * Pending counts sit in a small window of 2-way buckets, so an object
+ * that shows up again before it is evicted is counted once more instead
+ * of costing another atomic.  An evicted slot, and every slot left at
+ * the end, is applied with one compare and swap.  The objects of a big
+ * container are mostly cold, so each is prefetched a few places ahead.
+ */
+#define kBatchBuckets   32      // power of 2
+#define kBatchWays      2       // power of 2
+#define kBatchPrefetch  8
+
+typedef struct {
+    const OSMetaClassBase *object;
+    unsigned int           count;
+} BatchSlot;
+
+static inline unsigned int batchBucket(const OSMetaClassBase *object)
+{
+    u_int64_t h = (u_int64_t) (uintptr_t) object;
+
+    // Fibonacci hashing, the low bits of an address are all alike.
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int) (h >> 59) & (kBatchBuckets - 1);
+}
+
+inline void
+OSObject::taggedChangeObject(const OSMetaClassBase *object,
+                             unsigned int count, const void *tag, bool retain)
+{
+    const OSObject *me;
+
+    // A single reference is cheaper to take the usual way than to cast for.
+    if (count > 1 && (me = OSDynamicCast(OSObject, object))) {
+        if (retain ? me->taggedTryRetainMany(tag, count)
+                   : me->taggedTryReleaseMany(tag, count))
+            return;
+    }
+
+    // One reference, not an OSObject, or about to be freed or pegged.
+    while (count--) {
+        if (retain)
+            object->taggedRetain(tag);
+        else
+            object->taggedRelease(tag);
+    }
+}
+
+void OSObject::taggedChangeObjects(const OSMetaClassBase * const *objects,
+                                   unsigned int count, const void *tag,
+                                   bool retain)
+{
+    BatchSlot window[kBatchBuckets * kBatchWays];
+
+    bzero(window, sizeof(window));
+
+    for (unsigned int i = 0; i < count; i++) {
+        const OSMetaClassBase *object = objects[i];
+        BatchSlot *bucket;
+        unsigned int way;
+
+        if (i + kBatchPrefetch < count)
+            __builtin_prefetch(objects[i + kBatchPrefetch], 1);
+        if (!object)
+            continue;
+
+        bucket = &window[batchBucket(object) * kBatchWays];
+        for (way = 0; way < kBatchWays; way++) {
+            if (bucket[way].object == object || !bucket[way].object)
+                break;
+        }
+
+        if (way == kBatchWays) {
+            // Full, evict round robin.  Most evictions are of objects seen
+            // once, and those are quickest applied right here.
+            way = i & (kBatchWays - 1);
+            if (bucket[way].count > 1)
+                taggedChangeObject(bucket[way].object, bucket[way].count, tag, retain);
+            else if (retain)
+                bucket[way].object->taggedRetain(tag);
+            else
+                bucket[way].object->taggedRelease(tag);
+            bucket[way].object = 0;
+        }
+        if (bucket[way].object)
+            bucket[way].count++;
+        else {
+            bucket[way].object = object;
+            bucket[way].count = 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < kBatchBuckets * kBatchWays; i++) {
+        if (window[i].object)
+            taggedChangeObject(window[i].object, window[i].count, tag, retain);
+    }
+}
+
+void OSObject::taggedRetainObjects(const OSMetaClassBase * const *objects,
+                                   unsigned int count, const void *tag)
+{
+    taggedChangeObjects(objects, count, tag, true);
+}
+
+void OSObject::taggedReleaseObjects(const OSMetaClassBase * const *objects,
+                                    unsigned int count, const void *tag)
+{
+    taggedChangeObjects(objects, count, tag, false);
+}
+
 bool OSObject::serialize(OSSerialize *s) const
 {
     if (s->previouslySerialized(this)) return true;
+
+    if (s->isBinary()) {
+        char text[128];
+        int n = snprintf(text, sizeof(text), "%s is not serializable", getClassName(this));
+
+        if (n < 0)
+            return false;
+        if (n >= (int) sizeof(text))
+            n = sizeof(text) - 1;
+        return s->addBinaryObject(kOSSerializeString, n + 1, text);
+    }
 	
     if (!s->addXMLStartTag(this, "string")) return false;
 	
@@ -250,8 +494,9 @@ struct OSObjectTracking {};
 
 void *OSObject::operator new(size_t size)
 {
-    OSObjectTracking * mem = (OSObjectTracking *) kalloc(size);
-	
+    OSObjectTracking * mem = (OSObjectTracking *) OSZoneAlloc(size);
+    assert(mem);
+
     bzero(mem, size);
 
     ACCUMSIZE(size);
@@ -261,7 +506,7 @@ void *OSObject::operator new(size_t size)
 
 void OSObject::operator delete(void *_mem, size_t size)
 {
-    kfree(_mem);
+    OSZoneFree(_mem, size);
 
     ACCUMSIZE(-size);
 }
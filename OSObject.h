@@ -23,6 +23,16 @@ protected:
 	virtual bool init();
 	virtual void free();
 	static void operator delete(void * mem, size_t size);
+	bool taggedTryRetain(const void * tag = 0) const;
+	bool taggedTryRelease(const void * tag, const int freeWhen) const;
+
+private:
+	bool taggedTryRetainMany(const void * tag, unsigned int count) const;
+	bool taggedTryReleaseMany(const void * tag, unsigned int count) const;
+	static void taggedChangeObject(const OSMetaClassBase * object,
+	    unsigned int count, const void * tag, bool retain);
+	static void taggedChangeObjects(const OSMetaClassBase * const * objects,
+	    unsigned int count, const void * tag, bool retain);
 	
 public:
 	static void * operator new(size_t size);
@@ -31,6 +41,16 @@ public:
 	virtual void release() const;
 	virtual void taggedRetain(const void * tag = 0) const;
 	virtual void taggedRelease(const void * tag = 0) const;
+
+	// Retain or release every object in a list, as if by calling
+	// taggedRetain or taggedRelease on each in turn.  Repeats of an
+	// object close together in the list are counted with one atomic.
+	// Releases that don't free an object bypass an overridden
+	// taggedRelease, the way taggedTryRelease does.
+	static void taggedRetainObjects(const OSMetaClassBase * const * objects,
+	    unsigned int count, const void * tag = 0);
+	static void taggedReleaseObjects(const OSMetaClassBase * const * objects,
+	    unsigned int count, const void * tag = 0);
 	
 	virtual bool serialize(OSSerialize * serializer) const;
 	
@@ -28,12 +28,14 @@
 
 #include "OSDictionary.h"
 #include "OSOrderedSet.h"
+#include "OSSerialize.h"
+#include "OSZone.h"
 
 #define super OSCollection
 
 OSDefineMetaClassAndStructors(OSOrderedSet, OSCollection)
-OSMetaClassDefineReservedUnused(OSOrderedSet, 0)
-OSMetaClassDefineReservedUnused(OSOrderedSet, 1)
+OSMetaClassDefineReservedUsed(OSOrderedSet, 0)
+OSMetaClassDefineReservedUsed(OSOrderedSet, 1)
 OSMetaClassDefineReservedUnused(OSOrderedSet, 2)
 OSMetaClassDefineReservedUnused(OSOrderedSet, 3)
 OSMetaClassDefineReservedUnused(OSOrderedSet, 4)
@@ -68,7 +70,7 @@ initWithCapacity(unsigned int inCapacity,
         return false;
 
     size = sizeof(_Element) * inCapacity;
-    array = (_Element *) kalloc(size);
+    array = (_Element *) OSZoneAlloc(size);
     if (!array)
         return false;
 
@@ -104,7 +106,7 @@ void OSOrderedSet::free()
     flushCollection();
 
     if (array) {
-        kfree(array, sizeof(_Element) * capacity);
+        OSZoneFree(array, sizeof(_Element) * capacity);
         ACCUMSIZE( -(sizeof(_Element) * capacity) );
     }
 
@@ -124,29 +126,35 @@ unsigned int OSOrderedSet::setCapacityIncrement(unsigned int increment)
 unsigned int OSOrderedSet::ensureCapacity(unsigned int newCapacity)
 {
     _Element *newArray;
-    int oldSize, newSize;
+    size_t oldSize, newSize;
 
     if (newCapacity <= capacity)
         return capacity;
 
-    // round up
-    newCapacity = (((newCapacity - 1) / capacityIncrement) + 1)
-                * capacityIncrement;
+    newCapacity = growCapacity(capacity, newCapacity, capacityIncrement,
+                               sizeof(_Element));
+    if (!newCapacity)
+        return capacity;
+    oldSize = sizeof(_Element) * capacity;
     newSize = sizeof(_Element) * newCapacity;
 
-    newArray = (_Element *) kalloc(newSize);
-    if (newArray) {
-        oldSize = sizeof(_Element) * capacity;
-
-        ACCUMSIZE(newSize - oldSize);
+    if (OSZoneExtend(array, oldSize, newSize))
+        newArray = array;
+    else {
+        newArray = (_Element *) OSZoneAlloc(newSize);
+        if (!newArray)
+            return capacity;
 
         bcopy(array, newArray, oldSize);
-        bzero(&newArray[capacity], newSize - oldSize);
-        kfree(array, oldSize);
-        array = newArray;
-        capacity = newCapacity;
+        OSZoneFree(array, oldSize);
     }
 
+    ACCUMSIZE(newSize - oldSize);
+
+    bzero(&newArray[capacity], newSize - oldSize);
+    array = newArray;
+    capacity = newCapacity;
+
     return capacity;
 }
 
@@ -165,33 +173,48 @@ void OSOrderedSet::flushCollection()
 /* internal */
 bool OSOrderedSet::setObject(unsigned int index, const OSMetaClassBase *anObject)
 {
-    unsigned int i;
-    unsigned int newCount = count + 1;
+    return setObjects(index, &anObject, 1);
+}
 
-    if ((index > count) || !anObject)
-        return false;
+bool OSOrderedSet::setObjects(unsigned int index,
+                              const OSMetaClassBase * const *objects,
+                              unsigned int n)
+{
+    unsigned int i, j;
+    unsigned int newCount = count + n;
 
-    if (containsObject(anObject))
+    if ((index > count) || !objects || (newCount < count))
         return false;
 
+    for (i = 0; i < n; i++) {
+        if (!objects[i] || member(objects[i]))
+            return false;
+        for (j = 0; j < i; j++) {
+            if (objects[j] == objects[i])
+                return false;
+        }
+    }
+    if (!n)
+        return true;
+
     // do we need more space?
     if (newCount > capacity && newCount > ensureCapacity(newCount))
         return false;
 
     haveUpdated();
-    if (index != count) {
-        for (i = count; i > index; i--)
-            array[i] = array[i-1];
+    if (index != count)
+        bcopy(&array[index], &array[index + n], (count - index) * sizeof(_Element));
+    for (i = 0; i < n; i++) {
+        array[index + i].obj = objects[i];
+//      array[index + i].pri = pri;
     }
-    array[index].obj = anObject;
-//    array[index].pri = pri;
-    anObject->taggedRetain(OSTypeID(OSCollection));
-    count++;
+    count = newCount;
+
+    OSObject::taggedRetainObjects(objects, n, OSTypeID(OSCollection));
 
     return true;
 }
 
-
 bool OSOrderedSet::setFirstObject(const OSMetaClassBase *anObject)
 {
     return( setObject(0, anObject));
@@ -220,22 +243,64 @@ bool OSOrderedSet::setObject(const OSMetaClassBase *anObject )
 
 void OSOrderedSet::removeObject(const OSMetaClassBase *anObject)
 {
-    bool		deleted = false;
-    unsigned int 	i;
+    unsigned int i;
 
     for (i = 0; i < count; i++) {
-
-        if( deleted)
-            array[i-1] = array[i];
-        else if( (array[i].obj == anObject)) {
-            deleted = true;
-	    haveUpdated();	// Pity we can't flush the log
-            array[i].obj->taggedRelease(OSTypeID(OSCollection));
+        if (array[i].obj == anObject) {
+            removeObjects(i, 1);
+            break;
         }
     }
+}
+
+// Objects removed are set aside here while the rest move down;
+// longer ranges are rotated to the end of the array instead.
+#define kRemoveStash 32
+
+static void reverseElements(_Element *elements, unsigned int n)
+{
+    if (n < 2)
+        return;
+
+    for (unsigned int i = 0, j = n - 1; i < j; i++, j--) {
+        _Element element = elements[i];
+
+        elements[i] = elements[j];
+        elements[j] = element;
+    }
+}
+
+void OSOrderedSet::removeObjects(unsigned int index, unsigned int length)
+{
+    const OSMetaClassBase *stash[kRemoveStash];
+    unsigned int tail;
+
+    if ((index >= count) || !length)
+        return;
+
+    if (length > count - index)
+        length = count - index;
+    tail = count - index - length;
+
+    haveUpdated();
+    if (length <= kRemoveStash) {
+        for (unsigned int i = 0; i < length; i++)
+            stash[i] = array[index + i].obj;
+        bcopy(&array[index + length], &array[index], tail * sizeof(_Element));
+        count -= length;
+
+        OSObject::taggedReleaseObjects(stash, length, OSTypeID(OSCollection));
+        return;
+    }
 
-    if (deleted)
-	count--;
+    // Rotate the range past the tail.
+    reverseElements(&array[index], length);
+    reverseElements(&array[index + length], tail);
+    reverseElements(&array[index], length + tail);
+    count -= length;
+
+    for (unsigned int i = count; i < count + length; i++)
+        array[i].obj->taggedRelease(OSTypeID(OSCollection));
 }
 
 bool OSOrderedSet::containsObject(const OSMetaClassBase *anObject) const
@@ -321,6 +386,30 @@ bool OSOrderedSet::isEqualTo(const OSMetaClassBase *anObject) const
         return false;
 }
 
+bool OSOrderedSet::serialize(OSSerialize *s) const
+{
+    if (s->previouslySerialized(this)) return true;
+    if (s->cacheCollection(this)) return s->addCachedCollection(this);
+
+    // written as an array, the order is all there is to keep
+    if (s->isBinary()) {
+        if (!s->addBinaryObject(kOSSerializeArray, count, 0)) return false;
+
+        for (unsigned int i = 0; i < count; i++) {
+            if (!s->addBinaryMember(array[i].obj, i + 1 == count)) return false;
+        }
+        return true;
+    }
+
+    if (!s->addXMLStartTag(this, "array")) return false;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (!array[i].obj->serialize(s)) return false;
+    }
+
+    return s->addXMLEndTag("array");
+}
+
 unsigned int OSOrderedSet::iteratorSize() const
 {
     return( sizeof(unsigned int));
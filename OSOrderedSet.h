@@ -708,6 +708,26 @@ public:
     virtual bool isEqualTo(const OSMetaClassBase * anObject) const;
 
 
+   /*!
+    * @function serialize
+    *
+    * @abstract
+    * Archives the receiver into the provided
+    * @link //apple_ref/doc/class/OSSerialize OSSerialize@/link object.
+    *
+    * @param serializer The OSSerialize object.
+    *
+    * @result
+    * <code>true</code> if serialization succeeds, <code>false</code> if not.
+    *
+    * @discussion
+    * An ordered set is written as an array of its members in order,
+    * and so unserializes as an
+    * @link //apple_ref/doc/class/OSArray OSArray@/link.
+    */
+    virtual bool serialize(OSSerialize * serializer) const;
+
+
    /*!
     * @function setOptions
     *
@@ -760,8 +780,57 @@ public:
     */
     OSCollection *copyCollection(OSDictionary * cycleDict = 0);
 
-    OSMetaClassDeclareReservedUnused(OSOrderedSet, 0);
-    OSMetaClassDeclareReservedUnused(OSOrderedSet, 1);
+    OSMetaClassDeclareReservedUsed(OSOrderedSet, 0);
+
+   /*!
+    * @function setObjects
+    *
+    * @abstract
+    * Adds objects to an OSOrderedSet at a specified index.
+    *
+    * @param index    The index at which to insert the first object.
+    * @param objects  The objects to insert, none of them <code>NULL</code>.
+    * @param count    The number of objects.
+    *
+    * @result
+    * <code>true</code> if all the objects were added,
+    * <code>false</code> otherwise, in which case the set is unchanged.
+    *
+    * @discussion
+    * Fails if any of the objects is already in the set,
+    * or appears twice in <code>objects</code>.
+    * The objects at and after <code>index</code> move up
+    * in one block move.
+    *
+    * Like <code>setObject(unsigned int, const OSMetaClassBase *)</code>,
+    * this function ignores any ordering function of the ordered set.
+    */
+    virtual bool setObjects(
+        unsigned int                    index,
+        const OSMetaClassBase * const * objects,
+        unsigned int                    count);
+
+    OSMetaClassDeclareReservedUsed(OSOrderedSet, 1);
+
+   /*!
+    * @function removeObjects
+    *
+    * @abstract
+    * Removes a range of objects from the ordered set.
+    *
+    * @param index   The index of the first object to remove.
+    * @param length  The number of objects to remove;
+    *                the range is cut short at the end of the set.
+    *
+    * @discussion
+    * The objects removed are released.
+    * The objects after the range move down in one block move,
+    * so the order of the rest is kept.
+    */
+    virtual void removeObjects(
+        unsigned int index,
+        unsigned int length);
+
     OSMetaClassDeclareReservedUnused(OSOrderedSet, 2);
     OSMetaClassDeclareReservedUnused(OSOrderedSet, 3);
     OSMetaClassDeclareReservedUnused(OSOrderedSet, 4);
@@ -13,6 +13,11 @@
 
 typedef kern_return_t OSReturn;
 
+#ifndef err_system
+#define err_system(x)                 (((x) & 0x3f) << 26)
+#define err_sub(x)                    (((x) & 0xfff) << 14)
+#endif /* err_system */
+
 #ifndef sys_libkern
 #define sys_libkern                   err_system(0x37)
 #endif /* sys_libkern */
@@ -24,4 +29,11 @@ typedef kern_return_t OSReturn;
 #define libkern_common_err(return)    (sys_libkern|sub_libkern_common|(return))
 #define libkern_metaclass_err(return) (sys_libkern|sub_libkern_metaclass|(return))
 
+#define kOSReturnSuccess              0
+#define kOSReturnError                libkern_common_err(1)
+
+#define kOSMetaClassNoTempData        libkern_metaclass_err(4)
+#define kOSMetaClassNoDicts           libkern_metaclass_err(5)
+#define kOSMetaClassDuplicateClass    libkern_metaclass_err(10)
+
 #endif
@@ -28,14 +28,14 @@
 /* OSSerialize.cpp created by rsulack on Wen 25-Nov-1998 */
 
 
-#include "OSDictionary.h"
+#include "OSArray.h"
+#include "OSCollection.h"
 #include "OSSerialize.h"
-#include "OSString.h"
 
 #define super OSObject
 
 OSDefineMetaClassAndStructors(OSSerialize, OSObject)
-OSMetaClassDefineReservedUnused(OSSerialize, 0)
+OSMetaClassDefineReservedUsed(OSSerialize, 0)
 OSMetaClassDefineReservedUnused(OSSerialize, 1)
 OSMetaClassDefineReservedUnused(OSSerialize, 2)
 OSMetaClassDefineReservedUnused(OSSerialize, 3)
@@ -53,6 +53,10 @@ extern "C" {
 #define ACCUMSIZE(s)
 #endif
 
+// every kalloc made here, for getAllocationCount()
+static volatile int64_t sKallocCount;
+#define COUNTKALLOC(n) OSAtomicAdd64((n), &sKallocCount)
+
 char * OSSerialize::text() const
 {
 	return data;
@@ -60,58 +64,241 @@ char * OSSerialize::text() const
 
 void OSSerialize::clearText()
 {
-	bzero((void *)data, capacity);
-	length = 1;
+	if (reserved->binary) {
+		// the buffer always has room for the signature
+		bcopy(kOSSerializeBinarySignature, data, sizeof(kOSSerializeBinarySignature));
+		length = sizeof(kOSSerializeBinarySignature);
+		reserved->endCollection = true;
+	} else if (reserved->sink) {
+		length = 0;
+	} else {
+		data[0] = 0;
+		length = 1;
+	}
 	tag = 0;
-	tags->flushCollection();
+	reserved->failed = false;
+	clearIDs();
+}
+
+bool OSSerialize::isBinary() const
+{
+	return reserved->binary;
+}
+
+/*
+ * Object IDs.
+ *
+ * The first time an object is serialized it gets the next ID; every later
+ * visit writes a reference to that ID instead.  The IDs are kept in an
+ * open addressed table keyed by the object's address, probed linearly and
+ * never more than half full.  Each object in the table is retained, so
+ * its address cannot be reused for another object during the pass.
+ */
+
+#define kIDTableMinimum 64
+
+static inline unsigned int hashObject(const OSMetaClassBase *o, unsigned int mask)
+{
+	// the low bits are alignment, multiplying spreads the rest
+	return (unsigned int) ((((u_int64_t) (size_t) o >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static unsigned int formatID(unsigned int id, char *buffer)
+{
+	char digits[10];
+	unsigned int n = 0;
+
+	do {
+		digits[n++] = '0' + id % 10;
+		id /= 10;
+	} while (id);
+
+	for (unsigned int i = 0; i < n; i++)
+		buffer[i] = digits[n - 1 - i];
+
+	return n;
+}
+
+OSSerialize::IDEntry *OSSerialize::findID(const OSMetaClassBase *o) const
+{
+	unsigned int mask = reserved->idCapacity - 1;
+
+	if (!reserved->idCount)
+		return 0;
+
+	for (unsigned int i = hashObject(o, mask); ; i = (i + 1) & mask) {
+		IDEntry *entry = &reserved->ids[i];
+
+		if (entry->object == o)
+			return entry;
+		if (!entry->object)
+			return 0;
+	}
+}
+
+bool OSSerialize::addID(const OSMetaClassBase *o, unsigned int id)
+{
+	unsigned int mask;
+	IDEntry *entry;
+
+	if (2 * (reserved->idCount + 1) > reserved->idCapacity) {
+		unsigned int oldCapacity = reserved->idCapacity;
+		unsigned int newCapacity = (oldCapacity) ? 2 * oldCapacity : kIDTableMinimum;
+		IDEntry *oldIDs = reserved->ids;
+		IDEntry *newIDs;
+
+		if (newCapacity > ((unsigned int) -1) / sizeof(IDEntry))
+			return false;
+		newIDs = (IDEntry *) kalloc(newCapacity * sizeof(IDEntry));
+		if (!newIDs)
+			return false;
+		bzero(newIDs, newCapacity * sizeof(IDEntry));
+		ACCUMSIZE(newCapacity * sizeof(IDEntry));
+		COUNTKALLOC(1);
+
+		mask = newCapacity - 1;
+		for (unsigned int i = 0; i < oldCapacity; i++) {
+			if (!oldIDs[i].object)
+				continue;
+
+			unsigned int j = hashObject(oldIDs[i].object, mask);
+
+			while (newIDs[j].object)
+				j = (j + 1) & mask;
+			newIDs[j] = oldIDs[i];
+		}
+
+		if (oldIDs) {
+			kfree(oldIDs, oldCapacity * sizeof(IDEntry));
+			ACCUMSIZE( -(oldCapacity * sizeof(IDEntry)) );
+		}
+		reserved->ids = newIDs;
+		reserved->idCapacity = newCapacity;
+	}
+
+	mask = reserved->idCapacity - 1;
+	for (entry = &reserved->ids[hashObject(o, mask)]; entry->object; ) {
+		if (++entry == &reserved->ids[reserved->idCapacity])
+			entry = reserved->ids;
+	}
+
+	o->retain();
+	entry->object = o;
+	entry->id = id;
+	reserved->idCount++;
+	reserved->lastObject = o;
+	reserved->lastID = id;
+
+	return true;
+}
+
+void OSSerialize::clearIDs()
+{
+	if (!reserved->idCount)
+		return;
+
+	for (unsigned int i = 0; i < reserved->idCapacity; i++) {
+		if (reserved->ids[i].object)
+			reserved->ids[i].object->release();
+	}
+	bzero(reserved->ids, reserved->idCapacity * sizeof(IDEntry));
+	reserved->idCount = 0;
+	reserved->lastObject = 0;
 }
 
 bool OSSerialize::previouslySerialized(const OSMetaClassBase *o)
 {
-	char temp[16];
-	OSString *tagString;
+	IDEntry *entry = findID(o);
+	unsigned int id;
 
-	// look it up
-	tagString = (OSString *)tags->getObject((const OSSymbol *) o);
+	/*
+	 * A failure here makes the caller write the object in full, and
+	 * reserved->failed makes that fail at its start tag or record.
+	 */
+	if (entry)
+		id = entry->id;
+	else if (!reserved->shared) {
+		if ((reserved->capture && !addCapturedObject(o)) || !addID(o, tag))
+			reserved->failed = true;
+		else
+			tag++;
+		return false;
+	} else {
+		// a parallel task, written in full only where the first pass first saw it
+		entry = reserved->shared->findID(o);
+		if (!entry) {
+			reserved->failed = true;
+			return false;
+		}
+		id = entry->id;
+		if (id >= reserved->sharedLow) {
+			if (!addID(o, id))
+				reserved->failed = true;
+			return false;
+		}
+	}
 
-// xx-review: no error checking here for addString calls!
-	// does it exist?
-	if (tagString) {
-		addString("<reference IDREF=\"");
-		addString(tagString->getCStringNoCopy());
-		addString("\"/>");
-		return true;
+	if (!addReference(id)) {
+		reserved->failed = true;
+		return false;
 	}
+	return true;
+}
+
+bool OSSerialize::addReference(unsigned int id)
+{
+	if (reserved->binary) {
+		if (reserved->capture && !addPatch(id))
+			return false;
+		return addBinaryObject(kOSSerializeObject, id, 0);
+	}
+
+	if (!addStringN("<reference IDREF=\"", 18)) return false;
+	if (!addXMLID(id)) return false;
+	return addStringN("\"/>", 3);
+}
 
-	// build a tag
-	snprintf(temp, sizeof(temp), "%u", tag++);
-	tagString = OSString::withCString(temp);
+bool OSSerialize::addXMLID(unsigned int id)
+{
+	char temp[16];
 
-	// add to tag dictionary
-        tags->setObject((const OSSymbol *) o, tagString);// XXX check return
-	tagString->release();
+	// a cached copy leaves the number out, to be filled in when spliced
+	if (reserved->capture)
+		return addPatch(id);
 
-	return false;
+	return addStringN(temp, formatID(id, temp));
 }
 
 bool OSSerialize::addXMLStartTag(const OSMetaClassBase *o, const char *tagString)
 {
+	unsigned int id;
+
+	if (reserved->failed)
+		return false;
+
+	// nearly always the object previouslySerialized() just saw
+	if (o == reserved->lastObject)
+		id = reserved->lastID;
+	else {
+		IDEntry *entry = findID(o);
+
+		if (!entry)
+			return false;
+		id = entry->id;
+	}
 
 	if (!addChar('<')) return false;
 	if (!addString(tagString)) return false;
-	if (!addString(" ID=\"")) return false;
-	if (!addString(((OSString *)tags->getObject((const OSSymbol *)o))->getCStringNoCopy())) 
-		return false;
-	if (!addChar('\"')) return false;
-	if (!addChar('>')) return false;
+	if (!addStringN(" ID=\"", 5)) return false;
+	if (!addXMLID(id)) return false;
+	if (!addStringN("\">", 2)) return false;
 	return true;
 }
 
 bool OSSerialize::addXMLEndTag(const char *tagString)
 {
 
-	if (!addChar('<')) return false;
-	if (!addChar('/')) return false;
+	if (!addStringN("</", 2)) return false;
 	if (!addString(tagString)) return false;
 	if (!addChar('>')) return false;
 	return true;
@@ -119,11 +306,19 @@ bool OSSerialize::addXMLEndTag(const char *tagString)
 
 bool OSSerialize::addChar(const char c)
 {
+	if (reserved->idsOnly)
+		return true;
+	if (reserved->binary)
+		return false;
+	if (reserved->sink)
+		return streamBytes(&c, 1);
+
 	// add char, possibly extending our capacity
-	if (length >= capacity && length >=ensureCapacity(capacity+capacityIncrement))
+	if (length >= capacity && length >= ensureCapacity(length + 1))
 		return false;
 
 	data[length - 1] = c;
+	data[length] = 0;
 	length++;
  
 	return true;
@@ -131,11 +326,200 @@ bool OSSerialize::addChar(const char c)
 
 bool OSSerialize::addString(const char *s)
 {
-	bool rc = false;
+	return addBytes(s, strlen(s));
+}
+
+bool OSSerialize::addStringN(const char *s, unsigned int n)
+{
+	return addBytes(s, n);
+}
+
+bool OSSerialize::addBytes(const void *bytes, unsigned int n)
+{
+	if (reserved->idsOnly)
+		return true;
+	if (reserved->binary)
+		return false;
+	if (reserved->sink)
+		return streamBytes(bytes, n);
+
+	// length counts the nul, which stays at the end
+	if (n >= (unsigned int) -1 - length)
+		return false;
+	if (length + n > capacity && length + n > ensureCapacity(length + n))
+		return false;
+
+	bcopy(bytes, &data[length - 1], n);
+	length += n;
+	data[length - 1] = 0;
+
+	return true;
+}
+
+bool OSSerialize::addVectors(const OSSerializeVector *vectors, unsigned int count)
+{
+	u_int64_t total = 0;
+	char *next;
+
+	if (reserved->idsOnly)
+		return true;
+	if (reserved->binary)
+		return false;
+
+	if (reserved->sink) {
+		for (unsigned int i = 0; i < count; i++) {
+			if (!streamBytes(vectors[i].base, vectors[i].length))
+				return false;
+		}
+		return true;
+	}
+
+	for (unsigned int i = 0; i < count; i++)
+		total += vectors[i].length;
+	if (total >= (unsigned int) -1 - length)
+		return false;
+	if (length + total > capacity && length + total > ensureCapacity(length + (unsigned int) total))
+		return false;
+
+	next = &data[length - 1];
+	for (unsigned int i = 0; i < count; i++) {
+		bcopy(vectors[i].base, next, vectors[i].length);
+		next += vectors[i].length;
+	}
+	length += (unsigned int) total;
+	data[length - 1] = 0;
+
+	return true;
+}
+
+char *OSSerialize::reserveBytes(unsigned int n)
+{
+	reserved->spanLength = 0;
+	if (reserved->binary)
+		return 0;
+
+	if (reserved->sink) {
+		// the span has to be in one piece, so start an empty ring if need be
+		if (n > capacity)
+			return 0;
+		if (capacity - length < n && !flush())
+			return 0;
+		reserved->spanLength = n;
+		return &data[length];
+	}
+
+	// the span starts over the nul, which commitBytes() puts back
+	if (n >= (unsigned int) -1 - length)
+		return 0;
+	if (length + n > capacity && length + n > ensureCapacity(length + n))
+		return 0;
+	reserved->spanLength = n;
+	return &data[length - 1];
+}
+
+bool OSSerialize::commitBytes(unsigned int n)
+{
+	if (n > reserved->spanLength)
+		return false;
+	reserved->spanLength = 0;
+
+	if (reserved->binary)
+		return false;
+	if (reserved->idsOnly) {
+		if (!reserved->sink)
+			data[length - 1] = 0;
+		return true;
+	}
+
+	length += n;
+	if (!reserved->sink)
+		data[length - 1] = 0;
+
+	return true;
+}
+
+/*
+ * Escape scanning for addXMLString().
+ *
+ * Most property strings have nothing to escape, so the scan looks at a
+ * whole vector, or at least a word, per step and only goes byte by byte
+ * once it knows there is a hit.  Besides the escapes it stops at a nul,
+ * which setChar() can plant before the end.  '<' and '>' differ only in
+ * bit 1, so (c | 2) == '>' tests for both.  Kernels built without SSE
+ * get the word loop alone.
+ */
+#if defined(__AVX2__)
+typedef char EscapeVector __attribute__((vector_size(32), aligned(1)));
+#define escapeMask(v)   ((unsigned int) __builtin_ia32_pmovmskb256(v))
+#elif defined(__SSE2__)
+typedef char EscapeVector __attribute__((vector_size(16), aligned(1)));
+#define escapeMask(v)   ((unsigned int) __builtin_ia32_pmovmskb128(v))
+#endif
+
+typedef unsigned long EscapeWord __attribute__((aligned(1), may_alias));
+
+#define kEscapeOnes     (~0UL / 255)
+#define kEscapeHighs    (kEscapeOnes << 7)
+#define hasZeroByte(w)  (((w) - kEscapeOnes) & ~(w) & kEscapeHighs)
+
+static inline bool isEscape(char c)
+{
+    return (c | 2) == '>' || c == '&' || !c;
+}
+
+static const char *findEscape(const char *c, const char *end)
+{
+#ifdef escapeMask
+    while (end - c >= (long) sizeof(EscapeVector)) {
+        EscapeVector v = *(const EscapeVector *) c;
+        unsigned int hits = escapeMask(((v | 2) == '>') | (v == '&') | (v == 0));
+
+        if (hits)
+            return c + __builtin_ctz(hits);
+        c += sizeof(EscapeVector);
+    }
+#endif
+
+    while (end - c >= (long) sizeof(EscapeWord)) {
+        EscapeWord w = *(const EscapeWord *) c;
+
+        if (hasZeroByte((w | (kEscapeOnes * 2)) ^ (kEscapeOnes * '>'))
+         | hasZeroByte(w ^ (kEscapeOnes * '&'))
+         | hasZeroByte(w))
+            break;
+        c += sizeof(EscapeWord);
+    }
+
+    while (c < end && !isEscape(*c))
+        c++;
+
+    return c;
+}
+
+bool OSSerialize::addXMLString(const char *s, unsigned int n)
+{
+	const char *end = s + n;
+
+	if (reserved->idsOnly)
+		return true;
 
-	while (*s && (rc = addChar(*s++))) ;
+	// copy the runs between escapes in one go
+	for (;;) {
+		const char *c = findEscape(s, end);
 
-	return rc;
+		if (c > s && !addStringN(s, (unsigned int) (c - s))) return false;
+		if (c == end || !*c)
+			return true;
+
+		if (*c == '<') {
+			if (!addStringN("&lt;", 4)) return false;
+		} else if (*c == '>') {
+			if (!addStringN("&gt;", 4)) return false;
+		} else {
+			if (!addStringN("&amp;", 5)) return false;
+		}
+		s = c + 1;
+	}
 }
 
 bool OSSerialize::initWithCapacity(unsigned int inCapacity)
@@ -143,10 +527,12 @@ bool OSSerialize::initWithCapacity(unsigned int inCapacity)
     if (!super::init())
             return false;
 
-    tags = OSDictionary::withCapacity(32);
-    if (!tags) {
+    reserved = (ExpansionData *) kalloc(sizeof(ExpansionData));
+    if (!reserved)
         return false;
-    }
+    bzero(reserved, sizeof(ExpansionData));
+    ACCUMSIZE(sizeof(ExpansionData));
+    COUNTKALLOC(1);
 
     tag = 0;
     length = 1;
@@ -163,6 +549,7 @@ bool OSSerialize::initWithCapacity(unsigned int inCapacity)
 
 
     ACCUMSIZE(capacity);
+    COUNTKALLOC(1);
 
     return true;
 }
@@ -179,7 +566,839 @@ OSSerialize *OSSerialize::withCapacity(unsigned int inCapacity)
 	return me;
 }
 
+bool OSSerialize::initWithSink(OSSerializeSink sink, void *ref,
+                               unsigned int chunkSize, unsigned int chunkCount)
+{
+    if (!sink || !chunkSize || !chunkCount || chunkSize > ((unsigned int) -1) / chunkCount)
+        return false;
+
+    // the ring is the buffer, it just never grows
+    if (!initWithCapacity(chunkSize * chunkCount))
+        return false;
+
+    reserved->vectors = (OSSerializeVector *) kalloc(chunkCount * sizeof(OSSerializeVector));
+    if (!reserved->vectors)
+        return false;
+    ACCUMSIZE(chunkCount * sizeof(OSSerializeVector));
+    COUNTKALLOC(1);
+
+    reserved->sink = sink;
+    reserved->sinkRef = ref;
+    reserved->chunkSize = chunkSize;
+    reserved->chunkCount = chunkCount;
+    length = 0;
+
+    return true;
+}
+
+OSSerialize *OSSerialize::withSink(OSSerializeSink sink, void *ref,
+                                   unsigned int chunkSize, unsigned int chunkCount)
+{
+	OSSerialize *me = new OSSerialize;
+
+	if (me && !me->initWithSink(sink, ref, chunkSize, chunkCount)) {
+		me->release();
+		return 0;
+	}
+
+	return me;
+}
+
+bool OSSerialize::streamBytes(const void *bytes, unsigned int n)
+{
+	const char *next = (const char *) bytes;
+
+	while (n) {
+		unsigned int room = capacity - length;
+
+		if (!room) {
+			if (!flush())
+				return false;
+			continue;
+		}
+
+		if (room > n)
+			room = n;
+		bcopy(next, &data[length], room);
+		length += room;
+		next += room;
+		n -= room;
+	}
+
+	return true;
+}
+
+bool OSSerialize::flush()
+{
+	unsigned int count = 0;
+
+	if (!reserved->sink || !length)
+		return true;
+
+	for (unsigned int offset = 0; offset < length; offset += reserved->chunkSize) {
+		reserved->vectors[count].base = &data[offset];
+		reserved->vectors[count].length = (length - offset < reserved->chunkSize)
+		                                  ? length - offset : reserved->chunkSize;
+		count++;
+	}
+	length = 0;
+
+	return reserved->sink(reserved->sinkRef, reserved->vectors, count);
+}
+
+/*
+ * Parallel serialization.
+ */
+
+typedef struct {
+    OSSerialize    *parent;
+    const OSArray  *array;
+    unsigned int    taskCount;
+    unsigned int   *lows;           // first ID handed out in each task's part
+    OSSerialize   **fragments;      // each task's output
+} ParallelContext;
+
+static inline unsigned int firstMember(unsigned int count, unsigned int task, unsigned int taskCount)
+{
+    return (unsigned int) (((u_int64_t) count * task) / taskCount);
+}
+
+void OSSerialize::serializeTask(void *context, unsigned int index)
+{
+    ParallelContext *pc = (ParallelContext *) context;
+    unsigned int count = pc->array->getCount();
+    unsigned int end = firstMember(count, index + 1, pc->taskCount);
+    OSSerialize *fragment;
+
+    fragment = (pc->parent->reserved->binary) ? binaryWithCapacity(4096) : withCapacity(4096);
+    if (!fragment)
+        return;
+
+    fragment->reserved->shared = pc->parent;
+    fragment->reserved->sharedLow = pc->lows[index];
+
+    for (unsigned int i = firstMember(count, index, pc->taskCount); i < end; i++) {
+        const OSMetaClassBase *o = pc->array->getObject(i);
+        bool ok = (fragment->reserved->binary) ? fragment->addBinaryMember(o, i + 1 == count)
+                                               : o->serialize(fragment);
+
+        if (!ok) {
+            fragment->release();
+            return;
+        }
+    }
+
+    pc->fragments[index] = fragment;
+}
+
+bool OSSerialize::addFragment(const OSSerialize *fragment)
+{
+    const char *bytes = fragment->data;
+    unsigned int n = fragment->length;
+
+    // a fragment is a whole text, with a signature or a nul to drop
+    if (reserved->binary) {
+        bytes += sizeof(kOSSerializeBinarySignature);
+        n -= sizeof(kOSSerializeBinarySignature);
+    } else
+        n--;
+
+    return appendBytes(bytes, n);
+}
+
+/*
+ * Appends already formatted output, in either format.
+ */
+bool OSSerialize::appendBytes(const void *bytes, unsigned int n)
+{
+    if (reserved->sink)
+        return streamBytes(bytes, n);
+    if (!reserved->binary)
+        return addBytes(bytes, n);
+
+    if (n > (unsigned int) -1 - length)
+        return false;
+    if (length + n > capacity && length + n > ensureCapacity(length + n))
+        return false;
+    bcopy(bytes, &data[length], n);
+    length += n;
+
+    return true;
+}
+
+bool OSSerialize::serializeInParallel(const OSArray *array, OSSerializeExecutor executor,
+                                      void *ref, unsigned int taskCount)
+{
+    ParallelContext pc;
+    unsigned int count = array->getCount();
+    bool endCollection, ok = true;
+
+    if (taskCount > count)
+        taskCount = count;
+
+    // nothing to split, or only a reference to write
+    if (taskCount < 2 || reserved->shared || reserved->idsOnly || findID(array))
+        return array->serialize(this);
+
+    pc.parent = this;
+    pc.array = array;
+    pc.taskCount = taskCount;
+    pc.lows = (unsigned int *) kalloc(taskCount * sizeof(unsigned int));
+    pc.fragments = (OSSerialize **) kalloc(taskCount * sizeof(OSSerialize *));
+    if (!pc.lows || !pc.fragments) {
+        if (pc.lows)
+            kfree(pc.lows, taskCount * sizeof(unsigned int));
+        if (pc.fragments)
+            kfree(pc.fragments, taskCount * sizeof(OSSerialize *));
+        return false;
+    }
+    bzero(pc.fragments, taskCount * sizeof(OSSerialize *));
+    COUNTKALLOC(2);
+
+    // hand out every ID, in the order serialize() would
+    endCollection = reserved->endCollection;
+    reserved->idsOnly = true;
+    previouslySerialized(array);
+    for (unsigned int i = 0, task = 0; ok && i < count; i++) {
+        if (task < taskCount && i == firstMember(count, task, taskCount))
+            pc.lows[task++] = tag;
+        ok = array->getObject(i)->serialize(this);
+    }
+    reserved->idsOnly = false;
+    reserved->endCollection = endCollection;
+
+    if (ok) {
+        if (executor)
+            executor(ref, taskCount, serializeTask, &pc);
+        else {
+            for (unsigned int task = 0; task < taskCount; task++)
+                serializeTask(&pc, task);
+        }
+
+        for (unsigned int task = 0; task < taskCount; task++)
+            ok = ok && pc.fragments[task];
+    }
+
+    if (ok) {
+        ok = (reserved->binary) ? addBinaryObject(kOSSerializeArray, count, 0)
+                                : addXMLStartTag(array, "array");
+        for (unsigned int task = 0; ok && task < taskCount; task++)
+            ok = addFragment(pc.fragments[task]);
+        if (ok && !reserved->binary)
+            ok = addXMLEndTag("array");
+    }
+
+    for (unsigned int task = 0; task < taskCount; task++) {
+        if (pc.fragments[task])
+            pc.fragments[task]->release();
+    }
+    kfree(pc.lows, taskCount * sizeof(unsigned int));
+    kfree(pc.fragments, taskCount * sizeof(OSSerialize *));
+
+    return ok;
+}
+
+/*
+ * Cached collections.
+ *
+ * A collection with kImmutable and kCacheSerialization set keeps a copy
+ * of its serialized text for each format.  The copy is taken with an
+ * OSSerialize of its own, so it is self-contained: its IDs count from 0
+ * at the collection and none of them points outside it.  In XML the copy
+ * leaves the digits of every ID out and a patch says where they go; in
+ * the binary format only references carry an ID and a patch points at
+ * their key.  The copy also lists the object behind each of its IDs and
+ * where its text starts.
+ *
+ * Splicing the copy in hands out IDs the way serializing in full would.
+ * Each object in the list that this pass has not seen yet gets the next
+ * ID and is entered in the ID table.  One it has seen, say a string the
+ * tree shares, has its text swapped for a reference, which is only done
+ * for strings: their text is a single record that holds no other ID.  A
+ * collection that shares anything else with the rest of the tree is
+ * serialized as usual.
+ *
+ * A copy is current while the updateStamp of the collection and those of
+ * all the collections inside it are what they were when it was taken.
+ * The inner ones are listed parent first, so checking stops at a changed
+ * parent before it gets to a child the parent may have let go of.
+ * Members that are not collections are taken not to change, as nothing
+ * in an immutable collection is meant to.
+ *
+ * Copies are only taken at the top, never while taking another, so the
+ * collections inside share their outer copy rather than keeping their
+ * own as well.  Nor are they taken by a parallel task, which has to use
+ * the IDs the first pass handed out.
+ *
+ * A copy is counted: one reference for the collection's slot and one for
+ * each pass splicing it in.  The slot is swapped, and a reference to what
+ * it holds taken, with the collection's gate held, so a copy replaced or
+ * flushed under a pass lives until the pass is done with it.
+ */
+
+typedef struct {
+    unsigned int offset;        // into the text
+    unsigned int id;            // counting from the collection's own, 0
+} FragmentPatch;
+
+typedef struct {
+    const OSCollection *collection;
+    unsigned int        stamp;
+} FragmentNested;
+
+typedef struct {
+    const OSMetaClassBase *object;
+    unsigned int           start;   // of its text
+    unsigned int           end;     // of its text if a string, else 0
+} FragmentObject;
+
+// followed by the objects, by ID, the nested collections, the patches and the text
+struct OSSerializeFragment {
+    unsigned int       size;        // of the allocation
+    volatile int32_t   refs;
+    unsigned int       stamp;       // the collection's updateStamp
+    unsigned int       objectCount; // IDs used, the collection's own included
+    unsigned int       nestedCount;
+    unsigned int       patchCount;
+    unsigned int       textLength;
+    unsigned int       pad;         // keeps the tables aligned
+};
+
+struct OSSerializeCapture {
+    const OSCollection *root;
+    FragmentObject     *objects;
+    unsigned int        objectCount;
+    unsigned int        objectCapacity;
+    FragmentNested     *nested;
+    unsigned int        nestedCount;
+    unsigned int        nestedCapacity;
+    FragmentPatch      *patches;
+    unsigned int        patchCount;
+    unsigned int        patchCapacity;
+    bool                failed;
+};
+
+struct OSSerializeIDMap {
+    unsigned int id;            // the ID here of the one the copy gave this index
+    bool         reference;     // seen already, so its text becomes a reference
+};
+
+#define kFragmentMaxIDDigits 10
+
+static inline const FragmentObject *fragmentObjects(const OSSerializeFragment *f)
+{
+    return (const FragmentObject *) (f + 1);
+}
+
+static inline const FragmentNested *fragmentNested(const OSSerializeFragment *f)
+{
+    return (const FragmentNested *) (fragmentObjects(f) + f->objectCount);
+}
+
+static inline const FragmentPatch *fragmentPatches(const OSSerializeFragment *f)
+{
+    return (const FragmentPatch *) (fragmentNested(f) + f->nestedCount);
+}
+
+static inline const char *fragmentText(const OSSerializeFragment *f)
+{
+    return (const char *) (fragmentPatches(f) + f->patchCount);
+}
+
+static inline void closeGate(volatile u_int32_t *gate)
+{
+    while (!OSAtomicCompareAndSwap32(0, 1, gate))
+        ;
+}
+
+static inline void openGate(volatile u_int32_t *gate)
+{
+    OSMemoryBarrier();
+    *gate = 0;
+}
+
+static bool growList(void **list, unsigned int count, unsigned int *capacity, size_t elementSize)
+{
+    unsigned int newCapacity = (*capacity) ? 2 * *capacity : 16;
+    void *newList;
+
+    if (newCapacity > ((unsigned int) -1) / elementSize)
+        return false;
+    newList = kalloc(newCapacity * elementSize);
+    if (!newList)
+        return false;
+    ACCUMSIZE(newCapacity * elementSize);
+    COUNTKALLOC(1);
+
+    if (*list) {
+        bcopy(*list, newList, count * elementSize);
+        kfree(*list, *capacity * elementSize);
+        ACCUMSIZE( -(*capacity * elementSize) );
+    }
+    *list = newList;
+    *capacity = newCapacity;
+
+    return true;
+}
+
+static bool addNested(OSSerializeCapture *capture, const OSCollection *c, unsigned int stamp)
+{
+    if (capture->nestedCount == capture->nestedCapacity
+     && !growList((void **) &capture->nested, capture->nestedCount,
+                  &capture->nestedCapacity, sizeof(FragmentNested))) {
+        capture->failed = true;
+        return false;
+    }
+
+    capture->nested[capture->nestedCount].collection = c;
+    capture->nested[capture->nestedCount].stamp = stamp;
+    capture->nestedCount++;
+
+    return true;
+}
+
+/*
+ * Notes that the ID goes at the end of the text so far.
+ */
+bool OSSerialize::addPatch(unsigned int id)
+{
+    OSSerializeCapture *capture = reserved->capture;
+
+    if (capture->patchCount == capture->patchCapacity
+     && !growList((void **) &capture->patches, capture->patchCount,
+                  &capture->patchCapacity, sizeof(FragmentPatch))) {
+        capture->failed = true;
+        return false;
+    }
+
+    // a copy is always buffered, behind a signature or ahead of a nul
+    capture->patches[capture->patchCount].offset =
+        (reserved->binary) ? length - sizeof(kOSSerializeBinarySignature) : length - 1;
+    capture->patches[capture->patchCount].id = id;
+    capture->patchCount++;
+
+    return true;
+}
+
+/*
+ * Notes that the object with the next ID starts at the end of the text so far.
+ */
+bool OSSerialize::addCapturedObject(const OSMetaClassBase *o)
+{
+    OSSerializeCapture *capture = reserved->capture;
+    FragmentObject *object;
+
+    if (capture->objectCount == capture->objectCapacity
+     && !growList((void **) &capture->objects, capture->objectCount,
+                  &capture->objectCapacity, sizeof(FragmentObject))) {
+        capture->failed = true;
+        return false;
+    }
+
+    object = &capture->objects[capture->objectCount++];
+    object->object = o;
+    object->start = (reserved->binary) ? length - sizeof(kOSSerializeBinarySignature) : length - 1;
+    object->end = 0;
+
+    return true;
+}
+
+/*
+ * Where the text of a string starting at start ends, or 0 if it is not
+ * a string.  Its XML holds no '<' but the one of its end tag, as the
+ * string is escaped and the copy leaves its ID out.
+ */
+static unsigned int stringEnd(const char *text, unsigned int length, unsigned int start, bool binary)
+{
+    static const char startTag[] = "<string ID=\"";
+    unsigned int end;
+
+    if (binary) {
+        u_int32_t key = *(const u_int32_t *) (text + start);
+
+        if ((key & kOSSerializeTypeMask) != kOSSerializeString
+         && (key & kOSSerializeTypeMask) != kOSSerializeSymbol)
+            return 0;
+        return start + sizeof(key) + (((key & kOSSerializeDataMask) + 3) & ~3U);
+    }
+
+    if (length - start < sizeof(startTag) - 1
+     || strncmp(text + start, startTag, sizeof(startTag) - 1))
+        return 0;
+    for (end = start + 1; end < length && text[end] != '<'; end++)
+        ;
+    for (; end < length && text[end] != '>'; end++)
+        ;
+
+    return (end < length) ? end + 1 : 0;
+}
+
+static void freeFragment(OSSerializeFragment *fragment)
+{
+    unsigned int size = fragment->size;
+
+    kfree(fragment, size);
+    ACCUMSIZE( -size );
+}
+
+void OSSerialize::releaseFragment(OSSerializeFragment *fragment)
+{
+    if (!OSAtomicAdd32(-1, &fragment->refs))
+        freeFragment(fragment);
+}
+
+bool OSSerialize::fragmentIsCurrent(const OSCollection *c, const OSSerializeFragment *fragment)
+{
+    const FragmentNested *nested;
+
+    if (!fragment || fragment->stamp != c->updateStamp)
+        return false;
+
+    nested = fragmentNested(fragment);
+    for (unsigned int i = 0; i < fragment->nestedCount; i++) {
+        if (nested[i].collection->updateStamp != nested[i].stamp)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Takes a copy of c and puts it in c's slot, returning it with a
+ * reference for the caller.
+ */
+OSSerializeFragment *OSSerialize::captureFragment(const OSCollection *c)
+{
+    OSCollection::ExpansionData *cReserved = c->fReserved;
+    OSSerializeFragment *fragment = 0, *old;
+    OSSerializeCapture capture;
+    unsigned int stamp = c->updateStamp;
+    OSSerialize *copy;
+
+    bzero(&capture, sizeof(capture));
+    capture.root = c;
+
+    copy = (reserved->binary) ? binaryWithCapacity(4096) : withCapacity(4096);
+    if (!copy)
+        return 0;
+    copy->reserved->capture = &capture;
+
+    if (c->serialize(copy) && !capture.failed && capture.objectCount == copy->tag) {
+        const char *text = copy->data;
+        unsigned int textLength = copy->length;
+        size_t size;
+
+        if (copy->reserved->binary) {
+            text += sizeof(kOSSerializeBinarySignature);
+            textLength -= sizeof(kOSSerializeBinarySignature);
+        } else
+            textLength--;
+
+        for (unsigned int i = 1; i < capture.objectCount; i++) {
+            capture.objects[i].end = stringEnd(text, textLength, capture.objects[i].start,
+                                               copy->reserved->binary);
+        }
+
+        size = sizeof(OSSerializeFragment)
+             + (size_t) capture.objectCount * sizeof(FragmentObject)
+             + (size_t) capture.nestedCount * sizeof(FragmentNested)
+             + (size_t) capture.patchCount * sizeof(FragmentPatch)
+             + textLength;
+        if (size <= (unsigned int) -1)
+            fragment = (OSSerializeFragment *) kalloc(size);
+
+        if (fragment) {
+            ACCUMSIZE(size);
+            COUNTKALLOC(1);
+            fragment->size = (unsigned int) size;
+            fragment->refs = 2;     // the slot's and the caller's
+            fragment->stamp = stamp;
+            fragment->objectCount = capture.objectCount;
+            fragment->nestedCount = capture.nestedCount;
+            fragment->patchCount = capture.patchCount;
+            fragment->textLength = textLength;
+            fragment->pad = 0;
+            bcopy(capture.objects, (void *) fragmentObjects(fragment),
+                  capture.objectCount * sizeof(FragmentObject));
+            bcopy(capture.nested, (void *) fragmentNested(fragment),
+                  capture.nestedCount * sizeof(FragmentNested));
+            bcopy(capture.patches, (void *) fragmentPatches(fragment),
+                  capture.patchCount * sizeof(FragmentPatch));
+            bcopy(text, (void *) fragmentText(fragment), textLength);
+        }
+    }
+
+    copy->reserved->capture = 0;
+    copy->release();
+    if (capture.objects) {
+        kfree(capture.objects, capture.objectCapacity * sizeof(FragmentObject));
+        ACCUMSIZE( -(capture.objectCapacity * sizeof(FragmentObject)) );
+    }
+    if (capture.nested) {
+        kfree(capture.nested, capture.nestedCapacity * sizeof(FragmentNested));
+        ACCUMSIZE( -(capture.nestedCapacity * sizeof(FragmentNested)) );
+    }
+    if (capture.patches) {
+        kfree(capture.patches, capture.patchCapacity * sizeof(FragmentPatch));
+        ACCUMSIZE( -(capture.patchCapacity * sizeof(FragmentPatch)) );
+    }
+
+    if (!fragment)
+        return 0;
+
+    closeGate(&cReserved->gate);
+    old = cReserved->fragments[reserved->binary];
+    if (fragmentIsCurrent(c, old)) {
+        // another pass got there first
+        OSAtomicAdd32(1, &old->refs);
+        openGate(&cReserved->gate);
+        freeFragment(fragment);
+        return old;
+    }
+    cReserved->fragments[reserved->binary] = fragment;
+    openGate(&cReserved->gate);
+
+    // a pass still splicing the stale one in holds a reference of its own
+    if (old)
+        releaseFragment(old);
+
+    return fragment;
+}
+
+/*
+ * Works out the ID here of each object in the copy, as previouslySerialized()
+ * would hand them out, without entering any.  Fails if one seen already is
+ * not a string, as only a string's text is simple enough to swap for a
+ * reference.
+ */
+bool OSSerialize::mapFragment(const OSSerializeFragment *fragment, unsigned int base)
+{
+    const FragmentObject *objects = fragmentObjects(fragment);
+    OSSerializeIDMap *map;
+    unsigned int next = tag;
+
+    // nothing in the map is kept from one copy to the next
+    if (fragment->objectCount > reserved->idMapCapacity) {
+        unsigned int capacity = fragment->objectCount;
+
+        if (capacity > ((unsigned int) -1) / sizeof(OSSerializeIDMap))
+            return false;
+        map = (OSSerializeIDMap *) kalloc(capacity * sizeof(OSSerializeIDMap));
+        if (!map)
+            return false;
+        ACCUMSIZE(capacity * sizeof(OSSerializeIDMap));
+        COUNTKALLOC(1);
+
+        if (reserved->idMap) {
+            kfree(reserved->idMap, reserved->idMapCapacity * sizeof(OSSerializeIDMap));
+            ACCUMSIZE( -(reserved->idMapCapacity * sizeof(OSSerializeIDMap)) );
+        }
+        reserved->idMap = map;
+        reserved->idMapCapacity = capacity;
+    }
+
+    map = reserved->idMap;
+    map[0].id = base;
+    map[0].reference = false;
+
+    for (unsigned int i = 1; i < fragment->objectCount; i++) {
+        IDEntry *entry = findID(objects[i].object);
+        bool reference = (entry != 0);
+
+        if (!entry && reserved->shared) {
+            // a parallel task, as previouslySerialized() decides there
+            entry = reserved->shared->findID(objects[i].object);
+            if (!entry)
+                return false;
+            reference = (entry->id < reserved->sharedLow);
+        }
+        if (reference && !objects[i].end)
+            return false;
+
+        map[i].id = (entry) ? entry->id : next++;
+        map[i].reference = reference;
+    }
+
+    return true;
+}
+
+bool OSSerialize::cacheCollection(const OSCollection *c)
+{
+    OSSerializeCapture *capture = reserved->capture;
+    OSCollection::ExpansionData *cReserved = c->fReserved;
+    OSSerializeFragment *fragment;
+    unsigned int base;
+
+    if (reserved->cached) {
+        releaseFragment(reserved->cached);
+        reserved->cached = 0;
+    }
+
+    if (capture) {
+        // the copy being taken lists every collection inside it
+        if (c != capture->root)
+            addNested(capture, c, c->updateStamp);
+        return false;
+    }
+
+    if ((c->fOptions & (OSCollection::kImmutable | OSCollection::kCacheSerialization))
+          != (OSCollection::kImmutable | OSCollection::kCacheSerialization)
+     || !cReserved || reserved->failed)
+        return false;
+
+    if (c == reserved->lastObject)
+        base = reserved->lastID;
+    else {
+        IDEntry *entry = findID(c);
+
+        if (!entry)
+            return false;
+        base = entry->id;
+    }
+
+    closeGate(&cReserved->gate);
+    fragment = cReserved->fragments[reserved->binary];
+    if (fragment)
+        OSAtomicAdd32(1, &fragment->refs);
+    openGate(&cReserved->gate);
+
+    if (!fragmentIsCurrent(c, fragment)) {
+        if (fragment)
+            releaseFragment(fragment);
+        if (reserved->shared)
+            return false;
+        fragment = captureFragment(c);
+        if (!fragment)
+            return false;
+    }
+
+    if (!mapFragment(fragment, base)) {
+        releaseFragment(fragment);
+        return false;
+    }
+
+    reserved->cached = fragment;
+    return true;
+}
+
+bool OSSerialize::addCachedCollection(const OSCollection *c)
+{
+    OSSerializeFragment *fragment = reserved->cached;
+    bool ok;
+
+    reserved->cached = 0;
+    if (!fragment)
+        return false;
+
+    // the copy's first object is the collection it was taken of
+    ok = (fragmentObjects(fragment)->object == c) && spliceFragment(fragment);
+    releaseFragment(fragment);
+
+    return ok;
+}
+
+bool OSSerialize::spliceFragment(const OSSerializeFragment *fragment)
+{
+    const OSSerializeIDMap *map = reserved->idMap;
+    const FragmentObject *objects = fragmentObjects(fragment);
+    const FragmentPatch *patch = fragmentPatches(fragment);
+    const FragmentPatch *lastPatch = patch + fragment->patchCount;
+    const char *text = fragmentText(fragment);
+    unsigned int next = 0;
+
+    // the ones not seen yet, in the order previouslySerialized() would enter them
+    for (unsigned int i = 1; i < fragment->objectCount; i++) {
+        if (map[i].reference)
+            continue;
+        if (!addID(objects[i].object, map[i].id))
+            return false;
+        if (!reserved->shared)
+            tag++;
+    }
+    if (reserved->idsOnly)
+        return true;
+
+    // grow once for the lot
+    if (!reserved->sink) {
+        u_int64_t need = (u_int64_t) length + fragment->textLength;
+
+        if (!reserved->binary)
+            need += (u_int64_t) fragment->patchCount * kFragmentMaxIDDigits;
+        if (need <= (unsigned int) -1)
+            ensureCapacity((unsigned int) need);
+    }
+
+    if (reserved->binary) {
+        // the collection's own record, which ends the collection it is in or not
+        u_int32_t key = *(const u_int32_t *) text & ~kOSSerializeEndCollection;
+
+        if (reserved->endCollection) {
+            reserved->endCollection = false;
+            key |= kOSSerializeEndCollection;
+        }
+        if (!appendBytes(&key, sizeof(key)))
+            return false;
+        next = sizeof(key);
+    }
+
+    // the patches and the strings to swap, both in the order of the text
+    for (unsigned int i = 1; ; ) {
+        while (i < fragment->objectCount && !map[i].reference)
+            i++;
+
+        if (i < fragment->objectCount
+         && (patch == lastPatch || objects[i].start < patch->offset)) {
+            if (!appendBytes(text + next, objects[i].start - next))
+                return false;
+            if (reserved->binary) {
+                reserved->endCollection =
+                    (*(const u_int32_t *) (text + objects[i].start) & kOSSerializeEndCollection) != 0;
+            }
+            if (!addReference(map[i].id))
+                return false;
+            next = objects[i].end;
+            i++;
+
+            // the string's own ID
+            while (patch < lastPatch && patch->offset < next)
+                patch++;
+            continue;
+        }
+
+        if (patch == lastPatch)
+            break;
+
+        unsigned int id = map[patch->id].id;
+
+        if (!appendBytes(text + next, patch->offset - next))
+            return false;
+
+        if (reserved->binary) {
+            u_int32_t key = *(const u_int32_t *) (text + patch->offset);
+
+            if (id > kOSSerializeDataMask)
+                return false;
+            key = (key & ~kOSSerializeDataMask) | id;
+            if (!appendBytes(&key, sizeof(key)))
+                return false;
+            next = patch->offset + sizeof(key);
+        } else {
+            if (!addXMLID(id))
+                return false;
+            next = patch->offset;
+        }
+        patch++;
+    }
+
+    return appendBytes(text + next, fragment->textLength - next);
+}
+
 unsigned int OSSerialize::getLength() const { return length; }
+
+u_int64_t OSSerialize::getAllocationCount()
+{
+    return sKallocCount;
+}
 unsigned int OSSerialize::getCapacity() const { return capacity; }
 unsigned int OSSerialize::getCapacityIncrement() const { return capacityIncrement; }
 unsigned int OSSerialize::setCapacityIncrement(unsigned int increment)
@@ -194,9 +1413,14 @@ unsigned int OSSerialize::ensureCapacity(unsigned int newCapacity)
 	int newSize;
 	int oldSize;
 	
-	if (newCapacity <= capacity)
+	// a streaming ring never grows
+	if (newCapacity <= capacity || reserved->sink)
 		return capacity;
 
+    // at least double, so that appending n bytes copies O(n) in all
+    if (newCapacity < 2 * capacity && capacity < ((unsigned int) -1) / 2)
+        newCapacity = 2 * capacity;
+
     newCapacity = (((newCapacity - 1) / capacityIncrement) + 1)
 	* capacityIncrement;
     newSize = sizeof(char) * newCapacity;
@@ -205,10 +1429,12 @@ unsigned int OSSerialize::ensureCapacity(unsigned int newCapacity)
     if (newData) {
         oldSize = sizeof(char) * capacity;
 		
-        bcopy((void*)data, (void*)newData, oldSize);
-        bzero(&newData[capacity], newSize - oldSize);
+        // only the text is worth keeping, it is always nul-terminated
+        bcopy((void*)data, (void*)newData, length);
 		
-        kfree((void*)data, 0);
+        kfree((void*)data, oldSize);
+        ACCUMSIZE(newSize - oldSize);
+        COUNTKALLOC(1);
 		
         data = newData;
         capacity = newCapacity;
@@ -222,8 +1448,25 @@ unsigned int OSSerialize::ensureCapacity(unsigned int newCapacity)
 
 void OSSerialize::free()
 {
-    if (tags)
-        tags->release();
+    if (reserved) {
+        if (reserved->ids) {
+            clearIDs();
+            kfree(reserved->ids, reserved->idCapacity * sizeof(IDEntry));
+            ACCUMSIZE( -(reserved->idCapacity * sizeof(IDEntry)) );
+        }
+        if (reserved->vectors) {
+            kfree(reserved->vectors, reserved->chunkCount * sizeof(OSSerializeVector));
+            ACCUMSIZE( -(reserved->chunkCount * sizeof(OSSerializeVector)) );
+        }
+        if (reserved->cached)
+            releaseFragment(reserved->cached);
+        if (reserved->idMap) {
+            kfree(reserved->idMap, reserved->idMapCapacity * sizeof(OSSerializeIDMap));
+            ACCUMSIZE( -(reserved->idMapCapacity * sizeof(OSSerializeIDMap)) );
+        }
+        kfree(reserved, sizeof(ExpansionData));
+        ACCUMSIZE( -sizeof(ExpansionData) );
+    }
 
     if (data) {
 		kfree(data, capacity);
@@ -254,7 +1497,35 @@ OSSerializer * OSSerializer::forTarget( void * target,
     return( thing );
 }
 
+OSSerializer * OSSerializer::forTarget( void * target,
+                               OSSerializerVectorCallback callback, void * ref )
+{
+    OSSerializer * thing;
+
+    thing = new OSSerializer;
+    if( thing && !thing->init()) {
+	thing->release();
+	thing = 0;
+    }
+
+    if( thing) {
+	thing->target	= target;
+        thing->ref	= ref;
+        thing->vectorCallback = callback;
+    }
+    return( thing );
+}
+
 bool OSSerializer::serialize( OSSerialize * s ) const
 {
+    if (vectorCallback) {
+        const OSSerializeVector * vectors = 0;
+        unsigned int count = 0;
+
+        if (!(*vectorCallback)(target, ref, &vectors, &count))
+            return( false );
+        return( s->addVectors(vectors, count) );
+    }
+
     return( (*callback)(target, ref, s) );
 }
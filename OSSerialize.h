@@ -31,9 +31,15 @@
 #define _OS_OSSERIALIZE_H
 
 #include "OSObject.h"
+#include "OSCollection.h"
 
+class OSArray;
+class OSCollection;
 class OSSet;
 class OSDictionary;
+struct OSSerializeCapture;
+struct OSSerializeFragment;
+struct OSSerializeIDMap;
 
 /*!
  * @header
@@ -41,6 +47,102 @@ class OSDictionary;
  * @abstract
  * This header declares the OSSerialize class.
  */
+
+/*!
+ * @enum OSSerializeBinary
+ *
+ * @abstract
+ * Record keys of the binary serialization format.
+ *
+ * @discussion
+ * A binary stream starts with
+ * <code>kOSSerializeBinarySignature</code>
+ * followed by the records of one object.
+ * Every record is a 32-bit key in host byte order,
+ * holding a type and a 24-bit length,
+ * followed by <code>length</code> bytes of payload
+ * padded to the next multiple of 4.
+ *
+ * For collections the length is the number of members
+ * and the members follow as records of their own;
+ * a dictionary lists each key symbol before its value.
+ * For strings and symbols the payload is the characters
+ * including the terminating nul.
+ * A <code>kOSSerializeObject</code> record has no payload,
+ * its length is the index of an earlier record,
+ * counting every record except references from 0.
+ * The last member of each collection, and the top-level object,
+ * has <code>kOSSerializeEndCollection</code> set.
+ */
+enum {
+    kOSSerializeDictionary    = 0x01000000U,
+    kOSSerializeArray         = 0x02000000U,
+    kOSSerializeSet           = 0x03000000U,
+    kOSSerializeSymbol        = 0x08000000U,
+    kOSSerializeString        = 0x09000000U,
+    kOSSerializeObject        = 0x0c000000U,
+
+    kOSSerializeTypeMask      = 0x7F000000U,
+    kOSSerializeDataMask      = 0x00FFFFFFU,
+
+    kOSSerializeEndCollection = 0x80000000U
+};
+
+#define kOSSerializeBinarySignature "\323\0\0"
+
+/*!
+ * @typedef OSSerializeVector
+ *
+ * @abstract
+ * One fragment of serialized output, like a <code>struct iovec</code>.
+ *
+ * @field base   The first byte.
+ * @field length The number of bytes.
+ */
+typedef struct {
+    const void   * base;
+    unsigned int   length;
+} OSSerializeVector;
+
+/*!
+ * @typedef OSSerializeSink
+ *
+ * @abstract
+ * Receives the output of a streaming OSSerialize.
+ *
+ * @param ref     The reference given when the OSSerialize was created.
+ * @param vectors The output, in order.
+ * @param count   The number of vectors.
+ *
+ * @result
+ * <code>true</code> to continue,
+ * <code>false</code> to make serialization fail.
+ *
+ * @discussion
+ * The vectors point into the OSSerialize's own buffer
+ * and are only valid until the sink returns.
+ */
+typedef bool (*OSSerializeSink)(
+    void                    * ref,
+    const OSSerializeVector * vectors,
+    unsigned int              count);
+
+/*!
+ * @typedef OSSerializeWork
+ *
+ * @abstract
+ * The same as @link OSCollectionWork OSCollectionWork@/link.
+ */
+typedef OSCollectionWork OSSerializeWork;
+
+/*!
+ * @typedef OSSerializeExecutor
+ *
+ * @abstract
+ * Runs tasks for a parallel serialization;
+ * the same as @link OSCollectionExecutor OSCollectionExecutor@/link.
+ */
+typedef OSCollectionExecutor OSSerializeExecutor;
  
  
 /*!
@@ -48,9 +150,17 @@ class OSDictionary;
  *
  * @abstract
  * OSSerialize coordinates serialization of Libkern C++ objects
- * into an XML stream.
+ * into an XML stream, or into the more compact binary format
+ * described by @link OSSerializeBinary OSSerializeBinary@/link.
  *
  * @discussion
+ * By default the output accumulates in one buffer
+ * that grows to hold all of it.
+ * A streaming OSSerialize instead writes into a fixed ring of chunks
+ * and hands them to an @link OSSerializeSink OSSerializeSink@/link
+ * whenever the ring fills,
+ * so output of any size takes a fixed amount of memory.
+ *
  * This class is for the most part internal to the OSContainer classes,
  * used for transferring property tables between the kernel and user space.
  * It should not be used directly.
@@ -80,20 +190,73 @@ class OSSerialize : public OSObject
 {
     OSDeclareDefaultStructors(OSSerialize)
 
+    friend class OSCollection;
+
 protected:
     char         * data;               // container for serialized data
     unsigned int   length;             // of serialized data (counting NULL)
     unsigned int   capacity;           // of container
     unsigned int   capacityIncrement;  // of container
 
-    unsigned int   tag;
-    OSDictionary * tags;               // tags for all objects seen
-
-    struct ExpansionData { };
+    unsigned int   tag;                // next ID to hand out
+    OSDictionary * tags;               // unused, IDs live in reserved->ids
+
+    struct IDEntry {
+        const OSMetaClassBase * object;
+        unsigned int            id;
+    };
+
+    struct ExpansionData {
+        bool binary;            // writing the binary format
+        bool endCollection;     // next record ends its collection
+
+        OSSerializeSink     sink;       // streaming if set
+        void              * sinkRef;
+        unsigned int        chunkSize;
+        unsigned int        chunkCount;
+        OSSerializeVector * vectors;    // chunkCount of them
+
+        IDEntry           * ids;        // open addressed, by object
+        unsigned int        idCount;
+        unsigned int        idCapacity; // power of 2
+        const OSMetaClassBase * lastObject; // last one given an ID
+        unsigned int        lastID;
+
+        bool                idsOnly;    // handing out IDs without writing
+        bool                failed;     // an ID or reference could not be written
+        const OSSerialize * shared;     // IDs handed out for a parallel pass
+        unsigned int        sharedLow;  // IDs from here on were first seen by us
+
+        OSSerializeCapture  * capture;  // taking a cached copy
+        OSSerializeFragment * cached;   // found by cacheCollection()
+        OSSerializeIDMap    * idMap;    // where its IDs go, by cacheCollection()
+        unsigned int        idMapCapacity;
+
+        unsigned int        spanLength; // handed out by reserveBytes()
+    };
     
     /* Reserved for future use. (Internal use only)  */
     ExpansionData *reserved;
 
+    bool initWithSink(OSSerializeSink sink, void * ref,
+                      unsigned int chunkSize, unsigned int chunkCount);
+    bool streamBytes(const void * bytes, unsigned int length);
+    IDEntry * findID(const OSMetaClassBase * object) const;
+    bool addID(const OSMetaClassBase * object, unsigned int id);
+    void clearIDs();
+    bool addFragment(const OSSerialize * fragment);
+    static void serializeTask(void * context, unsigned int index);
+    bool appendBytes(const void * bytes, unsigned int length);
+    bool addXMLID(unsigned int id);
+    bool addReference(unsigned int id);
+    bool addPatch(unsigned int id);
+    bool addCapturedObject(const OSMetaClassBase * object);
+    OSSerializeFragment * captureFragment(const OSCollection * collection);
+    static bool fragmentIsCurrent(const OSCollection * collection,
+                                  const OSSerializeFragment * fragment);
+    static void releaseFragment(OSSerializeFragment * fragment);
+    bool mapFragment(const OSSerializeFragment * fragment, unsigned int base);
+    bool spliceFragment(const OSSerializeFragment * fragment);
 
 public:
 
@@ -115,6 +278,145 @@ public:
     */
     static OSSerialize * withCapacity(unsigned int capacity);
 
+   /*!
+    * @function binaryWithCapacity
+    *
+    * @abstract
+    * Creates and initializes an empty OSSerialize object
+    * that writes the binary format.
+    *
+    * @param  capacity The initial size of the buffer.
+    *
+    * @result
+    * A new instance of OSSerialize
+    * with a retain count of 1;
+    * <code>NULL</code> on failure.
+    *
+    * @discussion
+    * Objects are serialized through the same
+    * <code>serialize</code> functions as for XML.
+    * The output is the bytes at <code>text()</code>,
+    * <code>getLength()</code> of them; it is not nul-terminated.
+    * See @link OSSerializeBinary OSSerializeBinary@/link for the format.
+    */
+    static OSSerialize * binaryWithCapacity(unsigned int capacity);
+
+   /*!
+    * @function withSink
+    *
+    * @abstract
+    * Creates and initializes an OSSerialize object
+    * that streams XML to a sink.
+    *
+    * @param sink       The function that receives the output.
+    * @param ref        Passed on to <code>sink</code>.
+    * @param chunkSize  The size of each chunk of the ring.
+    * @param chunkCount The number of chunks in the ring.
+    *
+    * @result
+    * A new instance of OSSerialize
+    * with a retain count of 1;
+    * <code>NULL</code> on failure.
+    *
+    * @discussion
+    * The ring is allocated once and never grows.
+    * Each time it fills, all its chunks go to <code>sink</code> in one call.
+    * Call <code>@link flush flush@/link</code>
+    * after serializing to pass on the rest.
+    * The text is not nul-terminated,
+    * and <code>text()</code> and <code>getLength()</code>
+    * only describe what has not been flushed yet.
+    */
+    static OSSerialize * withSink(
+        OSSerializeSink sink,
+        void          * ref,
+        unsigned int    chunkSize,
+        unsigned int    chunkCount);
+
+   /*!
+    * @function binaryWithSink
+    *
+    * @abstract
+    * Creates and initializes an OSSerialize object
+    * that streams the binary format to a sink.
+    *
+    * @discussion
+    * Like <code>@link withSink withSink@/link</code>,
+    * for the format written by
+    * <code>@link binaryWithCapacity binaryWithCapacity@/link</code>.
+    * <code>chunkSize</code> must be a multiple of 4.
+    */
+    static OSSerialize * binaryWithSink(
+        OSSerializeSink sink,
+        void          * ref,
+        unsigned int    chunkSize,
+        unsigned int    chunkCount);
+
+   /*!
+    * @function getAllocationCount
+    *
+    * @abstract
+    * Reports how many allocations OSSerialize has made from kalloc.
+    *
+    * @discussion
+    * Counts the text buffers and each time one grows,
+    * the tables of IDs and each time one grows,
+    * and the rest of the bookkeeping,
+    * over every OSSerialize object so far.
+    * The objects themselves come from zones,
+    * which <code>OSZoneGetStatistics</code> counts.
+    */
+    static u_int64_t getAllocationCount();
+
+   /*!
+    * @function flush
+    *
+    * @abstract
+    * Hands all output not yet passed on to the sink.
+    *
+    * @result
+    * <code>true</code> if there is no sink, nothing to flush,
+    * or the sink accepted the output; <code>false</code> otherwise.
+    */
+    bool flush();
+
+   /*!
+    * @function serializeInParallel
+    *
+    * @abstract
+    * Serializes an array, splitting the work on its members
+    * across an executor.
+    *
+    * @param array     The array to serialize.
+    * @param executor  Runs the tasks; <code>NULL</code> runs them in turn.
+    * @param ref       Passed on to <code>executor</code>.
+    * @param taskCount How many tasks to split the members into.
+    *
+    * @result
+    * <code>true</code> if the array
+    * is successfully serialized, <code>false</code> otherwise.
+    *
+    * @discussion
+    * The output is byte for byte what <code>array->serialize()</code>
+    * would write.
+    * A first pass walks the tree without writing anything
+    * to hand out the IDs in the usual order.
+    * Each task then serializes a run of members
+    * into a buffer of its own,
+    * reading the IDs from that pass,
+    * and the buffers are appended in order.
+    *
+    * The tree must not change while this runs,
+    * and the <code>serialize</code> functions in it
+    * must be safe to run on several threads at once;
+    * those of the libkern containers are.
+    */
+    bool serializeInParallel(
+        const OSArray       * array,
+        OSSerializeExecutor   executor,
+        void                * ref,
+        unsigned int          taskCount);
+
    /*!
     * @function text
     *
@@ -136,6 +438,8 @@ public:
     * @discussion
     * This function is a useful optimization if you are serializing
     * the same object repeatedly.
+    * A streaming OSSerialize starts a new stream
+    * and drops any output not yet flushed.
     */
     virtual void clearText();
 
@@ -155,7 +459,11 @@ public:
     * by this OSSerialize object and a reference
     * to it is successfully added to the XML stream,
     * <code>false</code> otherwise.
-    *    
+    *
+    * If the object cannot be given an ID, or its reference
+    * cannot be written, the result is <code>false</code>
+    * and the object's start tag or binary record then fails,
+    * so that its <code>serialize</code> fails in turn.
     *
     * @discussion
     * This function both reduces the size of generated XML
@@ -269,6 +577,210 @@ public:
     */
     virtual bool addString(const char * cString);
 
+
+   /*!
+    * @function addStringN
+    *
+    * @abstract
+    * Appends the first <code>length</code> characters
+    * of a string to the XML stream.
+    *
+    * @param cString The characters to append; need not be nul-terminated.
+    * @param length  The number of characters to append.
+    *
+    * @result
+    * <code>true</code> if the characters
+    * are successfully added to the XML stream, <code>false</code> otherwise.
+    *
+    * @discussion
+    * Equivalent to <code>@link addBytes addBytes@/link</code>;
+    * use it when the length is already known,
+    * to save <code>addString</code> a call to <code>strlen</code>.
+    */
+    bool addStringN(const char * cString, unsigned int length);
+
+   /*!
+    * @function addVectors
+    *
+    * @abstract
+    * Appends a list of fragments to the XML stream.
+    *
+    * @param vectors The fragments, in order.
+    * @param count   The number of fragments.
+    *
+    * @result
+    * <code>true</code> if all of the fragments
+    * are successfully added to the XML stream, <code>false</code> otherwise.
+    *
+    * @discussion
+    * The buffer is grown once for all of them
+    * and each fragment is copied in one go.
+    * Like <code>@link addBytes addBytes@/link</code>,
+    * the bytes are not escaped.
+    */
+    bool addVectors(const OSSerializeVector * vectors, unsigned int count);
+
+   /*!
+    * @function reserveBytes
+    *
+    * @abstract
+    * Hands out space at the end of the XML stream to write into directly.
+    *
+    * @param length The most bytes that will be written.
+    *
+    * @result
+    * Where to write, or <code>NULL</code> if the space cannot be had,
+    * in which case the output is unchanged.
+    *
+    * @discussion
+    * The bytes only become part of the stream through
+    * <code>@link commitBytes commitBytes@/link</code>,
+    * which must follow before anything else is added,
+    * even if nothing was written.
+    * A streaming OSSerialize cannot hand out more than its whole ring.
+    */
+    char * reserveBytes(unsigned int length);
+
+   /*!
+    * @function commitBytes
+    *
+    * @abstract
+    * Adds bytes written to the space from
+    * <code>@link reserveBytes reserveBytes@/link</code> to the stream.
+    *
+    * @param length The number of bytes written, at most the number reserved.
+    *
+    * @result
+    * <code>true</code> if the bytes are added, <code>false</code> otherwise.
+    */
+    bool commitBytes(unsigned int length);
+
+   /*!
+    * @function addXMLString
+    *
+    * @abstract
+    * Appends characters to the XML stream,
+    * escaping the ones XML reserves.
+    *
+    * @param cString The characters to append.
+    * @param length  The number of characters to append.
+    *
+    * @result
+    * <code>true</code> if the characters
+    * are successfully added to the XML stream, <code>false</code> otherwise.
+    *
+    * @discussion
+    * '&lt;', '&gt;' and '&amp;' are written as entities.
+    * The characters stop early at a nul.
+    */
+    bool addXMLString(const char * cString, unsigned int length);
+
+   /*!
+    * @function isBinary
+    *
+    * @result
+    * <code>true</code> if this object writes the binary format.
+    *
+    * @discussion
+    * <code>serialize</code> implementations check this
+    * and describe themselves with
+    * <code>@link addBinaryObject addBinaryObject@/link</code>
+    * instead of XML tags.
+    */
+    bool isBinary() const;
+
+   /*!
+    * @function addBinaryObject
+    *
+    * @abstract
+    * Appends a record to the binary stream.
+    *
+    * @param type   One of the @link OSSerializeBinary OSSerializeBinary@/link
+    *               types.
+    * @param length The member count for collections,
+    *               otherwise the size of <code>bytes</code>.
+    * @param bytes  The payload, <code>NULL</code> for collections.
+    *
+    * @result
+    * <code>true</code> if the record
+    * is successfully added to the stream, <code>false</code> otherwise.
+    *
+    * @discussion
+    * Call <code>@link previouslySerialized previouslySerialized@/link</code>
+    * first, as for XML.
+    * The members of a collection are written after its record
+    * with <code>@link addBinaryMember addBinaryMember@/link</code>.
+    */
+    bool addBinaryObject(
+        unsigned int type,
+        unsigned int length,
+        const void * bytes);
+
+   /*!
+    * @function addBinaryMember
+    *
+    * @abstract
+    * Serializes a member of the collection being written
+    * to the binary stream.
+    *
+    * @param object The member.
+    * @param last   Whether this is the collection's last member.
+    *
+    * @result
+    * <code>true</code> if the member
+    * is successfully serialized, <code>false</code> otherwise.
+    */
+    bool addBinaryMember(const OSMetaClassBase * object, bool last);
+
+   /*!
+    * @function cacheCollection
+    *
+    * @abstract
+    * Looks for a cached copy of a collection's serialized form,
+    * taking one if the collection asks for it.
+    *
+    * @param collection The collection about to be serialized in full.
+    *
+    * @result
+    * <code>true</code> if a current copy is ready for
+    * <code>@link addCachedCollection addCachedCollection@/link</code>,
+    * <code>false</code> if the collection must be serialized as usual.
+    *
+    * @discussion
+    * Only collections with both <code>kImmutable</code> and
+    * <code>kCacheSerialization</code> set through
+    * <code>OSCollection::setOptions</code> are cached.
+    * Collections call this right after
+    * <code>@link previouslySerialized previouslySerialized@/link</code>
+    * returns <code>false</code>:
+    * <pre>
+    * if (s->cacheCollection(this)) return s->addCachedCollection(this);
+    * </pre>
+    *
+    * The output is the same as without the copy.
+    * Objects that the collection shares with the rest of the tree
+    * are written as references wherever serializing in full would.
+    * A collection that shares anything but strings with the rest of
+    * the tree is serialized as usual instead.
+    */
+    bool cacheCollection(const OSCollection * collection);
+
+   /*!
+    * @function addCachedCollection
+    *
+    * @abstract
+    * Appends the copy found by
+    * <code>@link cacheCollection cacheCollection@/link</code>.
+    *
+    * @param collection The collection passed to <code>cacheCollection</code>.
+    *
+    * @result
+    * <code>true</code> if the copy
+    * is successfully added to the stream, <code>false</code> otherwise,
+    * as when <code>collection</code> is not the one the copy was found for.
+    */
+    bool addCachedCollection(const OSCollection * collection);
+
     // stuff you should never have to use (in theory)
 
     virtual bool initWithCapacity(unsigned int inCapacity);
@@ -279,7 +791,29 @@ public:
     virtual unsigned int ensureCapacity(unsigned int newCapacity);
     virtual void free();
 
-    OSMetaClassDeclareReservedUnused(OSSerialize, 0);
+    OSMetaClassDeclareReservedUsed(OSSerialize, 0);
+
+   /*!
+    * @function addBytes
+    *
+    * @abstract
+    * Appends a run of bytes to the XML stream.
+    *
+    * @param bytes  The bytes to append.
+    * @param length The number of bytes to append.
+    *
+    * @result
+    * <code>true</code> if the bytes
+    * are successfully added to the XML stream, <code>false</code> otherwise.
+    *
+    * @discussion
+    * The buffer is grown at most once and the bytes are copied in one go,
+    * which makes this much cheaper than repeated calls to
+    * <code>@link addChar addChar@/link</code>.
+    * The bytes are not escaped in any way.
+    */
+    virtual bool addBytes(const void * bytes, unsigned int length);
+
     OSMetaClassDeclareReservedUnused(OSSerialize, 1);
     OSMetaClassDeclareReservedUnused(OSSerialize, 2);
     OSMetaClassDeclareReservedUnused(OSSerialize, 3);
@@ -294,6 +828,30 @@ public:
 typedef bool (*OSSerializerCallback)(void * target, void * ref,
                                      OSSerialize * serializer);
 
+/*!
+ * @typedef OSSerializerVectorCallback
+ *
+ * @abstract
+ * Describes a target's serialized form as a list of fragments.
+ *
+ * @param target  The target given to <code>OSSerializer::forTarget</code>.
+ * @param ref     The reference given to <code>OSSerializer::forTarget</code>.
+ * @param vectors Set to the fragments, in order.
+ * @param count   Set to the number of fragments.
+ *
+ * @result
+ * <code>true</code> on success, <code>false</code> to fail serialization.
+ *
+ * @discussion
+ * The fragments are appended with
+ * <code>OSSerialize::addVectors</code>;
+ * they must stay valid until the OSSerializer's
+ * <code>serialize</code> returns.
+ */
+typedef bool (*OSSerializerVectorCallback)(void * target, void * ref,
+                                           const OSSerializeVector ** vectors,
+                                           unsigned int * count);
+
 class OSSerializer : public OSObject
 {
     OSDeclareDefaultStructors(OSSerializer)
@@ -301,6 +859,7 @@ class OSSerializer : public OSObject
     void * target;
     void * ref;
     OSSerializerCallback callback;
+    OSSerializerVectorCallback vectorCallback;
     
 public:
 
@@ -309,6 +868,11 @@ public:
         OSSerializerCallback callback,
         void * ref = 0);
 
+    static OSSerializer * forTarget(
+        void * target,
+        OSSerializerVectorCallback callback,
+        void * ref = 0);
+
     virtual bool serialize(OSSerialize * serializer) const;
 };
 
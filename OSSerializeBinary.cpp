@@ -0,0 +1,329 @@
+/*
+ * OSSerializeBinary
+ * Passenger libkern
+ *
+ * Binary form of OSSerialize.
+ */
+
+#include "OSArray.h"
+#include "OSDictionary.h"
+#include "OSSerialize.h"
+#include "OSSet.h"
+#include "OSSymbol.h"
+#include "OSUnserialize.h"
+
+OSSerialize *OSSerialize::binaryWithCapacity(unsigned int inCapacity)
+{
+	OSSerialize *me;
+
+	if (inCapacity < sizeof(kOSSerializeBinarySignature))
+		inCapacity = sizeof(kOSSerializeBinarySignature);
+
+	me = OSSerialize::withCapacity(inCapacity);
+	if (me) {
+		me->reserved->binary = true;
+		me->clearText();
+	}
+
+	return me;
+}
+
+OSSerialize *OSSerialize::binaryWithSink(OSSerializeSink sink, void *ref,
+                                         unsigned int chunkSize, unsigned int chunkCount)
+{
+	OSSerialize *me;
+
+	// keeps each 4 byte word of the stream within one chunk
+	if (chunkSize & 3)
+		return 0;
+
+	me = OSSerialize::withSink(sink, ref, chunkSize, chunkCount);
+	if (me) {
+		me->reserved->binary = true;
+		me->clearText();
+	}
+
+	return me;
+}
+
+bool OSSerialize::addBinaryObject(unsigned int type, unsigned int n, const void *bytes)
+{
+	unsigned int size = (bytes) ? (n + 3) & ~3U : 0;
+	u_int32_t key;
+
+	if (!reserved->binary || n > kOSSerializeDataMask || reserved->failed)
+		return false;
+	if (reserved->idsOnly)
+		return true;
+	if (length > (unsigned int) -1 - sizeof(key) - size)
+		return false;
+
+	key = type | n;
+	if (reserved->endCollection) {
+		reserved->endCollection = false;
+		key |= kOSSerializeEndCollection;
+	}
+
+	if (reserved->sink) {
+		static const char zeros[3] = { 0, 0, 0 };
+
+		return streamBytes(&key, sizeof(key))
+		    && (!size || (streamBytes(bytes, n) && streamBytes(zeros, size - n)));
+	}
+
+	// length is a multiple of 4, and so is every record
+	if (length + sizeof(key) + size > capacity
+	 && length + sizeof(key) + size > ensureCapacity(length + sizeof(key) + size))
+		return false;
+
+	*(u_int32_t *) &data[length] = key;
+	length += sizeof(key);
+	if (size) {
+		bcopy(bytes, &data[length], n);
+		bzero(&data[length + n], size - n);
+		length += size;
+	}
+
+	return true;
+}
+
+bool OSSerialize::addBinaryMember(const OSMetaClassBase *o, bool last)
+{
+	reserved->endCollection = last;
+	return o->serialize(this);
+}
+
+/*
+ * OSUnserializeBinary
+ *
+ * The records are read in one pass.  A collection is created as soon as
+ * its record is read, with the member count from the record as its
+ * capacity, and stays on a stack until all its members have been read.
+ * Every object also goes into a table by record index, for references to
+ * find; the table holds a retain so a reference can never see an object
+ * the tree has let go of, say a value replaced by a duplicate key.
+ */
+
+typedef struct {
+    OSObject       *collection;
+    unsigned int    type;
+    unsigned int    remaining;      // members still to be read
+    const OSSymbol *key;            // dictionary key waiting for its value
+} BinaryFrame;
+
+static void *growBuffer(void *buffer, unsigned int used, unsigned int *capacity, size_t elementSize)
+{
+    unsigned int newCapacity = (*capacity) ? 2 * *capacity : 16;
+    void *newBuffer = kalloc(newCapacity * elementSize);
+
+    if (newBuffer && buffer) {
+        bcopy(buffer, newBuffer, used * elementSize);
+        kfree(buffer, *capacity * elementSize);
+    }
+    if (newBuffer)
+        *capacity = newCapacity;
+
+    return newBuffer;
+}
+
+OSObject *OSUnserializeBinary(const char *buffer, size_t bufferSize,
+                              OSString **errorString, unsigned int options)
+{
+    const u_int32_t *next, *end;
+    OSObject       **objects = 0;
+    unsigned int     objectCount = 0, objectCapacity = 0;
+    BinaryFrame     *frames = 0;
+    unsigned int     depth = 0, frameCapacity = 0;
+    OSObject        *root = 0;
+    const char      *error = 0;
+
+    if (errorString)
+        *errorString = 0;
+
+    if (!buffer || bufferSize < sizeof(kOSSerializeBinarySignature)
+     || (bufferSize & 3) || ((size_t) buffer & 3)
+     || *(const u_int32_t *) buffer != *(const u_int32_t *) kOSSerializeBinarySignature) {
+        error = "not a binary serialization";
+        goto finish;
+    }
+
+    next = (const u_int32_t *) (buffer + sizeof(kOSSerializeBinarySignature));
+    end = (const u_int32_t *) (buffer + bufferSize);
+
+    do {
+        u_int32_t    key;
+        unsigned int type, n, members = 0;
+        OSObject    *o = 0;
+        bool         last;
+
+        if (next >= end) {
+            error = "truncated stream";
+            break;
+        }
+        key = *next++;
+        type = key & kOSSerializeTypeMask;
+        n = key & kOSSerializeDataMask;
+
+        switch (type) {
+        case kOSSerializeObject:
+            if (n >= objectCount) {
+                error = "reference to an unknown object";
+                break;
+            }
+            o = objects[n];
+            for (unsigned int i = 0; i < depth; i++) {
+                if (frames[i].collection == o) {
+                    error = "reference to an unfinished collection";
+                    break;
+                }
+            }
+            if (!error)
+                o->retain();
+            break;
+
+        case kOSSerializeString:
+        case kOSSerializeSymbol: {
+            const char *string = (const char *) next;
+            size_t size = ((size_t) n + 3) & ~(size_t) 3;
+
+            if (!n || size > (size_t) ((const char *) end - string) || string[n - 1]) {
+                error = "malformed string";
+                break;
+            }
+            if (type == kOSSerializeSymbol)
+                o = (OSObject *) OSSymbol::withCString(string);
+            else if (options & kOSUnserializeNoCopy)
+                o = OSString::withCStringNoCopy(string);
+            else
+                o = OSString::withCString(string);
+            next += size / sizeof(*next);
+            break;
+        }
+
+        case kOSSerializeArray:
+        case kOSSerializeSet:
+        case kOSSerializeDictionary:
+            // every member takes a word at least, so this bounds the allocation
+            members = (type == kOSSerializeDictionary) ? 2 * n : n;
+            if (members > (unsigned int) (end - next)) {
+                error = "collection larger than the stream";
+                break;
+            }
+            if (type == kOSSerializeArray)
+                o = OSArray::withCapacity(n);
+            else if (type == kOSSerializeSet)
+                o = OSSet::withCapacity(n);
+            else
+                o = OSDictionary::withCapacity(n);
+            break;
+
+        default:
+            error = "unknown record type";
+            break;
+        }
+
+        if (error)
+            break;
+        if (!o) {
+            error = "out of memory";
+            break;
+        }
+
+        if (type != kOSSerializeObject) {
+            if (objectCount == objectCapacity) {
+                OSObject **grown = (OSObject **)
+                    growBuffer(objects, objectCount, &objectCapacity, sizeof(*objects));
+
+                if (!grown) {
+                    o->release();
+                    error = "out of memory";
+                    break;
+                }
+                objects = grown;
+            }
+            objects[objectCount++] = o;
+            o->retain();
+        }
+
+        // hand o to its collection, or make it the root
+        if (!depth) {
+            root = o;
+            last = true;
+        } else {
+            BinaryFrame *frame = &frames[depth - 1];
+
+            last = (--frame->remaining == 0);
+            if (frame->type == kOSSerializeArray) {
+                if (!((OSArray *) frame->collection)->setObject(o))
+                    error = "out of memory";
+            } else if (frame->type == kOSSerializeSet) {
+                // false for a member already there, which is fine
+                ((OSSet *) frame->collection)->setObject(o);
+            } else if (!frame->key) {
+                frame->key = OSDynamicCast(OSSymbol, o);
+                if (frame->key)
+                    frame->key->retain();
+                else
+                    error = "dictionary key is not a symbol";
+            } else {
+                if (!((OSDictionary *) frame->collection)->setObject(frame->key, o))
+                    error = "out of memory";
+                frame->key->release();
+                frame->key = 0;
+            }
+            o->release();
+        }
+
+        if (!error && !(key & kOSSerializeEndCollection) != !last)
+            error = "misplaced end of collection";
+        if (error)
+            break;
+
+        if (members) {
+            if (depth == frameCapacity) {
+                BinaryFrame *grown = (BinaryFrame *)
+                    growBuffer(frames, depth, &frameCapacity, sizeof(*frames));
+
+                if (!grown) {
+                    error = "out of memory";
+                    break;
+                }
+                frames = grown;
+            }
+            frames[depth].collection = o;
+            frames[depth].type = type;
+            frames[depth].remaining = members;
+            frames[depth].key = 0;
+            depth++;
+        }
+
+        while (depth && !frames[depth - 1].remaining)
+            depth--;
+    } while (depth);
+
+    if (!error && next != end)
+        error = "data after the end of the object";
+
+finish:
+    while (depth--) {
+        if (frames[depth].key)
+            frames[depth].key->release();
+    }
+    if (frames)
+        kfree(frames, frameCapacity * sizeof(*frames));
+
+    while (objectCount--)
+        objects[objectCount]->release();
+    if (objects)
+        kfree(objects, objectCapacity * sizeof(*objects));
+
+    if (error) {
+        if (root)
+            root->release();
+        root = 0;
+        if (errorString)
+            *errorString = OSString::withCString(error);
+    }
+
+    return root;
+}
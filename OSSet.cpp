@@ -184,6 +184,12 @@ unsigned int OSSet::setCapacityIncrement(unsigned int increment)
     return members->setCapacityIncrement(increment);
 }
 
+bool OSSet::setGrowthPolicy(unsigned int policy, unsigned int percent)
+{
+    return members->setGrowthPolicy(policy, percent)
+        && super::setGrowthPolicy(policy, percent);
+}
+
 unsigned int OSSet::ensureCapacity(unsigned int newCapacity)
 {
     return members->ensureCapacity(newCapacity);
@@ -327,6 +333,18 @@ bool OSSet::serialize(OSSerialize *s) const
     const OSMetaClassBase *o;
 
     if (s->previouslySerialized(this)) return true;   
+    if (s->cacheCollection(this)) return s->addCachedCollection(this);
+
+    if (s->isBinary()) {
+        unsigned int count = members->getCount();
+
+        if (!s->addBinaryObject(kOSSerializeSet, count, 0)) return false;
+
+        for (unsigned int i = 0; i < count; i++) {
+            if (!s->addBinaryMember(members->getObject(i), i + 1 == count)) return false;
+        }
+        return true;
+    }
  
     if (!s->addXMLStartTag(this, "set")) return false;
 
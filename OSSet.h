@@ -488,6 +488,19 @@ public:
     virtual unsigned int ensureCapacity(unsigned int newCapacity);
 
 
+   /*!
+    * @function setGrowthPolicy
+    *
+    * @abstract
+    * Selects how the set grows its storage.
+    *
+    * @discussion
+    * See <code>OSCollection::setGrowthPolicy</code>.
+    * The policy applies to the array that holds the set's members.
+    */
+    virtual bool setGrowthPolicy(unsigned int policy, unsigned int percent = 200);
+
+
    /*!
     * @function flushCollection
     *
@@ -31,8 +31,9 @@
 #include "OSArray.h"
 #include "OSString.h"
 #include "OSSerialize.h"
+#include "OSSymbol.h"
+#include "OSZone.h"
 
-#define kfree(ptr, size) kfree(ptr)
 #define super OSObject
 
 OSDefineMetaClassAndStructors(OSString, OSObject)
@@ -72,7 +73,7 @@ bool OSString::initWithCString(const char *cString)
     if (!cString || !super::init())
         return false;
     length = strlen(cString) + 1;
-    string = (char *) kalloc(length);
+    string = (char *) OSZoneAlloc(length);
     if (!string)
         return false;
     bcopy(cString, string, length);
@@ -135,7 +136,7 @@ OSString *OSString::withCStringNoCopy(const char *cString)
 void OSString::free()
 {
     if ( !(flags & kOSStringNoCopy) && string) {
-        kfree(string, (size_t)length);
+        OSZoneFree(string, (size_t)length);
         ACCUMSIZE(-length);
     }
 	
@@ -195,23 +196,16 @@ bool OSString::isEqualTo(const OSData *obj) const
 
 bool OSString::serialize(OSSerialize *s) const
 {
-	char *c = string;
-	
     if (s->previouslySerialized(this)) return true;
+
+    if (s->isBinary())
+        return s->addBinaryObject(OSDynamicCast(OSSymbol, this)
+                                  ? kOSSerializeSymbol : kOSSerializeString,
+                                  length, string);
 	
     if (!s->addXMLStartTag(this, "string")) return false;
-    while (*c) {
-        if (*c == '<') {
-            if (!s->addString("&lt;")) return false;
-        } else if (*c == '>') {
-            if (!s->addString("&gt;")) return false;
-        } else if (*c == '&') {
-            if (!s->addString("&amp;")) return false;
-        } else {
-            if (!s->addChar(*c)) return false;
-        }
-        c++;
-    }
+
+    if (!s->addXMLString(string, length - 1)) return false;
 	
     return s->addXMLEndTag("string");
 }
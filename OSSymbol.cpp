@@ -28,6 +28,7 @@
 /* IOSymbol.cpp created by gvdl on Fri 1998-11-17 */
 
 #include "OSSymbol.h"
+#include "OSZone.h"
 
 #define super OSString
 
@@ -42,81 +43,285 @@ extern "C" {
 #define ACCUMSIZE(s)
 #endif
 
-#define INITIAL_POOL_SIZE  (exp2ml(1 + log2(kInitBucketCount)))
+#define OSCompareAndSwap OSAtomicCompareAndSwap32
 
-#define GROW_FACTOR   (1)
-#define SHRINK_FACTOR (3)
+#if defined(__LITTLE_ENDIAN__) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define POOL_LITTLE_ENDIAN 1
+#endif
+
+#define INITIAL_POOL_SIZE  (kInitGroupCount)
 
+// hash and inLen are checked first, most mismatches never touch the string.
+#define SYMBOL_MATCHES(sym, hash, inLen, cString) \
+    ((sym)->hashValue == (hash) && (sym)->length == (inLen) \
+  && strncmp((sym)->string, (cString), (inLen)) == 0)
+
+// Past 7/8 full, counting tombstones, grow or just sweep the tombstones.
 #define GROW_POOL()     do \
-    if (count * GROW_FACTOR > nBuckets) { \
-        reconstructSymbols(true); \
+    if ((count - oldCount + deleted) * 8 > table->nGroups * kGroupWidth * 7) { \
+        if (count * 2 > table->nGroups * kGroupWidth) \
+            reconstructSymbols(true); \
+        else \
+            rebuildTable(table->nGroups); \
     } \
 while (0)
 
+// Shrink below 1/8 full.
 #define SHRINK_POOL()     do \
-    if (count * SHRINK_FACTOR < nBuckets && \
-        nBuckets > INITIAL_POOL_SIZE) { \
+    if (!oldTable && count * 8 < table->nGroups * kGroupWidth && \
+        table->nGroups > INITIAL_POOL_SIZE) { \
         reconstructSymbols(false); \
     } \
 while (0)
 
+/*
+ * Pool layout.
+ *
+ * One flat open-addressed table, split into groups of kGroupWidth slots.
+ * Each group starts with one control byte per slot, either kCtrlEmpty,
+ * kCtrlDeleted or, for a full slot, the top 7 bits of the symbol's hash,
+ * followed by the slots themselves.  A probe loads a group's control
+ * word, matches the tag against all of its bytes at once and only looks
+ * at the slots that match, so a lookup usually costs one or two cache
+ * lines.  Groups are probed triangularly from (hash & mask) until one
+ * with an empty byte turns up.  Removal leaves a tombstone; tombstones
+ * are reused by later inserts and dropped when the table is rebuilt.
+ * Nothing is allocated except on a rebuild.
+ *
+ * Concurrency.
+ *
+ * Writers (insertSymbol, removeSymbol and anything that frees a symbol)
+ * hold the pool gate.  findSymbol may also run without it, inside a
+ * read section, which is how OSSymbol::withCString finds an existing
+ * symbol without serialising behind other callers.
+ *
+ * Insertion publishes the slot before its control byte, removal clears
+ * the control byte before the slot, so a reader only ever sees empty
+ * slots or whole symbols, which it verifies anyway.  A symbol being
+ * migrated shows up in the new table before it leaves the old one, and
+ * a symbol whose last reference goes away is unhooked but not freed.  Old tables and dead
+ * symbols are retired, and reclaimed once every read section that might
+ * still see them has ended.  A reader can at worst miss a symbol, in
+ * which case the caller retries under the gate.
+ *
+ * Resizing is incremental.  A rebuild only allocates the new table and
+ * keeps the old one as oldTable; every later insert and remove then
+ * moves the next kMigrateGroups groups across, so the cost of a rehash
+ * is spread evenly instead of landing on one unlucky caller.  Inserts
+ * always go to the new table and lookups check both.
+ *
+ * Read sections are counted per parity of readEpoch.  To reclaim, a
+ * writer flips the epoch and waits, without blocking, for the count of
+ * the old parity to drain.  The counts are sharded by cpu so lookups on
+ * different cpus don't fight over a cache line.
+ */
 class OSSymbolPool
 {
 private:
-    static const unsigned int kInitBucketCount = 16;
-
-    typedef struct { unsigned int count; OSSymbol **symbolP; } Bucket;
-
-    Bucket *buckets;
-    unsigned int nBuckets;
-    unsigned int count;
-    int poolGate;
-
-    static inline void hashSymbol(const char *s,
-                                  unsigned int *hashP,
-                                  unsigned int *lenP)
-    {
-        unsigned int hash = 0;
-        unsigned int len = 0;
-
-        /* Unroll the loop. */
-        for (;;) {
-            if (!*s) break; len++; hash ^= *s++;
-            if (!*s) break; len++; hash ^= *s++ <<  8;
-            if (!*s) break; len++; hash ^= *s++ << 16;
-            if (!*s) break; len++; hash ^= *s++ << 24;
-        }
-        *lenP = len;
-        *hashP = hash;
-    }
+    static const unsigned int kInitGroupCount = 4;
+    static const unsigned int kGroupWidth = 8;
+    static const unsigned int kMigrateGroups = 2;	// per insert or remove
+    static const unsigned int kReaderShards = 32;	// power of 2
+
+    static const u_int8_t kCtrlEmpty = 0x80;
+    static const u_int8_t kCtrlDeleted = 0xfe;
+
+    typedef struct {
+        volatile u_int64_t ctrl;        // kGroupWidth control bytes
+        OSSymbol * volatile slots[8];   // kGroupWidth
+    } Group;
+
+    typedef struct {
+        unsigned int nGroups;           // power of 2
+        Group        groups[1];         // nGroups of them
+    } Table;
+
+#define TABLE_SIZE(n) (sizeof(Table) + ((n) - 1) * sizeof(Group))
+
+    typedef struct {
+        volatile int32_t active[2];
+        int32_t pad[14];                // one shard per cache line
+    } ReaderShard;
+
+    enum { kRetiredTable, kRetiredSymbol };
+
+    typedef struct { void *mem; unsigned int kind; } Retired;
+
+    typedef struct {
+        Retired     *items;
+        unsigned int count;
+        unsigned int capacity;
+    } RetireList;
+
+    Table * volatile table;
+    Table * volatile oldTable;          // being migrated into table, or 0
+    unsigned int migrateGroup;          // next group of oldTable to move
+    unsigned int count;                 // in both tables
+    unsigned int oldCount;              // still in oldTable
+    unsigned int deleted;               // tombstones in table
+    volatile u_int32_t poolGate;
+
+    volatile u_int32_t readEpoch;
+    unsigned int waitParity;
+    RetireList pending;                 // retired since the last flip
+    RetireList waiting;                 // waiting for waitParity to drain
+    ReaderShard readers[kReaderShards];
 
     static unsigned long log2(unsigned int x);
     static unsigned long exp2ml(unsigned int x);
 
+    static Table *allocTable(unsigned int nGroups);
+    static void freeTable(Table *t);
+    static void setCtrl(Group *group, unsigned int i, u_int8_t ctrl);
+
     void reconstructSymbols(void);
     void reconstructSymbols(bool grow);
+    void rebuildTable(unsigned int new_nGroups);
+    void migrateGroups(unsigned int nGroups);
+    void placeSymbol(OSSymbol *sym, unsigned int hash);
+    static OSSymbol *findInTable(const Table *t, const char *cString,
+                                 unsigned int hash, unsigned int inLen);
+    static bool removeFromTable(Table *t, OSSymbol *sym);
+
+    bool readersActive(unsigned int parity) const;
+    void retire(void *mem, unsigned int kind);
+    void freeRetired(RetireList *list);
+    void reclaim(bool wait);
 
 public:
     static void *operator new(size_t size);
     static void operator delete(void *mem, size_t size);
 
     OSSymbolPool() { };
-    OSSymbolPool(const OSSymbolPool *old);
     virtual ~OSSymbolPool();
 
     bool init();
 
-    inline void closeGate() { };
-    inline void openGate()  { };
+    static void hashSymbol(const char *s,
+                           unsigned int *hashP,
+                           unsigned int *lenP);
+
+    inline void closeGate()
+    {
+        while (!OSCompareAndSwap(0, 1, &poolGate))
+            ;
+    }
+    void openGate();
+
+    unsigned int enterReader();
+    void exitReader(unsigned int token);
 
-    OSSymbol *findSymbol(const char *cString) const;
-    OSSymbol *insertSymbol(OSSymbol *sym);
+    OSSymbol *findSymbol(const char *cString,
+                         unsigned int hash, unsigned int len) const;
+    OSSymbol *lookupSymbol(const char *cString,
+                           unsigned int hash, unsigned int len);
+    OSSymbol *insertSymbol(OSSymbol *sym, unsigned int hash);
     void removeSymbol(OSSymbol *sym);
+    void retireSymbol(OSSymbol *sym) { retire(sym, kRetiredSymbol); }
 
     OSSymbolPoolState initHashState();
     OSSymbol *nextHashState(OSSymbolPoolState *stateP);
 };
 
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Non-zero iff v has a zero byte; the lowest set bit marks the first one.
+#define HAS_ZERO_BYTE(v) (((v) - ONES) & ~(v) & HIGHS)
+
+// Bytes of a control word that are kCtrlEmpty (0x80, bit 6 clear).
+#define EMPTY_BYTES(ctrl) ((ctrl) & ~((ctrl) << 1) & HIGHS)
+
+// Byte number, in memory order, of the first flag set in a match word.
+static inline unsigned int firstByte(u_int64_t bits)
+{
+#if POOL_LITTLE_ENDIAN
+    return __builtin_ctzll(bits) / 8;
+#else
+    return __builtin_clzll(bits) / 8;
+#endif
+}
+
+static inline u_int64_t clearByte(u_int64_t bits, unsigned int i)
+{
+#if POOL_LITTLE_ENDIAN
+    return bits & ~(0x80ULL << (8 * i));
+#else
+    return bits & ~(0x80ULL << (56 - 8 * i));
+#endif
+}
+
+/*
+ * Symbol hash.
+ *
+ * A wyhash style multiply-fold over 8 byte words, taken from the start of
+ * the string in little endian order and with the last partial word padded
+ * with zeroes.  The length is found first so that no load goes past the
+ * terminator: the whole words are read with unaligned loads and the tail
+ * a byte at a time.
+ */
+#define kHashSecret0 0xa0761d6478bd642fULL
+#define kHashSecret1 0xe7037ed1a0b428dbULL
+#define kHashSecret2 0x8ebc6af09c88c6e3ULL
+#define kHashSecret3 0x589965cc75374cc3ULL
+
+
+typedef u_int64_t __attribute__((aligned(1), __may_alias__)) unaligned_u64;
+
+static inline u_int64_t hashMum(u_int64_t a, u_int64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) a * b;
+
+    return (u_int64_t) r ^ (u_int64_t) (r >> 64);
+#else
+    u_int64_t ha = a >> 32, la = (u_int32_t) a;
+    u_int64_t hb = b >> 32, lb = (u_int32_t) b;
+    u_int64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    u_int64_t t = rl + (rm0 << 32);
+    u_int64_t c = t < rl;
+    u_int64_t lo = t + (rm1 << 32);
+
+    c += lo < t;
+    return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline unsigned int hashFinal(u_int64_t h, u_int64_t tail, unsigned int len)
+{
+    h = hashMum(h ^ tail ^ kHashSecret2, len ^ kHashSecret3);
+    return (unsigned int) (h ^ (h >> 32));
+}
+
+void OSSymbolPool::hashSymbol(const char *s,
+                              unsigned int *hashP,
+                              unsigned int *lenP)
+{
+    unsigned int len = (unsigned int) strlen(s);
+    const char *end = s + (len & ~7U);
+    u_int64_t h = kHashSecret1;
+    u_int64_t word;
+
+    for (; s < end; s += 8) {
+#if POOL_LITTLE_ENDIAN
+        word = *(const unaligned_u64 *) s;
+#else
+        word = 0;
+        for (unsigned int i = 0; i < 8; i++)
+            word |= (u_int64_t) (unsigned char) s[i] << (8 * i);
+#endif
+        h = hashMum(word ^ kHashSecret0, h);
+    }
+
+    word = 0;
+    for (unsigned int i = 0; i < (len & 7); i++)
+        word |= (u_int64_t) (unsigned char) s[i] << (8 * i);
+
+    *lenP = len;
+    *hashP = hashFinal(h, word, len);
+}
+
 void * OSSymbolPool::operator new(size_t size)
 {
     void *mem = (void *)kalloc(size);
@@ -136,40 +341,39 @@ void OSSymbolPool::operator delete(void *mem, size_t size)
 bool OSSymbolPool::init()
 {
     count = 0;
-    nBuckets = INITIAL_POOL_SIZE;
-    buckets = (Bucket *) kalloc(nBuckets * sizeof(Bucket));
-    ACCUMSIZE(nBuckets * sizeof(Bucket));
+    oldCount = 0;
+    deleted = 0;
+    oldTable = 0;
+    table = allocTable(INITIAL_POOL_SIZE);
 	
-	assert(buckets);
+	assert(table);
 	
-    if (!buckets)
+    if (!table)
 	{
         return false;
 	}
 
-    bzero(buckets, nBuckets * sizeof(Bucket));
-
    // poolGate = lck_mtx_alloc_init(IOLockGroup, LCK_ATTR_NULL);
-	poolGate = 1; /* hax */
+    poolGate = 0;
+    readEpoch = 0;
 	
-    return poolGate != 0;
+    return true;
 }
 
-OSSymbolPool::OSSymbolPool(const OSSymbolPool *old)
+OSSymbolPool::~OSSymbolPool()
 {
-    count = old->count;
-    nBuckets = old->nBuckets;
-    buckets = old->buckets;
+    reclaim(true);
+    reclaim(true);
 
-    poolGate = 0;	// Do not duplicate the poolGate
-}
+    if (pending.items)
+        kfree(pending.items, pending.capacity * sizeof(Retired));
+    if (waiting.items)
+        kfree(waiting.items, waiting.capacity * sizeof(Retired));
 
-OSSymbolPool::~OSSymbolPool()
-{
-    if (buckets) {
-        kfree(buckets, nBuckets * sizeof(Bucket));
-        ACCUMSIZE(-(nBuckets * sizeof(Bucket)));
-    }
+    if (table)
+        freeTable(table);
+    if (oldTable)
+        freeTable(oldTable);
 
   //  if (poolGate)
     //    lck_mtx_free(poolGate, IOLockGroup);
@@ -189,29 +393,199 @@ unsigned long OSSymbolPool::exp2ml(unsigned int x)
     return (1 << x) - 1;
 }
 
+OSSymbolPool::Table *OSSymbolPool::allocTable(unsigned int nGroups)
+{
+    Table *t = (Table *) kalloc(TABLE_SIZE(nGroups));
+
+    if (t) {
+        ACCUMSIZE(TABLE_SIZE(nGroups));
+        t->nGroups = nGroups;
+
+        // One pass, this is the only part of a resize that isn't spread out.
+        for (unsigned int i = 0; i < nGroups; i++) {
+            Group *group = &t->groups[i];
+
+            group->ctrl = ONES * kCtrlEmpty;
+            for (unsigned int j = 0; j < kGroupWidth; j++)
+                group->slots[j] = 0;
+        }
+    }
+
+    return t;
+}
+
+void OSSymbolPool::freeTable(Table *t)
+{
+    kfree(t, TABLE_SIZE(t->nGroups));
+    ACCUMSIZE(-TABLE_SIZE(t->nGroups));
+}
+
+void OSSymbolPool::setCtrl(Group *group, unsigned int i, u_int8_t ctrl)
+{
+    ((volatile u_int8_t *) &group->ctrl)[i] = ctrl;
+}
+
+void OSSymbolPool::openGate()
+{
+    if (pending.count || waiting.count)
+        reclaim(false);
+
+    OSMemoryBarrier();
+    poolGate = 0;
+}
+
+unsigned int OSSymbolPool::enterReader()
+{
+    unsigned int shard = cpu_number() & (kReaderShards - 1);
+
+    for (;;) {
+        unsigned int parity = readEpoch & 1;
+
+        OSAtomicAdd32(1, &readers[shard].active[parity]);
+        OSMemoryBarrier();
+
+        // Raced with a flip, count ourselves against the new parity.
+        if ((readEpoch & 1) == parity)
+            return (shard << 1) | parity;
+
+        OSAtomicAdd32(-1, &readers[shard].active[parity]);
+    }
+}
+
+void OSSymbolPool::exitReader(unsigned int token)
+{
+    OSMemoryBarrier();
+    OSAtomicAdd32(-1, &readers[token >> 1].active[token & 1]);
+}
+
+bool OSSymbolPool::readersActive(unsigned int parity) const
+{
+    int32_t active = 0;
+
+    // A reader may leave on a different cpu than it entered, only the
+    // sum over all shards means anything.
+    for (unsigned int i = 0; i < kReaderShards; i++)
+        active += readers[i].active[parity];
+
+    return active != 0;
+}
+
+void OSSymbolPool::retire(void *mem, unsigned int kind)
+{
+    if (pending.count == pending.capacity) {
+        unsigned int newCapacity = (pending.capacity) ? 2 * pending.capacity : 16;
+        Retired *newItems = (Retired *) kalloc(newCapacity * sizeof(Retired));
+
+        if (!newItems) {
+            // Out of memory, wait out the readers and free it right away.
+            reclaim(true);
+            reclaim(true);
+
+            RetireList now = { 0, 0, 0 };
+            Retired item = { mem, kind };
+            now.items = &item;
+            now.count = 1;
+            freeRetired(&now);
+            return;
+        }
+        ACCUMSIZE(newCapacity * sizeof(Retired));
+
+        if (pending.count)
+            bcopy(pending.items, newItems, pending.count * sizeof(Retired));
+        if (pending.items) {
+            kfree(pending.items, pending.capacity * sizeof(Retired));
+            ACCUMSIZE(-(pending.capacity * sizeof(Retired)));
+        }
+        pending.items = newItems;
+        pending.capacity = newCapacity;
+    }
+
+    pending.items[pending.count].mem = mem;
+    pending.items[pending.count].kind = kind;
+    pending.count++;
+}
+
+void OSSymbolPool::freeRetired(RetireList *list)
+{
+    for (unsigned int i = 0; i < list->count; i++) {
+        Retired *item = &list->items[i];
+
+        switch (item->kind) {
+        case kRetiredTable:
+            freeTable((Table *) item->mem);
+            break;
+        case kRetiredSymbol:
+            // Second half of OSSymbol::free().
+            ((OSSymbol *) item->mem)->OSString::free();
+            break;
+        }
+    }
+    list->count = 0;
+}
+
+/*
+ * Called with the gate closed.  Frees whatever has been waiting for a
+ * full grace period, then starts a new one for what was retired since.
+ * With wait it spins until the grace period is over instead of leaving
+ * it to a later call.
+ */
+void OSSymbolPool::reclaim(bool wait)
+{
+    if (waiting.count) {
+        while (readersActive(waitParity)) {
+            if (!wait)
+                return;
+        }
+        freeRetired(&waiting);
+    }
+
+    if (pending.count) {
+        RetireList swap = waiting;
+
+        waiting = pending;
+        pending = swap;
+
+        // Everything in waiting is already unreachable.
+        OSMemoryBarrier();
+        waitParity = readEpoch & 1;
+        readEpoch++;
+        OSMemoryBarrier();
+
+        if (!wait && !readersActive(waitParity))
+            freeRetired(&waiting);
+    }
+}
+
+/*
+ * Walks the current table and then, while a migration is under way, the
+ * slots of the old one that haven't been moved yet.
+ */
 OSSymbolPoolState OSSymbolPool::initHashState()
 {
-    OSSymbolPoolState newState = { nBuckets, 0 };
+    OSSymbolPoolState newState = { (int) (table->nGroups * kGroupWidth), 0 };
     return newState;
 }
 
 OSSymbol *OSSymbolPool::nextHashState(OSSymbolPoolState *stateP)
 {
-    Bucket *thisBucket = &buckets[stateP->i];
+    for (;;) {
+        Table *t = (stateP->j) ? oldTable : table;
 
-    while (!stateP->j) {
-        if (!stateP->i)
+        while (stateP->i > 0) {
+            unsigned int slot = --stateP->i;
+            Group *group = &t->groups[slot / kGroupWidth];
+            u_int8_t ctrl = ((volatile u_int8_t *) &group->ctrl)[slot % kGroupWidth];
+
+            if (!(ctrl & kCtrlEmpty))
+                return group->slots[slot % kGroupWidth];
+        }
+
+        if (stateP->j || !oldTable)
             return 0;
-        stateP->i--;
-        thisBucket--;
-        stateP->j = thisBucket->count;
-    }
 
-    stateP->j--;
-    if (thisBucket->count == 1)
-        return (OSSymbol *) thisBucket->symbolP;
-    else
-        return thisBucket->symbolP[stateP->j];
+        stateP->j = 1;
+        stateP->i = oldTable->nGroups * kGroupWidth;
+    }
 }
 
 void OSSymbolPool::reconstructSymbols(void)
@@ -221,204 +595,252 @@ void OSSymbolPool::reconstructSymbols(void)
 
 void OSSymbolPool::reconstructSymbols(bool grow)
 {
-    unsigned int new_nBuckets = nBuckets;
-    OSSymbol *insert;
-    OSSymbolPoolState state;
+    unsigned int new_nGroups = table->nGroups;
 
     if (grow) {
-        new_nBuckets += new_nBuckets + 1;
+        new_nGroups *= 2;
     } else {
        /* Don't shrink the pool below the default initial size.
         */
-        if (nBuckets <= INITIAL_POOL_SIZE) {
+        if (new_nGroups <= INITIAL_POOL_SIZE) {
             return;
         }
-        new_nBuckets = (new_nBuckets - 1) / 2;
+        new_nGroups /= 2;
     }
 
-   /* Create old pool to iterate after doing above check, cause it
-    * gets finalized at return.
-    */
-    OSSymbolPool old(this);
+    rebuildTable(new_nGroups);
+}
 
-    count = 0;
-    nBuckets = new_nBuckets;
-    buckets = (Bucket *) kalloc(nBuckets * sizeof(Bucket));
-    ACCUMSIZE(nBuckets * sizeof(Bucket));
-    /* @@@ gvdl: Zero test and panic if can't set up pool */
-    bzero(buckets, nBuckets * sizeof(Bucket));
+/*
+ * Start moving everything to a fresh table of new_nGroups groups, which
+ * also drops the tombstones.  Only the table is allocated here; the
+ * symbols follow kMigrateGroups old groups at a time on each later
+ * insert or remove, so no single caller pays for rehashing the pool.
+ */
+void OSSymbolPool::rebuildTable(unsigned int new_nGroups)
+{
+    Table *newTable;
+
+    // Can't happen at kMigrateGroups per operation, but be sure.
+    if (oldTable)
+        migrateGroups(oldTable->nGroups);
+
+    newTable = allocTable(new_nGroups);
+    if (!newTable)
+        return;	// Fuller than we'd like, but still correct.
 
-    state = old.initHashState();
-    while ( (insert = old.nextHashState(&state)) )
-        insertSymbol(insert);
+    // Readers must see the old table as old before the new one is current.
+    oldTable = table;
+    oldCount = count;
+    migrateGroup = 0;
+    OSMemoryBarrier();
+    table = newTable;
+    deleted = 0;
+
+    migrateGroups(kMigrateGroups);
 }
 
-OSSymbol *OSSymbolPool::findSymbol(const char *cString) const
+/*
+ * Move the symbols of the next nGroups old groups into the current
+ * table.  Each symbol is visible in the new table before it disappears
+ * from the old one, so a reader looking at both may find it twice but
+ * rarely misses it.  Frees the old table once it is empty.
+ */
+void OSSymbolPool::migrateGroups(unsigned int nGroups)
 {
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
+    Table *t = oldTable;
 
-    hashSymbol(cString, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
+    if (!t)
+        return;
 
-    if (!j)
-        return 0;
+    for (; nGroups && oldCount && migrateGroup < t->nGroups; nGroups--) {
+        Group *group = &t->groups[migrateGroup++];
+        u_int64_t full = ~group->ctrl & HIGHS;
+
+        while (full) {
+            unsigned int i = firstByte(full);
+            OSSymbol *sym = group->slots[i];
+
+            placeSymbol(sym, sym->hashValue);
 
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) thisBucket->symbolP;
+            setCtrl(group, i, kCtrlDeleted);
+            OSMemoryBarrier();
+            group->slots[i] = 0;
+            oldCount--;
 
-        if (inLen == probeSymbol->length
-        &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
-            return probeSymbol;
-	return 0;
+            full = clearByte(full, i);
+        }
     }
 
-    for (list = thisBucket->symbolP; j--; list++) {
-        probeSymbol = *list;
-        if (inLen == probeSymbol->length
-        &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
-            return probeSymbol;
+    if (!oldCount || migrateGroup == t->nGroups) {
+        oldTable = 0;
+        retire(t, kRetiredTable);
     }
+}
 
-    return 0;
+/*
+ * Put sym, known not to be in the current table, into its first empty
+ * or deleted slot.  Rehashing uses the cached hash, the strings stay cold.
+ */
+void OSSymbolPool::placeSymbol(OSSymbol *sym, unsigned int hash)
+{
+    unsigned int mask = table->nGroups - 1;
+    unsigned int g = hash & mask;
+    u_int64_t free;
+
+    for (unsigned int probe = 0;
+         !(free = table->groups[g].ctrl & HIGHS);
+         g = (g + ++probe) & mask)
+        ;
+
+    Group *group = &table->groups[g];
+    unsigned int i = firstByte(free);
+
+    if (((u_int8_t *) &group->ctrl)[i] == kCtrlDeleted)
+        deleted--;
+
+    // The symbol must be complete, and in its slot, before its tag shows.
+    group->slots[i] = sym;
+    OSMemoryBarrier();
+    setCtrl(group, i, hash >> 25);
 }
 
-OSSymbol *OSSymbolPool::insertSymbol(OSSymbol *sym)
+OSSymbol *OSSymbolPool::findInTable(const Table *t, const char *cString,
+                                    unsigned int hash, unsigned int inLen)
 {
-    const char *cString = sym->string;
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
+    unsigned int mask = t->nGroups - 1;
+    unsigned int g = hash & mask;
+    u_int64_t tags = ONES * (hash >> 25);
+    OSSymbol *probeSymbol;
 
-    hashSymbol(cString, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
+    // Bounded, a reader racing with writers never sees a full table
+    // but may not see the empty byte it would have stopped at either.
+    for (unsigned int probe = 0; probe <= mask; g = (g + ++probe) & mask) {
+        const Group *group = &t->groups[g];
+        u_int64_t ctrl = group->ctrl;
+        u_int64_t match = HAS_ZERO_BYTE(ctrl ^ tags);
+
+        while (match) {
+            unsigned int i = firstByte(match);
+
+            probeSymbol = group->slots[i];
+            if (probeSymbol && SYMBOL_MATCHES(probeSymbol, hash, inLen, cString))
+                return probeSymbol;
+            match = clearByte(match, i);
+        }
 
-    if (!j) {
-        thisBucket->symbolP = (OSSymbol **) sym;
-        thisBucket->count++;
-        count++;
-        return sym;
+        if (EMPTY_BYTES(ctrl))
+            break;
     }
 
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) thisBucket->symbolP;
+    return 0;
+}
 
-        if (inLen == probeSymbol->length
-        &&  strncmp(probeSymbol->string, cString, probeSymbol->length) == 0)
-            return probeSymbol;
+/*
+ * Callers hold the gate or are inside a read section.  hash and len
+ * come from hashSymbol(cString).
+ */
+OSSymbol *OSSymbolPool::findSymbol(const char *cString,
+                                   unsigned int hash, unsigned int len) const
+{
+    Table *t = table;
+    Table *old = oldTable;
+    OSSymbol *probeSymbol = findInTable(t, cString, hash, len + 1);
 
-        list = (OSSymbol **) kalloc(2 * sizeof(OSSymbol *));
-        ACCUMSIZE(2 * sizeof(OSSymbol *));
-        /* @@@ gvdl: Zero test and panic if can't set up pool */
-        list[0] = sym;
-        list[1] = probeSymbol;
-        thisBucket->symbolP = list;
-        thisBucket->count++;
-        count++;
-        GROW_POOL();
+    if (!probeSymbol && old && old != t)
+        probeSymbol = findInTable(old, cString, hash, len + 1);
 
-        return sym;
-    }
+    return probeSymbol;
+}
 
-    for (list = thisBucket->symbolP; j--; list++) {
-        probeSymbol = *list;
-        if (inLen == probeSymbol->length
-        &&  strncmp(probeSymbol->string, cString, probeSymbol->length) == 0)
-            return probeSymbol;
-    }
+/*
+ * Lock free lookup, returns a retained symbol or 0.  A 0 is not final,
+ * the caller must check again with the gate closed.
+ */
+OSSymbol *OSSymbolPool::lookupSymbol(const char *cString,
+                                     unsigned int hash, unsigned int len)
+{
+    unsigned int token = enterReader();
+    OSSymbol *probeSymbol = findSymbol(cString, hash, len);
 
-    j = thisBucket->count++;
-    count++;
-    list = (OSSymbol **) kalloc(thisBucket->count * sizeof(OSSymbol *));
-    ACCUMSIZE(thisBucket->count * sizeof(OSSymbol *));
-    /* @@@ gvdl: Zero test and panic if can't set up pool */
-    list[0] = sym;
-    bcopy(thisBucket->symbolP, list + 1, j * sizeof(OSSymbol *));
-    kfree(thisBucket->symbolP, j * sizeof(OSSymbol *));
-    ACCUMSIZE(-(j * sizeof(OSSymbol *)));
-    thisBucket->symbolP = list;
-    GROW_POOL();
+    // It may have just lost its last reference.
+    if (probeSymbol && !probeSymbol->taggedTryRetain())
+        probeSymbol = 0;
 
-    return sym;
+    exitReader(token);
+
+    return probeSymbol;
 }
 
-void OSSymbolPool::removeSymbol(OSSymbol *sym)
+/*
+ * hash is hashSymbol(sym->string), which the caller has already had to
+ * compute for its findSymbol.
+ */
+OSSymbol *OSSymbolPool::insertSymbol(OSSymbol *sym, unsigned int hash)
 {
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
+    OSSymbol *probeSymbol = findSymbol(sym->string, hash, sym->length - 1);
 
-    hashSymbol(sym->string, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
-    list = thisBucket->symbolP;
+    if (probeSymbol)
+        return probeSymbol;
 
-    if (!j)
-        return;
+    sym->hashValue = hash;
+    placeSymbol(sym, hash);
+    count++;
+
+    migrateGroups(kMigrateGroups);
+    GROW_POOL();
 
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) list;
+    return sym;
+}
 
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = 0;
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
+/*
+ * Tombstone sym's slot in t, if it's there.
+ */
+bool OSSymbolPool::removeFromTable(Table *t, OSSymbol *sym)
+{
+    // The cached hash finds the slot, the string is never read.
+    unsigned int hash = sym->hashValue;
+    unsigned int mask = t->nGroups - 1;
+    unsigned int g = hash & mask;
+    u_int64_t tags = ONES * (hash >> 25);
+
+    for (unsigned int probe = 0; probe <= mask; g = (g + ++probe) & mask) {
+        Group *group = &t->groups[g];
+        u_int64_t ctrl = group->ctrl;
+        u_int64_t match = HAS_ZERO_BYTE(ctrl ^ tags);
+
+        while (match) {
+            unsigned int i = firstByte(match);
+
+            if (group->slots[i] == sym) {
+                setCtrl(group, i, kCtrlDeleted);
+                OSMemoryBarrier();
+                group->slots[i] = 0;
+                return true;
+            }
+            match = clearByte(match, i);
         }
-        return;
+
+        if (EMPTY_BYTES(ctrl))
+            break;
     }
 
-    if (j == 2) {
-        probeSymbol = list[0];
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = (OSSymbol **) list[1];
-            kfree(list, 2 * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(2 * sizeof(OSSymbol *)));
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
-        }
+    return false;
+}
 
-        probeSymbol = list[1];
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = (OSSymbol **) list[0];
-            kfree(list, 2 * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(2 * sizeof(OSSymbol *)));
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
-        }
+void OSSymbolPool::removeSymbol(OSSymbol *sym)
+{
+    if (removeFromTable(table, sym))
+        deleted++;
+    else if (oldTable && removeFromTable(oldTable, sym))
+        oldCount--;
+    else
         return;
-    }
 
-    for (; j--; list++) {
-        probeSymbol = *list;
-        if (probeSymbol == sym) {
-
-            list = (OSSymbol **)
-                kalloc((thisBucket->count-1) * sizeof(OSSymbol *));
-	    ACCUMSIZE((thisBucket->count-1) * sizeof(OSSymbol *));
-            if (thisBucket->count-1 != j)
-                bcopy(thisBucket->symbolP, list,
-                      (thisBucket->count-1-j) * sizeof(OSSymbol *));
-            if (j)
-                bcopy(thisBucket->symbolP + thisBucket->count-j,
-                      list + thisBucket->count-1-j,
-                      j * sizeof(OSSymbol *));
-            kfree(thisBucket->symbolP, thisBucket->count * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(thisBucket->count * sizeof(OSSymbol *)));
-            thisBucket->symbolP = list;
-            count--;
-            thisBucket->count--;
-            return;
-        }
-    }
+    count--;
+
+    migrateGroups(kMigrateGroups);
+    SHRINK_POOL();
 }
 
 /*
@@ -469,9 +891,22 @@ const OSSymbol *OSSymbol::withString(const OSString *aString)
 
 const OSSymbol *OSSymbol::withCString(const char *cString)
 {
+    unsigned int hash, len;
+
+    if (!cString)
+        return 0;
+
+    // Hash once, every step below reuses it.
+    OSSymbolPool::hashSymbol(cString, &hash, &len);
+
+    // Most calls are for symbols that already exist, try without the gate.
+    OSSymbol *oldSymb = pool->lookupSymbol(cString, hash, len);
+    if (oldSymb)
+        return oldSymb;
+
     pool->closeGate();
 
-    OSSymbol *oldSymb = pool->findSymbol(cString);
+    oldSymb = pool->findSymbol(cString, hash, len);
     if (!oldSymb) {
         OSSymbol *newSymb = new OSSymbol;
         if (!newSymb) {
@@ -480,7 +915,7 @@ const OSSymbol *OSSymbol::withCString(const char *cString)
         }
 
 	if (newSymb->OSString::initWithCString(cString))
-	    oldSymb = pool->insertSymbol(newSymb);
+	    oldSymb = pool->insertSymbol(newSymb, hash);
         
         if (newSymb == oldSymb) {
             pool->openGate();
@@ -489,6 +924,11 @@ const OSSymbol *OSSymbol::withCString(const char *cString)
         else
             // Somebody else inserted the new symbol so free our copy
 	    newSymb->OSString::free();
+
+        if (!oldSymb) {
+            pool->openGate();
+            return 0;
+        }
     }
     
     oldSymb->retain();	// Retain the old symbol before releasing the lock.
@@ -499,9 +939,22 @@ const OSSymbol *OSSymbol::withCString(const char *cString)
 
 const OSSymbol *OSSymbol::withCStringNoCopy(const char *cString)
 {
+    unsigned int hash, len;
+
+    if (!cString)
+        return 0;
+
+    // Hash once, every step below reuses it.
+    OSSymbolPool::hashSymbol(cString, &hash, &len);
+
+    // Most calls are for symbols that already exist, try without the gate.
+    OSSymbol *oldSymb = pool->lookupSymbol(cString, hash, len);
+    if (oldSymb)
+        return oldSymb;
+
     pool->closeGate();
 
-    OSSymbol *oldSymb = pool->findSymbol(cString);
+    oldSymb = pool->findSymbol(cString, hash, len);
     if (!oldSymb) {
         OSSymbol *newSymb = new OSSymbol;
         if (!newSymb) {
@@ -510,7 +963,7 @@ const OSSymbol *OSSymbol::withCStringNoCopy(const char *cString)
         }
 
 	if (newSymb->OSString::initWithCStringNoCopy(cString))
-	    oldSymb = pool->insertSymbol(newSymb);
+	    oldSymb = pool->insertSymbol(newSymb, hash);
         
         if (newSymb == oldSymb) {
             pool->openGate();
@@ -519,6 +972,11 @@ const OSSymbol *OSSymbol::withCStringNoCopy(const char *cString)
         else
             // Somebody else inserted the new symbol so free our copy
 	    newSymb->OSString::free();
+
+        if (!oldSymb) {
+            pool->openGate();
+            return 0;
+        }
     }
     
     oldSymb->retain();	// Retain the old symbol before releasing the lock.
@@ -538,7 +996,7 @@ void OSSymbol::checkForPageUnload(void *startAddr, void *endAddr)
         if (probeSymbol->string >= startAddr && probeSymbol->string < endAddr) {
             const char *oldString = probeSymbol->string;
 
-            probeSymbol->string = (char *) kalloc(probeSymbol->length);
+            probeSymbol->string = (char *) OSZoneAlloc(probeSymbol->length);
 	    ACCUMSIZE(probeSymbol->length);
             bcopy(oldString, probeSymbol->string, probeSymbol->length);
             probeSymbol->flags &= ~kOSStringNoCopy;
@@ -554,6 +1012,10 @@ void OSSymbol::taggedRelease(const void *tag) const
 
 void OSSymbol::taggedRelease(const void *tag, const int when) const
 {
+    // Only the release that frees us has to synchronize with the pool.
+    if (taggedTryRelease(tag, when))
+        return;
+
     pool->closeGate();
     super::taggedRelease(tag, when);
     pool->openGate();
@@ -561,8 +1023,10 @@ void OSSymbol::taggedRelease(const void *tag, const int when) const
 
 void OSSymbol::free()
 {
+    // Lock free lookups may still be looking at us, the pool calls
+    // super::free() once they are done.
     pool->removeSymbol(this);
-    super::free();
+    pool->retireSymbol(this);
 }
 
 bool OSSymbol::isEqualTo(const char *aCString) const
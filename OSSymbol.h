@@ -71,7 +71,10 @@
  * Consult the I/O Kit documentation related to primary interrupts 
  * for more information.
  *
- * OSSymbol provides no concurrency protection;
+ * The creation functions and the final release synchronize
+ * with the pool of unique symbols,
+ * and finding a symbol that already exists does not take a lock.
+ * Beyond that OSSymbol provides no concurrency protection;
  * it's up to the usage context to provide any protection necessary.
  * Some portions of the I/O Kit, such as
  * @link //apple_ref/doc/class/IORegistryEntry IORegistryEntry@/link,
@@ -90,6 +93,9 @@ private:
     /* Reserved for future use. (Internal use only)  */
     ExpansionData * reserved;
 
+    /* Hash of the string, set by the symbol pool on insertion. */
+    unsigned int hashValue;
+
     static void initialize();
 
     // xx-review: not in xnu, delete?
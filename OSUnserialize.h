@@ -0,0 +1,100 @@
+/*
+ * OSUnserialize
+ * Passenger libkern
+ *
+ * Rebuilds object trees from the output of OSSerialize.
+ */
+
+#ifndef _OS_OSUNSERIALIZE_H
+#define _OS_OSUNSERIALIZE_H
+
+#include "runtime.h"
+
+class OSObject;
+class OSString;
+
+/*!
+ * @header
+ *
+ * @abstract
+ * This header declares the OSUnserializeXML and OSUnserializeBinary
+ * functions.
+ *
+ * @discussion
+ * Both rebuild a tree of OSArray, OSDictionary, OSSet, OSString and
+ * OSSymbol objects, restoring shared objects from their references.
+ * Dictionary keys become OSSymbols.
+ * Containers are created with exactly the capacity they end up with,
+ * so building a tree never grows one.
+ */
+
+/*!
+ * @enum OSUnserializeOptions
+ *
+ * @constant kOSUnserializeNoCopy
+ * Strings in a binary stream are created with
+ * <code>OSString::withCStringNoCopy</code>,
+ * pointing into the buffer instead of copying it.
+ * The buffer must then stay unchanged
+ * for as long as any of those strings exists.
+ * Symbols are always copied, as other users of the symbol pool
+ * may keep them after the buffer is gone.
+ */
+enum {
+    kOSUnserializeNoCopy = 0x00000001
+};
+
+/*!
+ * @function OSUnserializeXML
+ *
+ * @abstract
+ * Rebuilds an object tree from XML text written by OSSerialize.
+ *
+ * @param buffer      The nul-terminated XML text.
+ * @param errorString If not <code>NULL</code>, set on failure
+ *                    to a new OSString describing the problem,
+ *                    which the caller must release.
+ *
+ * @result
+ * The root object with a retain count of 1,
+ * or <code>NULL</code> on failure.
+ *
+ * @discussion
+ * The tags understood are the ones OSSerialize writes:
+ * array, dict, key, set, string and reference,
+ * with optional ID attributes.
+ * Strings are always copied,
+ * since the XML text is escaped and has no nul to end them.
+ */
+OSObject * OSUnserializeXML(const char * buffer, OSString ** errorString = 0);
+
+/*!
+ * @function OSUnserializeBinary
+ *
+ * @abstract
+ * Rebuilds an object tree from the binary format written by
+ * <code>OSSerialize::binaryWithCapacity</code>.
+ *
+ * @param buffer      The serialized bytes, 4 byte aligned.
+ * @param bufferSize  The number of bytes.
+ * @param errorString If not <code>NULL</code>, set on failure
+ *                    to a new OSString describing the problem,
+ *                    which the caller must release.
+ * @param options     <code>kOSUnserializeNoCopy</code> or 0.
+ *
+ * @result
+ * The root object with a retain count of 1,
+ * or <code>NULL</code> on failure.
+ *
+ * @discussion
+ * The stream is checked as it is read,
+ * so untrusted input cannot make the parser read past the buffer
+ * or allocate more than a small multiple of its size.
+ */
+OSObject * OSUnserializeBinary(
+    const char   * buffer,
+    size_t         bufferSize,
+    OSString    ** errorString = 0,
+    unsigned int   options = 0);
+
+#endif /* !_OS_OSUNSERIALIZE_H */
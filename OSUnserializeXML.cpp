@@ -0,0 +1,463 @@
+/*
+ * OSUnserializeXML
+ * Passenger libkern
+ *
+ * Rebuilds object trees from the XML written by OSSerialize.
+ */
+
+#include "OSArray.h"
+#include "OSDictionary.h"
+#include "OSSet.h"
+#include "OSSymbol.h"
+#include "OSUnserialize.h"
+
+/*
+ * The parser is a single loop over the tags, without recursion.  Finished
+ * objects are pushed on a value stack; an open array, dict or set only
+ * records where its members start on that stack.  Its closing tag then
+ * knows the exact member count, creates the container with that capacity
+ * and moves the members in.  A dict's members alternate between key
+ * symbols and values.
+ *
+ * Objects with an ID go into a table for references to find.  The table
+ * holds a retain of its own, so a reference cannot outlive its object.
+ */
+
+typedef struct {
+    unsigned int    kind;
+    unsigned int    base;           // first member on the value stack
+    int             id;             // -1 for none
+} XMLFrame;
+
+enum {
+    kXMLArray,
+    kXMLDict,
+    kXMLSet
+};
+
+typedef struct {
+    const char     *next;
+    size_t          bufferLength;
+    OSObject      **values;
+    unsigned int    valueCount, valueCapacity;
+    XMLFrame       *frames;
+    unsigned int    depth, frameCapacity;
+    OSObject      **objects;        // by ID
+    unsigned int    objectCapacity;
+    char           *text;           // unescaped string being read
+    unsigned int    textCapacity;
+    const char     *error;
+} XMLParser;
+
+static bool growBuffer(void **buffer, unsigned int used, unsigned int *capacity,
+                       unsigned int needed, size_t elementSize)
+{
+    unsigned int newCapacity = (*capacity) ? *capacity : 16;
+    void *newBuffer;
+
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    newBuffer = kalloc(newCapacity * elementSize);
+    if (!newBuffer)
+        return false;
+
+    if (*buffer) {
+        bcopy(*buffer, newBuffer, used * elementSize);
+        kfree(*buffer, *capacity * elementSize);
+    }
+    bzero((char *) newBuffer + used * elementSize, (newCapacity - used) * elementSize);
+
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+
+    return true;
+}
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool matchWord(XMLParser *parser, const char *word)
+{
+    size_t n = strlen(word);
+
+    if (strncmp(parser->next, word, n))
+        return false;
+    parser->next += n;
+
+    return true;
+}
+
+/*
+ * Reads a number attribute value, up to and including its closing quote.
+ */
+static int readNumber(XMLParser *parser)
+{
+    size_t value = 0;
+    const char *c = parser->next;
+
+    if (*c < '0' || *c > '9')
+        return -1;
+
+    for (; *c >= '0' && *c <= '9'; c++) {
+        value = value * 10 + (*c - '0');
+        // IDs are dense, so one past the text is already too large
+        if (value > parser->bufferLength || value > 0x7fffffff)
+            return -1;
+    }
+    if (*c != '"')
+        return -1;
+    parser->next = c + 1;
+
+    return (int) value;
+}
+
+/*
+ * Reads the characters up to the next tag, which must close the element
+ * named tag, into parser->text.
+ */
+static bool readText(XMLParser *parser, const char *tag)
+{
+    const char *c = parser->next;
+    unsigned int n = 0;
+
+    for (;; c++) {
+        char ch = *c;
+
+        if (ch == '<' || !ch)
+            break;
+
+        if (ch == '&') {
+            if (!strncmp(c, "&lt;", 4))
+                ch = '<', c += 3;
+            else if (!strncmp(c, "&gt;", 4))
+                ch = '>', c += 3;
+            else if (!strncmp(c, "&amp;", 5))
+                ch = '&', c += 4;
+            else if (!strncmp(c, "&quot;", 6))
+                ch = '"', c += 5;
+            else if (!strncmp(c, "&apos;", 6))
+                ch = '\'', c += 5;
+            else {
+                parser->error = "unknown entity";
+                return false;
+            }
+        }
+
+        if (n + 1 >= parser->textCapacity
+         && !growBuffer((void **) &parser->text, n, &parser->textCapacity, n + 2, sizeof(char))) {
+            parser->error = "out of memory";
+            return false;
+        }
+        parser->text[n++] = ch;
+    }
+
+    parser->next = c;
+    if (!matchWord(parser, "</") || !matchWord(parser, tag) || !matchWord(parser, ">")) {
+        parser->error = "unterminated string";
+        return false;
+    }
+
+    if (!parser->text
+     && !growBuffer((void **) &parser->text, 0, &parser->textCapacity, 1, sizeof(char))) {
+        parser->error = "out of memory";
+        return false;
+    }
+    parser->text[n] = 0;
+
+    return true;
+}
+
+/*
+ * Pushes a finished object, which the stack takes over, and registers it
+ * under its ID.
+ */
+static bool pushValue(XMLParser *parser, OSObject *o, int id, bool isKey)
+{
+    if (!o) {
+        parser->error = "out of memory";
+        return false;
+    }
+
+    if (parser->depth) {
+        XMLFrame *frame = &parser->frames[parser->depth - 1];
+        bool wantKey = (frame->kind == kXMLDict && !((parser->valueCount - frame->base) & 1));
+
+        if (isKey != wantKey) {
+            parser->error = (isKey) ? "key outside of a dict" : "dict value without a key";
+            o->release();
+            return false;
+        }
+    } else if (isKey || parser->valueCount) {
+        parser->error = (isKey) ? "key outside of a dict" : "more than one top-level object";
+        o->release();
+        return false;
+    }
+
+    if (id >= 0) {
+        if ((unsigned int) id >= parser->objectCapacity
+         && !growBuffer((void **) &parser->objects, parser->objectCapacity,
+                        &parser->objectCapacity, id + 1, sizeof(OSObject *))) {
+            parser->error = "out of memory";
+            o->release();
+            return false;
+        }
+        if (parser->objects[id])
+            parser->objects[id]->release();
+        parser->objects[id] = o;
+        o->retain();
+    }
+
+    if (parser->valueCount == parser->valueCapacity
+     && !growBuffer((void **) &parser->values, parser->valueCount,
+                    &parser->valueCapacity, parser->valueCount + 1, sizeof(OSObject *))) {
+        parser->error = "out of memory";
+        o->release();
+        return false;
+    }
+    parser->values[parser->valueCount++] = o;
+
+    return true;
+}
+
+static bool openCollection(XMLParser *parser, unsigned int kind, int id)
+{
+    if (parser->depth == parser->frameCapacity
+     && !growBuffer((void **) &parser->frames, parser->depth,
+                    &parser->frameCapacity, parser->depth + 1, sizeof(XMLFrame))) {
+        parser->error = "out of memory";
+        return false;
+    }
+
+    // a collection is never a key, so check where it goes now
+    if (parser->depth) {
+        XMLFrame *frame = &parser->frames[parser->depth - 1];
+
+        if (frame->kind == kXMLDict && !((parser->valueCount - frame->base) & 1)) {
+            parser->error = "dict value without a key";
+            return false;
+        }
+    } else if (parser->valueCount) {
+        parser->error = "more than one top-level object";
+        return false;
+    }
+
+    parser->frames[parser->depth].kind = kind;
+    parser->frames[parser->depth].base = parser->valueCount;
+    parser->frames[parser->depth].id = id;
+    parser->depth++;
+
+    return true;
+}
+
+static bool closeCollection(XMLParser *parser, unsigned int kind)
+{
+    XMLFrame frame;
+    OSObject **members;
+    unsigned int count;
+    OSObject *o = 0;
+    bool ok = true;
+
+    if (!parser->depth || parser->frames[parser->depth - 1].kind != kind) {
+        parser->error = "mismatched closing tag";
+        return false;
+    }
+
+    frame = parser->frames[--parser->depth];
+    members = &parser->values[frame.base];
+    count = parser->valueCount - frame.base;
+
+    if (kind == kXMLArray) {
+        OSArray *array = OSArray::withCapacity(count);
+
+        for (unsigned int i = 0; array && ok && i < count; i++)
+            ok = array->setObject(members[i]);
+        o = array;
+    } else if (kind == kXMLSet) {
+        OSSet *set = OSSet::withCapacity(count);
+
+        // setObject() is false for a member already there, which is fine
+        for (unsigned int i = 0; set && i < count; i++)
+            set->setObject(members[i]);
+        o = set;
+    } else if (!(count & 1)) {
+        OSDictionary *dict = OSDictionary::withCapacity(count / 2);
+
+        for (unsigned int i = 0; dict && ok && i < count; i += 2)
+            ok = dict->setObject((const OSSymbol *) members[i], members[i + 1]);
+        o = dict;
+    } else {
+        parser->error = "dict key without a value";
+        return false;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+        members[i]->release();
+    parser->valueCount = frame.base;
+
+    if (!ok) {
+        o->release();
+        o = 0;
+    }
+
+    return pushValue(parser, o, frame.id, false);
+}
+
+static bool parseTag(XMLParser *parser)
+{
+    const char *name;
+    size_t nameLength;
+    int id = -1, idref = -1;
+    bool empty = false;
+
+    if (parser->next[1] == '/') {
+        parser->next += 2;
+        if (matchWord(parser, "array>"))
+            return closeCollection(parser, kXMLArray);
+        if (matchWord(parser, "dict>"))
+            return closeCollection(parser, kXMLDict);
+        if (matchWord(parser, "set>"))
+            return closeCollection(parser, kXMLSet);
+        parser->error = "unexpected closing tag";
+        return false;
+    }
+
+    name = ++parser->next;
+    while (*parser->next >= 'a' && *parser->next <= 'z')
+        parser->next++;
+    nameLength = parser->next - name;
+
+    for (;;) {
+        while (isSpace(*parser->next))
+            parser->next++;
+
+        if (matchWord(parser, "ID=\"")) {
+            if ((id = readNumber(parser)) < 0)
+                break;
+        } else if (matchWord(parser, "IDREF=\"")) {
+            if ((idref = readNumber(parser)) < 0)
+                break;
+        } else if (matchWord(parser, "/>")) {
+            empty = true;
+            break;
+        } else {
+            matchWord(parser, ">");
+            break;
+        }
+    }
+    if (parser->next[-1] != '>') {
+        parser->error = "malformed tag";
+        return false;
+    }
+
+#define isTag(t) (nameLength == sizeof(t) - 1 && !strncmp(name, t, nameLength))
+
+    if (isTag("reference")) {
+        OSObject *o;
+
+        if (!empty || idref < 0) {
+            parser->error = "malformed reference";
+            return false;
+        }
+        o = ((unsigned int) idref < parser->objectCapacity) ? parser->objects[idref] : 0;
+        if (!o) {
+            parser->error = "reference to an unknown or unfinished object";
+            return false;
+        }
+        o->retain();
+        return pushValue(parser, o, -1, false);
+    }
+
+    if (isTag("string") || isTag("key")) {
+        bool isKey = isTag("key");
+
+        if (!empty && !readText(parser, (isKey) ? "key" : "string"))
+            return false;
+
+        const char *string = (empty) ? "" : parser->text;
+        OSObject *o = (isKey) ? (OSObject *) OSSymbol::withCString(string)
+                              : OSString::withCString(string);
+
+        return pushValue(parser, o, (isKey) ? -1 : id, isKey);
+    }
+
+    unsigned int kind;
+
+    if (isTag("array"))
+        kind = kXMLArray;
+    else if (isTag("dict"))
+        kind = kXMLDict;
+    else if (isTag("set"))
+        kind = kXMLSet;
+    else {
+        parser->error = "unsupported tag";
+        return false;
+    }
+#undef isTag
+
+    if (!openCollection(parser, kind, id))
+        return false;
+
+    return !empty || closeCollection(parser, kind);
+}
+
+OSObject *OSUnserializeXML(const char *buffer, OSString **errorString)
+{
+    XMLParser parser;
+    OSObject *root = 0;
+
+    if (errorString)
+        *errorString = 0;
+
+    bzero(&parser, sizeof(parser));
+    parser.next = buffer;
+    if (!buffer)
+        parser.error = "no text";
+    else
+        parser.bufferLength = strlen(buffer);
+
+    while (!parser.error) {
+        while (isSpace(*parser.next))
+            parser.next++;
+
+        if (!*parser.next)
+            break;
+        if (*parser.next != '<') {
+            parser.error = "text outside of a string";
+            break;
+        }
+        parseTag(&parser);
+    }
+
+    if (!parser.error) {
+        if (parser.depth)
+            parser.error = "unterminated collection";
+        else if (!parser.valueCount)
+            parser.error = "no object";
+        else
+            root = parser.values[--parser.valueCount];
+    }
+
+    while (parser.valueCount--)
+        parser.values[parser.valueCount]->release();
+    if (parser.values)
+        kfree(parser.values, parser.valueCapacity * sizeof(OSObject *));
+    if (parser.frames)
+        kfree(parser.frames, parser.frameCapacity * sizeof(XMLFrame));
+
+    for (unsigned int i = 0; i < parser.objectCapacity; i++) {
+        if (parser.objects[i])
+            parser.objects[i]->release();
+    }
+    if (parser.objects)
+        kfree(parser.objects, parser.objectCapacity * sizeof(OSObject *));
+    if (parser.text)
+        kfree(parser.text, parser.textCapacity);
+
+    if (parser.error && errorString)
+        *errorString = OSString::withCString(parser.error);
+
+    return root;
+}
@@ -0,0 +1,447 @@
+/*
+ * OSZone
+ * Passenger libkern
+ *
+ * Size-class zone allocator for libkern objects and container buffers.
+ */
+
+#include "OSZone.h"
+
+/*
+ * Layout.
+ *
+ * Each zone hands out elements of one size.  Free elements live in
+ * magazines, fixed size stacks of pointers, and in a loose list threaded
+ * through the free elements themselves.  Every cpu has one loaded
+ * magazine per zone.  A thread claims it by swapping the slot to NULL,
+ * pops or pushes an element, and swaps it back; nothing else in the
+ * zone is touched.  If the slot is already empty, because another
+ * thread on the same cpu holds it, the thread brings a magazine of its
+ * own and hands it back to the depot when done.
+ *
+ * The depot holds full and empty magazines and the loose list under a
+ * spin gate.  A thread whose magazine ran empty trades it for a full one,
+ * refilling from the loose list or a new slab when there is none, and a
+ * thread whose magazine is full trades it for an empty one.  A thread
+ * without a magazine takes one from the depot; a new one is only made
+ * when the depot has none to give.  The depot keeps at most
+ * kDepotEmptyMax empty magazines and frees the rest, so a burst of frees
+ * doesn't leave its magazines behind for good.  The gate is only ever
+ * held for a few pointer moves; kalloc and kfree are called with it open.
+ *
+ * Allocations and frees are counted in the magazine they went through,
+ * which only its holder writes, so counting costs no atomics either.
+ * Every magazine is on the zone's list of all magazines for the
+ * statistics to find.  Elements that bypass magazines, and those counted
+ * in magazines since freed, are counted in the depot.
+ */
+
+#define kZoneCPUs       32          // power of 2
+#define kMagazineSize   30
+#define kDepotEmptyMax  8
+#define kSlabSize       (16 * 1024)
+
+typedef struct Magazine {
+    struct Magazine *next;          // on the depot's full or empty list
+    struct Magazine *allNext;       // on the zone's list of all magazines
+    struct Magazine *allPrev;
+    unsigned int     count;
+    u_int64_t        allocations;
+    u_int64_t        frees;
+    void            *items[kMagazineSize];
+} Magazine;
+
+typedef struct {
+    Magazine * volatile loaded;
+    void               *pad[7];     // one cpu per cache line
+} CPUCache;
+
+typedef struct {
+    volatile u_int32_t  gate;
+    Magazine           *full;
+    Magazine           *empty;
+    unsigned int        emptyCount;
+    void               *loose;      // free elements, linked through their first word
+    Magazine           *all;
+    u_int64_t           allocations;    // not counted in any live magazine
+    u_int64_t           frees;
+    size_t              slabBytes;
+    CPUCache            cpus[kZoneCPUs];
+} Zone;
+
+/*
+ * The size classes, 16 byte steps up to 128 and then four classes per
+ * power of 2, so no more than 1/4 of an element is ever wasted past
+ * the first few classes.
+ */
+static const size_t sZoneSizes[] = {
+      16,   32,   48,   64,   80,   96,  112,  128,
+     160,  192,  224,  256,
+     320,  384,  448,  512,
+     640,  768,  896, 1024
+};
+
+#define kZoneCount (sizeof(sZoneSizes) / sizeof(sZoneSizes[0]))
+
+static Zone sZones[kZoneCount];
+
+#if OSALLOCDEBUG
+extern "C" {
+    extern int debug_container_malloc_size;
+};
+#define ACCUMSIZE(s) do { debug_container_malloc_size += (s); } while(0)
+#else
+#define ACCUMSIZE(s)
+#endif
+
+static inline void closeGate(Zone *zone)
+{
+    while (!OSAtomicCompareAndSwap32(0, 1, &zone->gate))
+        ;
+}
+
+static inline void openGate(Zone *zone)
+{
+    OSMemoryBarrier();
+    zone->gate = 0;
+}
+
+unsigned int OSZoneIndexForSize(size_t size)
+{
+    if (size <= 128)
+        return (size) ? (unsigned int) ((size - 1) >> 4) : 0;
+    if (size <= 256)
+        return 8 + (unsigned int) ((size - 129) >> 5);
+    if (size <= 512)
+        return 12 + (unsigned int) ((size - 257) >> 6);
+    if (size <= kOSZoneMaxElement)
+        return 16 + (unsigned int) ((size - 513) >> 7);
+
+    return kZoneCount;
+}
+
+/*
+ * Claim this cpu's loaded magazine, or NULL if someone else has it.
+ */
+static inline Magazine *takeMagazine(CPUCache *cache)
+{
+    Magazine *mag;
+
+    do {
+        mag = cache->loaded;
+    } while (mag && !OSCompareAndSwapPtr(mag, 0, (void * volatile *) &cache->loaded));
+
+    return mag;
+}
+
+/*
+ * Called with the gate closed.  Takes an empty magazine from the depot,
+ * or NULL if there is none.
+ */
+static inline Magazine *depotGetEmpty(Zone *zone)
+{
+    Magazine *mag = zone->empty;
+
+    if (mag) {
+        zone->empty = mag->next;
+        zone->emptyCount--;
+    }
+
+    return mag;
+}
+
+/*
+ * Called with the gate closed.  Keeps the empty magazine mag in the
+ * depot, or if the depot has enough of them takes mag off the zone's
+ * list and returns it, for the caller to free once the gate is open.
+ */
+static Magazine *depotPutEmpty(Zone *zone, Magazine *mag)
+{
+    if (zone->emptyCount < kDepotEmptyMax) {
+        mag->next = zone->empty;
+        zone->empty = mag;
+        zone->emptyCount++;
+        return 0;
+    }
+
+    // Its counts stay with the zone.
+    zone->allocations += mag->allocations;
+    zone->frees += mag->frees;
+
+    if (mag->allNext)
+        mag->allNext->allPrev = mag->allPrev;
+    if (mag->allPrev)
+        mag->allPrev->allNext = mag->allNext;
+    else
+        zone->all = mag->allNext;
+
+    return mag;
+}
+
+static void freeMagazine(Magazine *mag)
+{
+    if (mag) {
+        kfree(mag, sizeof(Magazine));
+        ACCUMSIZE(-sizeof(Magazine));
+    }
+}
+
+static void depotPut(Zone *zone, Magazine *mag)
+{
+    closeGate(zone);
+    if (mag->count) {
+        mag->next = zone->full;
+        zone->full = mag;
+        mag = 0;
+    } else
+        mag = depotPutEmpty(zone, mag);
+    openGate(zone);
+
+    freeMagazine(mag);
+}
+
+/*
+ * Give mag back to this cpu, or to the depot if the slot got refilled
+ * in the meantime.
+ */
+static inline void putMagazine(Zone *zone, CPUCache *cache, Magazine *mag)
+{
+    if (!OSCompareAndSwapPtr(0, mag, (void * volatile *) &cache->loaded))
+        depotPut(zone, mag);
+}
+
+/*
+ * Only when the depot has no magazine to give.
+ */
+static Magazine *allocMagazine(Zone *zone)
+{
+    Magazine *mag = (Magazine *) kalloc(sizeof(Magazine));
+
+    if (mag) {
+        ACCUMSIZE(sizeof(Magazine));
+        bzero(mag, sizeof(Magazine));
+
+        closeGate(zone);
+        mag->allNext = zone->all;
+        if (zone->all)
+            zone->all->allPrev = mag;
+        zone->all = mag;
+        openGate(zone);
+    }
+
+    return mag;
+}
+
+/*
+ * Carve a new slab into the zone's loose list.
+ */
+static bool growZone(Zone *zone, size_t elementSize)
+{
+    char *slab = (char *) kalloc(kSlabSize);
+    void *head = 0;
+
+    if (!slab)
+        return false;
+    ACCUMSIZE(kSlabSize);
+
+    // Link back to front so the list hands them out in address order.
+    for (size_t offset = (kSlabSize / elementSize) * elementSize;
+         offset >= elementSize; offset -= elementSize) {
+        void **element = (void **) (slab + offset - elementSize);
+
+        *element = head;
+        head = element;
+    }
+
+    closeGate(zone);
+    // Splice it in front, the last element is the tail.
+    *(void **) (slab + ((kSlabSize / elementSize) - 1) * elementSize) = zone->loose;
+    zone->loose = head;
+    zone->slabBytes += kSlabSize;
+    openGate(zone);
+
+    return true;
+}
+
+/*
+ * The loaded magazine was empty, or not ours to use.
+ */
+static void *allocSlow(Zone *zone, CPUCache *cache, Magazine *mag, size_t elementSize)
+{
+    Magazine *spare = 0;
+    bool noMagazine = false;    // none in the depot and kalloc had none
+    void *mem = 0;
+
+    for (;;) {
+        closeGate(zone);
+        if (zone->full) {
+            Magazine *full = zone->full;
+
+            zone->full = full->next;
+            if (mag)
+                spare = depotPutEmpty(zone, mag);
+            mag = full;
+        } else if (!mag)
+            mag = depotGetEmpty(zone);
+
+        if (mag) {
+            while (zone->loose && mag->count < kMagazineSize) {
+                void **element = (void **) zone->loose;
+
+                zone->loose = *element;
+                mag->items[mag->count++] = element;
+            }
+            if (mag->count) {
+                mem = mag->items[--mag->count];
+                mag->allocations++;
+            }
+        } else if (noMagazine && zone->loose) {
+            // No magazine to be had, serve straight from the loose list.
+            mem = zone->loose;
+            zone->loose = *(void **) mem;
+            zone->allocations++;
+        }
+        openGate(zone);
+
+        freeMagazine(spare);
+        spare = 0;
+
+        if (mem)
+            break;
+        if (!mag && !noMagazine) {
+            // The depot is out of magazines, bring one before going on.
+            mag = allocMagazine(zone);
+            noMagazine = !mag;
+            continue;
+        }
+        if (!growZone(zone, elementSize))
+            break;
+    }
+
+    if (mag)
+        putMagazine(zone, cache, mag);
+
+    return mem;
+}
+
+/*
+ * The loaded magazine was full, or not ours to use.
+ */
+static void freeSlow(Zone *zone, CPUCache *cache, Magazine *mag, void *mem)
+{
+    closeGate(zone);
+    if (mag) {
+        mag->next = zone->full;
+        zone->full = mag;
+    }
+    mag = depotGetEmpty(zone);
+    openGate(zone);
+
+    // The depot is out of empty magazines, bring one rather than
+    // leaving the element, and every one after it, on the loose list.
+    if (!mag)
+        mag = allocMagazine(zone);
+
+    if (mag) {
+        mag->items[mag->count++] = mem;
+        mag->frees++;
+        putMagazine(zone, cache, mag);
+        return;
+    }
+
+    closeGate(zone);
+    *(void **) mem = zone->loose;
+    zone->loose = mem;
+    zone->frees++;
+    openGate(zone);
+}
+
+void *OSZoneAlloc(size_t size)
+{
+    unsigned int index = OSZoneIndexForSize(size);
+
+    if (index >= kZoneCount)
+        return kalloc(size);
+
+    Zone *zone = &sZones[index];
+    CPUCache *cache = &zone->cpus[cpu_number() & (kZoneCPUs - 1)];
+    Magazine *mag = takeMagazine(cache);
+
+    if (mag && mag->count) {
+        void *mem = mag->items[--mag->count];
+
+        mag->allocations++;
+        putMagazine(zone, cache, mag);
+        return mem;
+    }
+
+    return allocSlow(zone, cache, mag, sZoneSizes[index]);
+}
+
+void OSZoneFree(void *mem, size_t size)
+{
+    unsigned int index = OSZoneIndexForSize(size);
+
+    if (!mem)
+        return;
+
+    if (index >= kZoneCount) {
+        kfree(mem, size);
+        return;
+    }
+
+    Zone *zone = &sZones[index];
+    CPUCache *cache = &zone->cpus[cpu_number() & (kZoneCPUs - 1)];
+    Magazine *mag = takeMagazine(cache);
+
+    if (mag && mag->count < kMagazineSize) {
+        mag->items[mag->count++] = mem;
+        mag->frees++;
+
+        putMagazine(zone, cache, mag);
+        return;
+    }
+
+    freeSlow(zone, cache, mag, mem);
+}
+
+bool OSZoneExtend(void *mem, size_t oldSize, size_t newSize)
+{
+    unsigned int index = OSZoneIndexForSize(oldSize);
+
+    // the element is as large as its class, whatever was asked for
+    return mem && index < kZoneCount && index == OSZoneIndexForSize(newSize);
+}
+
+unsigned int OSZoneGetCount(void)
+{
+    return kZoneCount;
+}
+
+bool OSZoneGetStatistics(unsigned int zoneIndex, OSZoneStatistics *stats)
+{
+    if (zoneIndex >= kZoneCount || !stats)
+        return false;
+
+    Zone *zone = &sZones[zoneIndex];
+    u_int64_t allocations, frees;
+
+    // The gate keeps magazines from being freed under the walk; their
+    // holders keep counting.
+    closeGate(zone);
+    allocations = zone->allocations;
+    frees = zone->frees;
+    for (Magazine *mag = zone->all; mag; mag = mag->allNext) {
+        allocations += mag->allocations;
+        frees += mag->frees;
+    }
+    openGate(zone);
+
+    stats->elementSize = sZoneSizes[zoneIndex];
+    stats->allocations = allocations;
+    stats->frees = frees;
+    stats->inUse = (allocations > frees) ? allocations - frees : 0;
+    stats->slabBytes = zone->slabBytes;
+
+    return true;
+}
@@ -0,0 +1,130 @@
+/*
+ * OSZone
+ * Passenger libkern
+ *
+ * Size-class zone allocator for libkern objects and container buffers.
+ */
+
+#ifndef _OS_OSZONE_H
+#define _OS_OSZONE_H
+
+#include "runtime.h"
+
+/*!
+ * @header
+ *
+ * @abstract
+ * Small-block allocator used by OSObject and the libkern containers.
+ *
+ * @discussion
+ * Requests up to <code>kOSZoneMaxElement</code> bytes are rounded up
+ * to one of a fixed set of size classes, each of which is a zone
+ * carved out of slabs obtained from kalloc.  Every zone keeps one
+ * magazine (a small stack of free elements) per cpu, so the common
+ * alloc and free touch only memory local to the calling cpu and take
+ * no lock.  Magazines are exchanged with a per-zone depot when they
+ * run full or empty.  Larger requests go straight to kalloc.
+ *
+ * Memory is never handed back to kalloc once a zone has carved it.
+ * Elements are not zeroed.
+ *
+ * Frees must pass the size that was allocated, like kfree(ptr, size).
+ */
+
+enum {
+    kOSZoneMaxElement = 1024
+};
+
+/*!
+ * @typedef OSZoneStatistics
+ *
+ * @field elementSize  The size class, in bytes.
+ * @field allocations  Elements allocated from the zone so far.
+ * @field frees        Elements returned to the zone so far.
+ * @field inUse        Elements currently allocated.
+ * @field slabBytes    Memory the zone has carved from kalloc.
+ */
+typedef struct {
+    size_t    elementSize;
+    u_int64_t allocations;
+    u_int64_t frees;
+    u_int64_t inUse;
+    size_t    slabBytes;
+} OSZoneStatistics;
+
+/*!
+ * @function OSZoneAlloc
+ *
+ * @abstract
+ * Allocates <code>size</code> bytes.
+ *
+ * @result
+ * The memory, or <code>NULL</code> if none could be had.
+ */
+void * OSZoneAlloc(size_t size);
+
+/*!
+ * @function OSZoneFree
+ *
+ * @abstract
+ * Frees memory from <code>OSZoneAlloc</code>.
+ *
+ * @param mem   The memory, may be <code>NULL</code>.
+ * @param size  The size it was allocated with.
+ */
+void OSZoneFree(void * mem, size_t size);
+
+/*!
+ * @function OSZoneExtend
+ *
+ * @abstract
+ * Grows or shrinks memory from <code>OSZoneAlloc</code> in place.
+ *
+ * @param mem      The memory, may be <code>NULL</code>.
+ * @param oldSize  The size it was allocated with.
+ * @param newSize  The size wanted.
+ *
+ * @result
+ * <code>true</code> if the element already holds <code>newSize</code>
+ * bytes; it must then be freed with <code>newSize</code>.
+ * <code>false</code> if the memory has to be moved.
+ *
+ * @discussion
+ * Only an element whose size class also serves <code>newSize</code>
+ * can be extended.  Memory from kalloc never is.
+ */
+bool OSZoneExtend(void * mem, size_t oldSize, size_t newSize);
+
+/*!
+ * @function OSZoneGetCount
+ *
+ * @result
+ * The number of zones, ordered by element size.
+ */
+unsigned int OSZoneGetCount(void);
+
+/*!
+ * @function OSZoneIndexForSize
+ *
+ * @result
+ * The zone that serves allocations of <code>size</code> bytes, or
+ * <code>OSZoneGetCount()</code> if they go to kalloc.
+ */
+unsigned int OSZoneIndexForSize(size_t size);
+
+/*!
+ * @function OSZoneGetStatistics
+ *
+ * @abstract
+ * Reports the activity of one zone.
+ *
+ * @discussion
+ * The counters are summed over all of the zone's magazines without
+ * stopping anyone, so a snapshot taken under load is approximate.
+ *
+ * @result
+ * <code>false</code> if <code>zoneIndex</code> is out of range.
+ */
+bool OSZoneGetStatistics(unsigned int zoneIndex, OSZoneStatistics * stats);
+
+#endif /* !_OS_OSZONE_H */
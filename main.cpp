@@ -12,9 +12,1828 @@
 #include "OSString.h"
 #include "OSSerialize.h"
 
+#if SERIALIZE_BENCHMARK || COLLECTION_BENCHMARK || SYMBOL_BENCHMARK
+#include "OSDictionary.h"
+#include "OSSymbol.h"
+#include "OSZone.h"
+#endif
+
+#if SERIALIZE_CHECK
+#include "OSCollectionIterator.h"
+#include "OSDictionary.h"
+#include "OSOrderedSet.h"
+#include "OSSet.h"
+#include "OSSymbol.h"
+#include "OSUnserialize.h"
+#endif
+
 extern "C" volatile int kmod_start(void);
 void libkern_init0();
 
+#if SERIALIZE_BENCHMARK || COLLECTION_BENCHMARK
+static u_int64_t benchZoneAllocations(void)
+{
+	OSZoneStatistics stats;
+	u_int64_t allocations = 0;
+
+	for (unsigned int i = 0; OSZoneGetStatistics(i, &stats); i++)
+		allocations += stats.allocations;
+
+	return allocations;
+}
+#endif
+
+#if SERIALIZE_BENCHMARK || COLLECTION_BENCHMARK || SYMBOL_BENCHMARK || CAST_BENCHMARK
+static u_int64_t benchPerSecond(u_int64_t count, u_int64_t ns)
+{
+	if (!ns)
+		return 0;
+	// keep count * 10^9 within 64 bits
+	if (count < (u_int64_t) -1 / 1000000000ULL)
+		return count * 1000000000ULL / ns;
+	return count / ns * 1000000000ULL;
+}
+
+static u_int64_t benchNanoseconds(u_int64_t start)
+{
+	u_int64_t ns;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	return ns;
+}
+#endif
+
+#if SERIALIZE_CHECK || SERIALIZE_BENCHMARK || COLLECTION_BENCHMARK
+// An OSCollectionExecutor running each task on a thread of its own.
+static void smpExecutor(void *ref, unsigned int count, OSCollectionWork work, void *context)
+{
+	smp_run(count, work, context);
+}
+#endif
+
+#if SERIALIZE_BENCHMARK
+/*
+ * Serialization benchmark.
+ *
+ * Builds registry shaped trees and serializes each one in every format,
+ * with a new OSSerialize per pass the way a registry dump does.  Every
+ * node is a dictionary of dictSize string properties, plus an array of
+ * fanOut child nodes above the last of depth levels.  The keys are the
+ * same symbols in every node.  A sharePercent share of the properties
+ * reuse one of the last few strings, which the output writes as a
+ * reference.
+ *
+ * Each result is one line of JSON.  The time per object is per object
+ * serialized, so it stays flat as the trees grow while looking objects
+ * up to find repeats takes constant time.  The bytes are the text written,
+ * leaving out the nul that ends buffered XML, so that the buffered and the
+ * streaming passes agree.  Allocations are those the zones served plus
+ * those OSSerialize made from kalloc, per object serialized.  The
+ * peak buffer is the largest capacity any pass ended with, or the ring
+ * for a streaming pass.
+ *
+ * The parallel passes hand the root's array of children, the bulk of
+ * the tree, to serializeInParallel on kBenchTasks threads from smp_run,
+ * and count only the objects below the root.  A tree with no children
+ * goes in an array of its own, which leaves one task any work.
+ *
+ * The cached passes set kImmutable and kCacheSerialization on the tree,
+ * so the first pass takes a copy of its serialized form and the rest
+ * write the copy.
+ */
+
+typedef struct {
+	const char   *name;
+	unsigned int  depth;            // levels of nodes, at least 1
+	unsigned int  fanOut;           // children of each node above the last level
+	unsigned int  dictSize;         // string properties of each node
+	unsigned int  minString;        // string lengths are uniform in [min, max]
+	unsigned int  maxString;
+	unsigned int  sharePercent;     // properties that repeat a recent string
+	unsigned int  iterations;
+} SerializeBenchConfig;
+
+static const SerializeBenchConfig sSerializeBenchConfigs[] = {
+	// name          depth fanOut dict  min   max share iterations
+	{ "flat",           1,     0,  64,    4,   32,    0,   2000 },
+	{ "registry",       5,     4,  12,    4,   48,   10,     50 },
+	{ "wide",           2,   512,   8,    8,   64,    5,     50 },
+	{ "shared",         4,     6,  16,    4,   32,   50,     50 },
+	{ "long-strings",   3,     8,   8,  256, 4096,    0,     20 },
+	// the same shape at 13k and 100k objects, ns_per_object should hold
+	{ "13k-objects",    4,     8,  23,    4,   32,   10,     80 },
+	{ "100k-objects",   5,     8,  23,    4,   32,   10,     10 },
+};
+
+#define kBenchRecent        16          // strings sharePercent draws from
+#define kBenchChunkSize     4096
+#define kBenchChunkCount    4
+#define kBenchTasks         4
+
+typedef struct {
+	const SerializeBenchConfig *config;
+	u_int32_t         random;
+	const OSSymbol  **keys;
+	const OSSymbol   *childrenKey;
+	OSString         *recent[kBenchRecent];
+	unsigned int      recentCount;
+	char             *scratch;          // maxString + 1 bytes
+	unsigned int      objects;          // distinct objects in the tree
+	unsigned int      childObjects;     // of those, below the root
+} SerializeBenchTree;
+
+static u_int32_t benchRandom(SerializeBenchTree *tree)
+{
+	// xorshift32, never 0
+	tree->random ^= tree->random << 13;
+	tree->random ^= tree->random >> 17;
+	tree->random ^= tree->random << 5;
+	return tree->random;
+}
+
+static OSString *benchString(SerializeBenchTree *tree)
+{
+	const SerializeBenchConfig *config = tree->config;
+	unsigned int n;
+	OSString *string;
+
+	if (tree->recentCount && benchRandom(tree) % 100 < config->sharePercent) {
+		string = tree->recent[benchRandom(tree) % tree->recentCount];
+		string->retain();
+		return string;
+	}
+
+	n = config->minString + benchRandom(tree) % (config->maxString - config->minString + 1);
+	for (unsigned int i = 0; i < n; i++) {
+		u_int32_t r = benchRandom(tree);
+
+		// now and then something to escape
+		tree->scratch[i] = (r % 64) ? 'a' + r % 26 : '&';
+	}
+	tree->scratch[n] = 0;
+
+	string = OSString::withCString(tree->scratch);
+	if (!string)
+		return 0;
+	tree->objects++;
+
+	if (tree->recentCount < kBenchRecent)
+		tree->recentCount++;
+	else
+		tree->recent[kBenchRecent - 1]->release();
+	for (unsigned int i = tree->recentCount - 1; i > 0; i--)
+		tree->recent[i] = tree->recent[i - 1];
+	tree->recent[0] = string;
+	string->retain();
+
+	return string;
+}
+
+static OSDictionary *benchNode(SerializeBenchTree *tree, unsigned int level)
+{
+	const SerializeBenchConfig *config = tree->config;
+	OSDictionary *node = OSDictionary::withCapacity(config->dictSize + 1);
+
+	if (!node)
+		return 0;
+	tree->objects++;
+
+	for (unsigned int i = 0; i < config->dictSize; i++) {
+		OSString *value = benchString(tree);
+
+		if (!value) {
+			node->release();
+			return 0;
+		}
+		node->setObject(tree->keys[i], value);
+		value->release();
+	}
+
+	if (level + 1 < config->depth && config->fanOut) {
+		OSArray *children = OSArray::withCapacity(config->fanOut);
+
+		if (!children) {
+			node->release();
+			return 0;
+		}
+		tree->objects++;
+		if (!level)
+			tree->childObjects = tree->objects;
+
+		for (unsigned int i = 0; i < config->fanOut; i++) {
+			OSDictionary *child = benchNode(tree, level + 1);
+
+			if (!child) {
+				children->release();
+				node->release();
+				return 0;
+			}
+			children->setObject(child);
+			child->release();
+		}
+		node->setObject(tree->childrenKey, children);
+		children->release();
+		if (!level)
+			tree->childObjects = tree->objects - tree->childObjects + 1;
+	}
+
+	return node;
+}
+
+static bool benchSink(void *ref, const OSSerializeVector *vectors, unsigned int count)
+{
+	u_int64_t *bytes = (u_int64_t *) ref;
+
+	for (unsigned int i = 0; i < count; i++)
+		*bytes += vectors[i].length;
+
+	return true;
+}
+
+enum {
+	kBenchXML,
+	kBenchBinary,
+	kBenchXMLStream,
+	kBenchXMLParallel,
+	kBenchBinaryParallel,
+	kBenchXMLCached,
+	kBenchBinaryCached,
+	kBenchFormats
+};
+
+static const char *sBenchFormatNames[kBenchFormats] = {
+	"xml", "binary", "xml-stream", "xml-parallel", "binary-parallel",
+	"xml-cached", "binary-cached"
+};
+
+static void benchFormat(const SerializeBenchConfig *config, OSObject *root,
+                        unsigned int objects, unsigned int format)
+{
+	u_int64_t bytes = 0, streamed = 0, allocations, serialized, allocsPerObject, start, ns;
+	unsigned int peak = 0;
+	bool ok = true;
+
+	allocations = benchZoneAllocations() + OSSerialize::getAllocationCount();
+	start = mach_absolute_time();
+
+	for (unsigned int i = 0; ok && i < config->iterations; i++) {
+		OSSerialize *s;
+
+		switch (format) {
+		case kBenchXML:
+		case kBenchXMLParallel:
+		case kBenchXMLCached:
+			s = OSSerialize::withCapacity(kBenchChunkSize);
+			break;
+		case kBenchBinary:
+		case kBenchBinaryParallel:
+		case kBenchBinaryCached:
+			s = OSSerialize::binaryWithCapacity(kBenchChunkSize);
+			break;
+		default:
+			s = OSSerialize::withSink(benchSink, &streamed, kBenchChunkSize, kBenchChunkCount);
+			break;
+		}
+		if (!s) {
+			ok = false;
+			break;
+		}
+
+		if (format == kBenchXMLParallel || format == kBenchBinaryParallel)
+			ok = s->serializeInParallel(OSDynamicCast(OSArray, root), smpExecutor, 0, kBenchTasks);
+		else
+			ok = root->serialize(s);
+		ok = ok && s->flush();
+		if (format == kBenchBinary || format == kBenchBinaryParallel || format == kBenchBinaryCached)
+			bytes += s->getLength();
+		else if (format != kBenchXMLStream)
+			bytes += s->getLength() - 1;
+		if (s->getCapacity() > peak)
+			peak = s->getCapacity();
+		s->release();
+	}
+
+	ns = benchNanoseconds(start);
+	allocations = benchZoneAllocations() + OSSerialize::getAllocationCount() - allocations;
+	bytes += streamed;
+	serialized = (u_int64_t) objects * config->iterations;
+	// thousandths, printed as a decimal
+	allocsPerObject = (serialized) ? allocations * 1000 / serialized : 0;
+
+	printk("{\"bench\":\"serialize\",\"tree\":\"%s\",\"format\":\"%s\",\"ok\":%s,"
+	       "\"objects\":%u,\"iterations\":%u,\"bytes\":%llu,\"ns\":%llu,"
+	       "\"ns_per_object\":%llu,\"bytes_per_sec\":%llu,\"allocs\":%llu,"
+	       "\"allocs_per_object\":%llu.%03llu,\"peak_buffer\":%u}\n",
+	       config->name, sBenchFormatNames[format], (ok) ? "true" : "false",
+	       objects, config->iterations, bytes, ns,
+	       (serialized) ? ns / serialized : 0,
+	       benchPerSecond(bytes, ns), allocations,
+	       allocsPerObject / 1000, allocsPerObject % 1000, peak);
+}
+
+static bool benchSerialize(const SerializeBenchConfig *config)
+{
+	SerializeBenchTree tree;
+	OSDictionary *root = 0;
+	char name[20];
+	bool ok = false;
+
+	if (!config->depth || config->minString > config->maxString)
+		return false;
+
+	bzero(&tree, sizeof(tree));
+	tree.config = config;
+	tree.random = 0x9E3779B9;
+	tree.keys = (const OSSymbol **) kalloc((config->dictSize + 1) * sizeof(OSSymbol *));
+	tree.scratch = (char *) kalloc(config->maxString + 1);
+	tree.childrenKey = OSSymbol::withCString("IORegistryEntryChildren");
+
+	if (tree.keys && tree.scratch && tree.childrenKey) {
+		unsigned int i;
+
+		for (i = 0; i < config->dictSize; i++) {
+			snprintf(name, sizeof(name), "Property%u", i);
+			tree.keys[i] = OSSymbol::withCString(name);
+			if (!tree.keys[i])
+				break;
+		}
+		if (i == config->dictSize)
+			root = benchNode(&tree, 0);
+		// the keys are objects of the tree too
+		tree.objects += i + 1;
+
+		while (i--)
+			tree.keys[i]->release();
+	}
+
+	if (root) {
+		OSArray *children = OSDynamicCast(OSArray, root->getObject(tree.childrenKey));
+		unsigned int childObjects = tree.childObjects + config->dictSize;
+
+		if (children) {
+			children->retain();
+			// the children have a children key only above the last level
+			if (config->depth > 2)
+				childObjects++;
+		} else {
+			children = OSArray::withObjects((const OSObject **) &root, 1);
+			childObjects = tree.objects + 1;
+		}
+
+		for (unsigned int format = 0; format < kBenchFormats; format++) {
+			if (format == kBenchXMLParallel || format == kBenchBinaryParallel) {
+				if (children)
+					benchFormat(config, children, childObjects, format);
+				continue;
+			}
+			if (format == kBenchXMLCached) {
+				root->setOptions(OSCollection::kImmutable | OSCollection::kCacheSerialization,
+				                 OSCollection::kImmutable | OSCollection::kCacheSerialization);
+			}
+			benchFormat(config, root, tree.objects, format);
+		}
+		OSSafeRelease(children);
+		root->release();
+		ok = true;
+	}
+
+	for (unsigned int i = 0; i < tree.recentCount; i++)
+		tree.recent[i]->release();
+	if (tree.childrenKey)
+		tree.childrenKey->release();
+	if (tree.scratch)
+		kfree(tree.scratch, config->maxString + 1);
+	if (tree.keys)
+		kfree(tree.keys, (config->dictSize + 1) * sizeof(OSSymbol *));
+
+	return ok;
+}
+
+/*
+ * OSString::serialize over registry-like property values, most with
+ * nothing to escape, against the character at a time loop it used to
+ * run.  Throughput is of string bytes in, not XML out.
+ */
+#define kBenchEscapeStrings     1024
+#define kBenchEscapePasses      2000
+
+static const char * const sBenchEscapeValues[] = {
+	"AppleACPIPlatformExpert",
+	"IOService:/AppleACPIPlatformExpert/PCI0@0/AppleACPIPCI/XHC1@14/AppleUSBXHCIPCI",
+	"com.apple.driver.AppleHDAController",
+	"Built-In Microphone & Line In",
+	"IOPCIDevice",
+	"pci8086,9d2f",
+	"<unknown>",
+	"Intel(R) Core(TM) i7-7700HQ CPU @ 2.80GHz",
+	"IOPropertyMatch",
+	"/System/Library/Extensions/IOUSBHostFamily.kext/Contents/PlugIns/AppleUSBXHCIPCI.kext",
+	"Apple Inc.",
+	"0x1b3c",
+};
+
+#define kBenchEscapeValues  (sizeof(sBenchEscapeValues) / sizeof(sBenchEscapeValues[0]))
+
+static bool benchEscapeByChar(OSSerialize *s, const OSString *string)
+{
+	const char *c = string->getCStringNoCopy();
+
+	if (s->previouslySerialized(string)) return true;
+	if (!s->addXMLStartTag(string, "string")) return false;
+	for (; *c; c++) {
+		if (*c == '<') {
+			if (!s->addString("&lt;")) return false;
+		} else if (*c == '>') {
+			if (!s->addString("&gt;")) return false;
+		} else if (*c == '&') {
+			if (!s->addString("&amp;")) return false;
+		} else {
+			if (!s->addChar(*c)) return false;
+		}
+	}
+	return s->addXMLEndTag("string");
+}
+
+static void benchEscape(void)
+{
+	OSString *strings[kBenchEscapeStrings];
+	OSSerialize *s = OSSerialize::withCapacity(kBenchChunkSize);
+	u_int64_t bytes = 0, start, charNS = 0, scanNS = 0;
+	unsigned int made;
+	bool ok = s != 0;
+
+	for (made = 0; ok && made < kBenchEscapeStrings; made++) {
+		strings[made] = OSString::withCString(sBenchEscapeValues[made % kBenchEscapeValues]);
+		if (!strings[made])
+			break;
+		bytes += strings[made]->getLength();
+	}
+	ok = ok && made == kBenchEscapeStrings;
+	bytes *= kBenchEscapePasses;
+
+	for (int scan = 0; ok && scan < 2; scan++) {
+		start = mach_absolute_time();
+		for (unsigned int pass = 0; ok && pass < kBenchEscapePasses; pass++) {
+			s->clearText();
+			for (unsigned int i = 0; ok && i < kBenchEscapeStrings; i++)
+				ok = (scan) ? strings[i]->serialize(s) : benchEscapeByChar(s, strings[i]);
+		}
+		if (scan)
+			scanNS = benchNanoseconds(start);
+		else
+			charNS = benchNanoseconds(start);
+	}
+
+	printk("{\"bench\":\"escape\",\"ok\":%s,\"strings\":%u,\"passes\":%u,"
+	       "\"bytes\":%llu,\"char_ns\":%llu,\"scan_ns\":%llu,"
+	       "\"char_mb_per_sec\":%llu,\"scan_mb_per_sec\":%llu}\n",
+	       (ok) ? "true" : "false", made, kBenchEscapePasses, bytes, charNS, scanNS,
+	       benchPerSecond(bytes, charNS) / 1000000, benchPerSecond(bytes, scanNS) / 1000000);
+
+	while (made--)
+		strings[made]->release();
+	if (s)
+		s->release();
+}
+#endif /* SERIALIZE_BENCHMARK */
+
+#if COLLECTION_BENCHMARK
+/*
+ * Collection benchmarks.
+ *
+ * Each result is one line of JSON, like the serialization benchmark's.
+ * The objects stored come from a pool of distinct strings, so none of
+ * them is in enough collections at once to peg its retain count.
+ */
+
+#define kBenchPoolSize      4096
+#define kBenchAppendMax     10000000
+#define kBenchLinearMax     100000      // linear growth is quadratic past this
+
+static OSString *sBenchPool[kBenchPoolSize];
+
+static bool benchMakePool(void)
+{
+	char name[20];
+
+	for (unsigned int i = 0; i < kBenchPoolSize; i++) {
+		snprintf(name, sizeof(name), "object%u", i);
+		sBenchPool[i] = OSString::withCString(name);
+		if (!sBenchPool[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void benchFreePool(void)
+{
+	for (unsigned int i = 0; i < kBenchPoolSize; i++) {
+		if (sBenchPool[i])
+			sBenchPool[i]->release();
+		sBenchPool[i] = 0;
+	}
+}
+
+/*
+ * Appends count objects one at a time to an array created empty.
+ */
+static void benchAppend(unsigned int count, unsigned int policy, unsigned int percent)
+{
+	const char *growth = (policy == OSCollection::kGrowthLinear) ? "linear" : "geometric";
+	u_int64_t allocations, start, ns;
+	unsigned int capacity = 0;
+	OSArray *array;
+	bool ok = true;
+
+	if (policy == OSCollection::kGrowthLinear && count > kBenchLinearMax) {
+		printk("{\"bench\":\"append\",\"growth\":\"%s\",\"count\":%u,\"skipped\":true}\n",
+		       growth, count);
+		return;
+	}
+
+	array = OSArray::withCapacity(0);
+	if (!array || !array->setGrowthPolicy(policy, percent)) {
+		if (array)
+			array->release();
+		return;
+	}
+
+	allocations = benchZoneAllocations();
+	start = mach_absolute_time();
+
+	for (unsigned int i = 0; ok && i < count; i++)
+		ok = array->setObject(sBenchPool[i % kBenchPoolSize]);
+
+	ns = benchNanoseconds(start);
+	allocations = benchZoneAllocations() - allocations;
+	capacity = array->getCapacity();
+	array->release();
+
+	printk("{\"bench\":\"append\",\"growth\":\"%s\",\"percent\":%u,\"ok\":%s,"
+	       "\"count\":%u,\"ns\":%llu,\"appends_per_sec\":%llu,\"zone_allocs\":%llu,"
+	       "\"capacity\":%u}\n",
+	       growth, (policy == OSCollection::kGrowthLinear) ? 0 : percent, (ok) ? "true" : "false",
+	       count, ns, benchPerSecond(count, ns), allocations, capacity);
+}
+
+/*
+ * Adds count objects kBenchBatch at a time, at the end or in the middle,
+ * either one setObject call per object or one setObjects per batch.
+ */
+#define kBenchBatch         64
+#define kBenchBatchMax      1000000
+#define kBenchMiddleMax     100000      // middle inserts are quadratic
+
+static void benchBatch(unsigned int count, bool middle, bool batched)
+{
+	const OSMetaClassBase * const *pool = (const OSMetaClassBase * const *) sBenchPool;
+	u_int64_t start, ns;
+	OSArray *array;
+	bool ok = true;
+
+	array = OSArray::withCapacity(0);
+	if (!array || !array->setGrowthPolicy(OSCollection::kGrowthGeometric)) {
+		if (array)
+			array->release();
+		return;
+	}
+
+	start = mach_absolute_time();
+
+	for (unsigned int done = 0; ok && done < count; done += kBenchBatch) {
+		const OSMetaClassBase * const *batch = &pool[done % kBenchPoolSize];
+		unsigned int index = (middle) ? array->getCount() / 2 : array->getCount();
+		unsigned int n = count - done;
+
+		if (n > kBenchBatch)
+			n = kBenchBatch;
+		if (batched)
+			ok = array->setObjects(index, batch, n);
+		else {
+			for (unsigned int i = 0; ok && i < n; i++)
+				ok = array->setObject(index + i, batch[i]);
+		}
+	}
+
+	ns = benchNanoseconds(start);
+	array->release();
+
+	printk("{\"bench\":\"%s\",\"where\":\"%s\",\"batch\":%u,\"ok\":%s,"
+	       "\"count\":%u,\"ns\":%llu,\"objects_per_sec\":%llu}\n",
+	       (batched) ? "setObjects" : "setObject", (middle) ? "middle" : "end",
+	       kBenchBatch, (ok) ? "true" : "false",
+	       count, ns, benchPerSecond(count, ns));
+}
+
+/*
+ * Takes and drops one collection reference on each of count objects,
+ * one call per object and then as a batch, and flushes an array of them.
+ * With distinct set, every object is a new string nobody has touched
+ * lately; otherwise they cycle through the first 16 of the pool, like
+ * the handful of booleans and small numbers that fill many containers.
+ */
+#define kBenchShared        16
+#define kBenchFlushMax      1000000
+#define kBenchFlushPasses   5
+
+static void benchFlush(unsigned int count, bool distinct)
+{
+	const void *tag = OSTypeID(OSCollection);
+	const OSMetaClassBase **objects;
+	u_int64_t start, loopNS, batchNS, flushNS;
+	OSArray *array = 0;
+	unsigned int made = 0;
+	bool ok = false;
+
+	objects = (const OSMetaClassBase **) kalloc(count * sizeof(*objects));
+	if (!objects)
+		return;
+
+	for (made = 0; made < count; made++) {
+		if (distinct) {
+			char name[20];
+
+			snprintf(name, sizeof(name), "flush%u", made);
+			objects[made] = OSString::withCString(name);
+			if (!objects[made])
+				break;
+		} else
+			objects[made] = sBenchPool[made % kBenchShared];
+	}
+	if (made < count)
+		goto finish;
+	if (distinct) {
+		// Out of allocation order, as in a container that has seen churn.
+		u_int32_t random = count;
+
+		for (unsigned int i = count - 1; i > 0; i--) {
+			const OSMetaClassBase *swap = objects[i];
+			unsigned int j;
+
+			// xorshift32, as in benchRandom
+			random ^= random << 13;
+			random ^= random >> 17;
+			random ^= random << 5;
+			j = random % (i + 1);
+
+			objects[i] = objects[j];
+			objects[j] = swap;
+		}
+	}
+
+	// best of a few passes, taking turns so neither finds the other's cache
+	loopNS = batchNS = (u_int64_t) -1;
+	for (unsigned int pass = 0; pass < kBenchFlushPasses; pass++) {
+		u_int64_t ns;
+
+		start = mach_absolute_time();
+		for (unsigned int i = 0; i < count; i++)
+			objects[i]->taggedRetain(tag);
+		for (unsigned int i = 0; i < count; i++)
+			objects[i]->taggedRelease(tag);
+		ns = benchNanoseconds(start);
+		if (ns < loopNS)
+			loopNS = ns;
+
+		start = mach_absolute_time();
+		OSObject::taggedRetainObjects(objects, count, tag);
+		OSObject::taggedReleaseObjects(objects, count, tag);
+		ns = benchNanoseconds(start);
+		if (ns < batchNS)
+			batchNS = ns;
+	}
+
+	array = OSArray::withCapacity(count);
+	if (!array || !array->setObjects(objects, count))
+		goto finish;
+	start = mach_absolute_time();
+	array->flushCollection();
+	flushNS = benchNanoseconds(start);
+	ok = true;
+
+	printk("{\"bench\":\"flush\",\"objects\":\"%s\",\"count\":%u,"
+	       "\"loop_ns\":%llu,\"batch_ns\":%llu,\"flush_ns\":%llu,"
+	       "\"flushes_per_sec\":%llu}\n",
+	       (distinct) ? "distinct" : "shared", count,
+	       loopNS, batchNS, flushNS, benchPerSecond(count, flushNS));
+
+finish:
+	if (!ok)
+		printk("flush benchmark: no memory for %u objects\n", count);
+	if (array)
+		array->release();
+	if (distinct) {
+		for (unsigned int i = 0; i < made; i++)
+			objects[i]->release();
+	}
+	kfree(objects, count * sizeof(*objects));
+}
+
+/*
+ * Removes the first k objects of an array of count, one removeObject at
+ * a time, as one ordered range, and as one unordered range.
+ */
+#define kBenchRemoveCount   100000
+
+static void benchRemove(unsigned int count, unsigned int k, int how)
+{
+	static const char * const hows[] = { "removeObject", "removeObjects", "unordered" };
+	const OSMetaClassBase * const *pool = (const OSMetaClassBase * const *) sBenchPool;
+	u_int64_t start, ns;
+	OSArray *array;
+	bool ok = true;
+
+	array = OSArray::withCapacity(count);
+	if (!array)
+		return;
+	for (unsigned int done = 0; ok && done < count; done += kBenchPoolSize)
+		ok = array->setObjects(pool, (count - done < kBenchPoolSize) ? count - done : kBenchPoolSize);
+
+	start = mach_absolute_time();
+	if (how == 0) {
+		for (unsigned int i = 0; i < k; i++)
+			array->removeObject(0);
+	} else
+		array->removeObjects(0, k, how == 1);
+	ns = benchNanoseconds(start);
+
+	ok = ok && array->getCount() == count - k;
+	array->release();
+
+	printk("{\"bench\":\"remove\",\"how\":\"%s\",\"ok\":%s,\"count\":%u,"
+	       "\"removed\":%u,\"ns\":%llu}\n",
+	       hows[how], (ok) ? "true" : "false", count, k, ns);
+}
+
+/*
+ * Builds a sorted array of count objects four ways: the linear scan and
+ * setObject(index) callers used to write, setSortedObject, appending and
+ * then sortUsingFunction, and the parallel sort on kBenchSortTasks threads
+ * from smp_run.  The pool is visited in a scrambled order so the input
+ * isn't sorted.
+ */
+#define kBenchSortMax       1000000
+#define kBenchScanMax       10000       // the scan is quadratic
+#define kBenchSortedMax     100000      // setSortedObject moves are quadratic
+#define kBenchSortTasks     8
+
+static int32_t benchCompare(const OSMetaClassBase *obj1, const OSMetaClassBase *obj2,
+                            void *context)
+{
+	return strcmp(((const OSString *) obj1)->getCStringNoCopy(),
+	              ((const OSString *) obj2)->getCStringNoCopy());
+}
+
+static void benchSort(unsigned int count, int how)
+{
+	static const char * const hows[] = { "scan", "setSortedObject", "sort", "parallel" };
+	u_int64_t start, ns;
+	OSArray *array;
+	bool ok = true;
+
+	array = OSArray::withCapacity(count);
+	if (!array)
+		return;
+
+	start = mach_absolute_time();
+	for (unsigned int i = 0; ok && i < count; i++) {
+		// 2503 is prime to the pool size, so this visits all of it
+		const OSString *object = sBenchPool[(i * 2503) % kBenchPoolSize];
+		unsigned int index;
+
+		switch (how) {
+		case 0:
+			for (index = array->getCount(); index > 0; index--) {
+				if (benchCompare(array->getObject(index - 1), object, 0) <= 0)
+					break;
+			}
+			ok = array->setObject(index, object);
+			break;
+		case 1:
+			ok = array->setSortedObject(object, benchCompare, 0);
+			break;
+		default:
+			ok = array->setObject(object);
+			break;
+		}
+	}
+	if (how == 2)
+		array->sortUsingFunction(benchCompare, 0);
+	else if (how == 3)
+		array->sortUsingFunction(benchCompare, 0, smpExecutor, 0, kBenchSortTasks);
+	ns = benchNanoseconds(start);
+
+	for (unsigned int i = 1; ok && i < array->getCount(); i++)
+		ok = benchCompare(array->getObject(i - 1), array->getObject(i), 0) <= 0;
+	array->release();
+
+	printk("{\"bench\":\"sorted\",\"how\":\"%s\",\"ok\":%s,\"count\":%u,"
+	       "\"ns\":%llu,\"objects_per_sec\":%llu}\n",
+	       hows[how], (ok) ? "true" : "false", count, ns, benchPerSecond(count, ns));
+}
+
+/*
+ * The parallel sort through the executor, with run counts that leave a
+ * merge of each round without a partner and runs of unequal length.  A
+ * pool object compares equal only to itself, so the result must match
+ * the single threaded sort object for object, which makes it sorted and
+ * a permutation of the input.
+ */
+static const struct {
+	unsigned int count;
+	unsigned int tasks;
+} sBenchSortChecks[] = {
+	{ 3 * 1024 + 1,     3 },
+	{ 5 * 1024 + 1000,  8 },    // cut to 5 runs of at least 1024
+	{ 6 * 1024 + 5,     6 },
+	{ 7 * 1024 + 517,   7 },
+};
+
+#define kBenchSortChecks    (sizeof(sBenchSortChecks) / sizeof(sBenchSortChecks[0]))
+
+static void benchSortCheck(unsigned int count, unsigned int tasks)
+{
+	OSArray *parallel = OSArray::withCapacity(count);
+	OSArray *serial = OSArray::withCapacity(count);
+	bool ok = parallel && serial;
+
+	// past kBenchPoolSize objects repeat, often in another run
+	for (unsigned int i = 0; ok && i < count; i++) {
+		const OSString *object = sBenchPool[(i * 2503) % kBenchPoolSize];
+
+		ok = parallel->setObject(object) && serial->setObject(object);
+	}
+
+	if (ok) {
+		parallel->sortUsingFunction(benchCompare, 0, smpExecutor, 0, tasks);
+		serial->sortUsingFunction(benchCompare, 0);
+		ok = parallel->getCount() == count;
+	}
+	for (unsigned int i = 0; ok && i < count; i++) {
+		ok = parallel->getObject(i) == serial->getObject(i)
+		  && (!i || benchCompare(parallel->getObject(i - 1), parallel->getObject(i), 0) <= 0);
+	}
+
+	OSSafeRelease(parallel);
+	OSSafeRelease(serial);
+
+	printk("{\"check\":\"parallel-sort\",\"ok\":%s,\"count\":%u,\"tasks\":%u}\n",
+	       (ok) ? "true" : "false", count, tasks);
+}
+
+static void benchCollections(void)
+{
+	if (!benchMakePool()) {
+		benchFreePool();
+		printk("collection benchmark: no memory for the pool\n");
+		return;
+	}
+
+	for (unsigned int count = 10; count <= kBenchAppendMax; count *= 10) {
+		benchAppend(count, OSCollection::kGrowthLinear, 0);
+		benchAppend(count, OSCollection::kGrowthGeometric, 150);
+		benchAppend(count, OSCollection::kGrowthGeometric, 200);
+	}
+
+	for (unsigned int count = 1000; count <= kBenchBatchMax; count *= 10) {
+		for (int middle = 0; middle < 2; middle++) {
+			if (middle && count > kBenchMiddleMax)
+				continue;
+			benchBatch(count, middle, false);
+			benchBatch(count, middle, true);
+		}
+	}
+
+	for (unsigned int count = 1000; count <= kBenchFlushMax; count *= 10) {
+		benchFlush(count, true);
+		benchFlush(count, false);
+	}
+
+	for (unsigned int k = 10; k <= kBenchRemoveCount / 2; k *= 10) {
+		for (int how = 0; how < 3; how++)
+			benchRemove(kBenchRemoveCount, k, how);
+	}
+
+	for (unsigned int i = 0; i < kBenchSortChecks; i++)
+		benchSortCheck(sBenchSortChecks[i].count, sBenchSortChecks[i].tasks);
+
+	for (unsigned int count = 1000; count <= kBenchSortMax; count *= 10) {
+		for (int how = 0; how < 4; how++) {
+			if ((how == 0 && count > kBenchScanMax)
+			 || (how == 1 && count > kBenchSortedMax))
+				continue;
+			benchSort(count, how);
+		}
+	}
+
+	benchFreePool();
+}
+#endif /* COLLECTION_BENCHMARK */
+
+#if SYMBOL_BENCHMARK
+/*
+ * Symbol benchmarks.
+ *
+ * Each result is one line of JSON, like the other benchmarks'.  The
+ * threads come from smp_run; on a uniprocessor they take turns, so only
+ * the one thread line means much there.
+ */
+
+#define kBenchSymbolCount       4096
+#define kBenchSymbolName        32
+#define kBenchInternOps         1000000     // per thread
+#define kBenchInternThreadsMax  8
+
+typedef struct {
+	char              *names;               // kBenchSymbolCount of kBenchSymbolName
+	unsigned int       ops;
+	volatile int32_t   failures;
+} SymbolBenchIntern;
+
+static void benchMakeNames(char *names, unsigned int count, const char *format)
+{
+	for (unsigned int i = 0; i < count; i++)
+		snprintf(&names[i * kBenchSymbolName], kBenchSymbolName, format, i);
+}
+
+/*
+ * One thread's share of the intern benchmark: looks up ops names, all of
+ * them already in the pool, and drops each symbol again.  Every thread
+ * starts somewhere else in the names so they don't all go through the
+ * same retain counts in step.
+ */
+static void benchInternTask(void *context, unsigned int index)
+{
+	SymbolBenchIntern *run = (SymbolBenchIntern *) context;
+	unsigned int name = index * (kBenchSymbolCount / kBenchInternThreadsMax);
+	int32_t failures = 0;
+
+	for (unsigned int i = 0; i < run->ops; i++) {
+		const OSSymbol *sym;
+
+		// 2503 is prime to the name count, so this visits all of them
+		name = (name + 2503) % kBenchSymbolCount;
+		sym = OSSymbol::withCString(&run->names[name * kBenchSymbolName]);
+		if (sym)
+			sym->release();
+		else
+			failures++;
+	}
+
+	if (failures)
+		OSAtomicAdd32(failures, &run->failures);
+}
+
+/*
+ * Interns names that are already in the pool from 1, 2, 4 and 8
+ * threads at once and reports the throughput of each against one thread.
+ */
+static void benchIntern(void)
+{
+	const OSSymbol **held;
+	SymbolBenchIntern run;
+	u_int64_t start, ns, base = 0;
+	unsigned int made;
+
+	bzero(&run, sizeof(run));
+	run.ops = kBenchInternOps;
+	run.names = (char *) kalloc(kBenchSymbolCount * kBenchSymbolName);
+	held = (const OSSymbol **) kalloc(kBenchSymbolCount * sizeof(*held));
+	if (!run.names || !held)
+		goto finish;
+
+	// Keep every name interned so each lookup is a hit.
+	benchMakeNames(run.names, kBenchSymbolCount, "IOBenchProperty%u");
+	for (made = 0; made < kBenchSymbolCount; made++) {
+		held[made] = OSSymbol::withCString(&run.names[made * kBenchSymbolName]);
+		if (!held[made])
+			break;
+	}
+	if (made < kBenchSymbolCount)
+		printk("symbol benchmark: no memory for the symbols\n");
+
+	for (unsigned int threads = 1; made == kBenchSymbolCount && threads <= kBenchInternThreadsMax; threads *= 2) {
+		u_int64_t total = (u_int64_t) threads * run.ops, perSecond;
+
+		run.failures = 0;
+		start = mach_absolute_time();
+		smp_run(threads, benchInternTask, &run);
+		ns = benchNanoseconds(start);
+
+		perSecond = benchPerSecond(total, ns);
+		if (threads == 1)
+			base = perSecond;
+
+		printk("{\"bench\":\"intern\",\"threads\":%u,\"ok\":%s,\"lookups\":%llu,"
+		       "\"ns\":%llu,\"lookups_per_sec\":%llu,\"speedup_x100\":%llu}\n",
+		       threads, (run.failures) ? "false" : "true", total,
+		       ns, perSecond, (base) ? perSecond * 100 / base : 0);
+	}
+
+	while (made--)
+		held[made]->release();
+
+finish:
+	if (!run.names || !held)
+		printk("symbol benchmark: no memory for %u names\n", kBenchSymbolCount);
+	if (held)
+		kfree(held, kBenchSymbolCount * sizeof(*held));
+	if (run.names)
+		kfree(run.names, kBenchSymbolCount * kBenchSymbolName);
+}
+
+/*
+ * Interns count new names of length characters one at a time, which
+ * grows the pool from nothing, then drops them all, which shrinks it
+ * again, and reports the slowest single call each way.  The pool
+ * rehashes from the hashes kept in the symbols, so the slowest call
+ * should not get slower as the names get longer.
+ */
+#define kBenchResizeCount       65536
+#define kBenchResizeLengthMax   256
+
+static void benchResize(unsigned int count, unsigned int length)
+{
+	const OSSymbol **syms;
+	char *names;
+	u_int64_t start, ns, insertNS = 0, releaseNS = 0, worstInsert = 0, worstRelease = 0;
+	unsigned int made;
+
+	names = (char *) kalloc(count * (length + 1));
+	syms = (const OSSymbol **) kalloc(count * sizeof(*syms));
+	if (!names || !syms) {
+		printk("symbol benchmark: no memory for %u names\n", count);
+		goto finish;
+	}
+
+	// zero padded numbers, as long as asked and all different
+	for (unsigned int i = 0; i < count; i++)
+		snprintf(&names[i * (length + 1)], length + 1, "%0*u", length, i);
+
+	for (made = 0; made < count; made++) {
+		start = mach_absolute_time();
+		syms[made] = OSSymbol::withCString(&names[made * (length + 1)]);
+		ns = benchNanoseconds(start);
+
+		if (!syms[made])
+			break;
+		insertNS += ns;
+		if (ns > worstInsert)
+			worstInsert = ns;
+	}
+
+	for (unsigned int i = 0; i < made; i++) {
+		start = mach_absolute_time();
+		syms[i]->release();
+		ns = benchNanoseconds(start);
+
+		releaseNS += ns;
+		if (ns > worstRelease)
+			worstRelease = ns;
+	}
+
+	printk("{\"bench\":\"resize\",\"length\":%u,\"ok\":%s,\"symbols\":%u,"
+	       "\"insert_ns\":%llu,\"worst_insert_ns\":%llu,"
+	       "\"release_ns\":%llu,\"worst_release_ns\":%llu}\n",
+	       length, (made == count) ? "true" : "false", made,
+	       insertNS, worstInsert, releaseNS, worstRelease);
+
+finish:
+	if (syms)
+		kfree(syms, count * sizeof(*syms));
+	if (names)
+		kfree(names, count * (length + 1));
+}
+
+/*
+ * Latency histogram, exact below 16ns and to within an eighth above,
+ * so 496 buckets cover all of 64 bits.
+ */
+#define kBenchLatencyBuckets    496
+
+typedef struct {
+	u_int32_t counts[kBenchLatencyBuckets];
+	u_int64_t samples;
+	u_int64_t worst;
+} SymbolBenchLatency;
+
+static void benchLatencyAdd(SymbolBenchLatency *latency, u_int64_t ns)
+{
+	unsigned int bucket = (unsigned int) ns;
+
+	if (ns >= 16) {
+		unsigned int msb = 63 - __builtin_clzll(ns);
+
+		bucket = 16 + (msb - 4) * 8 + (unsigned int) ((ns >> (msb - 3)) & 7);
+	}
+
+	latency->counts[bucket]++;
+	latency->samples++;
+	if (ns > latency->worst)
+		latency->worst = ns;
+}
+
+// The largest latency in the bucket holding the given fraction, in 1/100000ths.
+static u_int64_t benchLatencyPercentile(const SymbolBenchLatency *latency, u_int64_t fraction)
+{
+	u_int64_t rank = (latency->samples * fraction + 99999) / 100000, seen = 0;
+
+	for (unsigned int bucket = 0; bucket < kBenchLatencyBuckets; bucket++) {
+		seen += latency->counts[bucket];
+		if (seen && seen >= rank) {
+			unsigned int shift;
+
+			if (bucket < 16)
+				return bucket;
+			shift = (bucket - 16) / 8 + 1;
+			return ((u_int64_t) (8 + (bucket - 16) % 8 + 1) << shift) - 1;
+		}
+	}
+
+	return latency->worst;
+}
+
+static void benchLatencyPrint(const char *op, unsigned int count, const SymbolBenchLatency *latency)
+{
+	printk("{\"bench\":\"tail\",\"op\":\"%s\",\"symbols\":%u,\"samples\":%llu,"
+	       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"p9999_ns\":%llu,"
+	       "\"max_ns\":%llu}\n",
+	       op, count, latency->samples,
+	       benchLatencyPercentile(latency, 50000), benchLatencyPercentile(latency, 99000),
+	       benchLatencyPercentile(latency, 99900), benchLatencyPercentile(latency, 99990),
+	       latency->worst);
+}
+
+/*
+ * Grows the pool to count symbols and empties it again, one call at a
+ * time, and reports the spread of the single call latencies.  With the
+ * migration spread over later calls, the rehashes that used to land on
+ * one call in each doubling no longer stand out in the tail; what is left
+ * is allocating and clearing each new table.
+ */
+#define kBenchTailCount         1000000
+
+static void benchTail(unsigned int count)
+{
+	SymbolBenchLatency *latency;
+	const OSSymbol **syms;
+	char *names;
+	u_int64_t start;
+	unsigned int made;
+
+	names = (char *) kalloc(count * kBenchSymbolName);
+	syms = (const OSSymbol **) kalloc(count * sizeof(*syms));
+	latency = (SymbolBenchLatency *) kalloc(sizeof(*latency));
+	if (!names || !syms || !latency) {
+		printk("symbol benchmark: no memory for %u names\n", count);
+		goto finish;
+	}
+
+	benchMakeNames(names, count, "IOBenchTail%u");
+
+	bzero(latency, sizeof(*latency));
+	for (made = 0; made < count; made++) {
+		start = mach_absolute_time();
+		syms[made] = OSSymbol::withCString(&names[made * kBenchSymbolName]);
+		benchLatencyAdd(latency, benchNanoseconds(start));
+
+		if (!syms[made])
+			break;
+	}
+	benchLatencyPrint("insert", made, latency);
+
+	bzero(latency, sizeof(*latency));
+	for (unsigned int i = 0; i < made; i++) {
+		start = mach_absolute_time();
+		syms[i]->release();
+		benchLatencyAdd(latency, benchNanoseconds(start));
+	}
+	benchLatencyPrint("release", made, latency);
+
+finish:
+	if (latency)
+		kfree(latency, sizeof(*latency));
+	if (syms)
+		kfree(syms, count * sizeof(*syms));
+	if (names)
+		kfree(names, count * kBenchSymbolName);
+}
+
+static void benchSymbols(void)
+{
+	benchIntern();
+
+	for (unsigned int length = 8; length <= kBenchResizeLengthMax; length *= 2)
+		benchResize(kBenchResizeCount, length);
+
+	benchTail(kBenchTailCount);
+}
+#endif /* SYMBOL_BENCHMARK */
+
+#if CAST_BENCHMARK
+/*
+ * Cast benchmark.
+ *
+ * OSDynamicCast on an object twelve classes below OSObject, about as
+ * deep as driver classes get, against walking the superclass chain one
+ * link at a time the way checkMetaCast did before postModLoad built the
+ * class displays.  Each result is one line of JSON.
+ */
+
+#define BenchCastClass(className, superclassName)           \
+class className : public superclassName {                   \
+	OSDeclareDefaultStructors(className)                    \
+};                                                          \
+OSDefineMetaClassAndStructors(className, superclassName)
+
+BenchCastClass(BenchCast1, OSObject)
+BenchCastClass(BenchCast2, BenchCast1)
+BenchCastClass(BenchCast3, BenchCast2)
+BenchCastClass(BenchCast4, BenchCast3)
+BenchCastClass(BenchCast5, BenchCast4)
+BenchCastClass(BenchCast6, BenchCast5)
+BenchCastClass(BenchCast7, BenchCast6)
+BenchCastClass(BenchCast8, BenchCast7)
+BenchCastClass(BenchCast9, BenchCast8)
+BenchCastClass(BenchCast10, BenchCast9)
+BenchCastClass(BenchCast11, BenchCast10)
+BenchCastClass(BenchCast12, BenchCast11)
+
+#define kBenchCasts             10000000
+
+// Out of line, like checkMetaCast.
+static __attribute__((noinline)) const OSMetaClassBase *benchWalkCast(const OSMetaClass *toMeta, const OSMetaClassBase *object)
+{
+	for (const OSMetaClass *meta = object->getMetaClass(); meta; meta = meta->getSuperClass()) {
+		if (meta == toMeta)
+			return object;
+	}
+
+	return 0;
+}
+
+static void benchCast(const char *target, const OSMetaClass *toMeta,
+                      const OSMetaClassBase *object, bool hit)
+{
+	u_int64_t start, walkNS, displayNS;
+	unsigned int walkHits = 0, displayHits = 0;
+
+	start = mach_absolute_time();
+	for (unsigned int i = 0; i < kBenchCasts; i++) {
+		if (benchWalkCast(toMeta, object))
+			walkHits++;
+	}
+	walkNS = benchNanoseconds(start);
+
+	start = mach_absolute_time();
+	for (unsigned int i = 0; i < kBenchCasts; i++) {
+		if (OSMetaClassBase::safeMetaCast(object, toMeta))
+			displayHits++;
+	}
+	displayNS = benchNanoseconds(start);
+
+	printk("{\"bench\":\"cast\",\"to\":\"%s\",\"ok\":%s,\"casts\":%u,"
+	       "\"walk_ns\":%llu,\"display_ns\":%llu,\"walk_per_sec\":%llu,"
+	       "\"display_per_sec\":%llu}\n",
+	       target, (walkHits == displayHits && (displayHits != 0) == hit) ? "true" : "false",
+	       kBenchCasts, walkNS, displayNS,
+	       benchPerSecond(kBenchCasts, walkNS), benchPerSecond(kBenchCasts, displayNS));
+}
+
+static void benchCasts(void)
+{
+	BenchCast12 *object = new BenchCast12;
+
+	if (!object) {
+		printk("cast benchmark: no memory for the object\n");
+		return;
+	}
+
+	// the deepest cast, one step up, halfway, the root, and a miss
+	benchCast("BenchCast12", OSTypeID(BenchCast12), object, true);
+	benchCast("BenchCast11", OSTypeID(BenchCast11), object, true);
+	benchCast("BenchCast6", OSTypeID(BenchCast6), object, true);
+	benchCast("OSObject", OSTypeID(OSObject), object, true);
+	benchCast("OSString", OSTypeID(OSString), object, false);
+
+	object->release();
+}
+#endif /* CAST_BENCHMARK */
+
+#if SERIALIZE_CHECK
+/*
+ * Serialization round trip.
+ *
+ * Serializes a tree holding every container, strings and symbols, empty
+ * collections and objects reached more than once, unserializes it and
+ * serializes the copy.  Both passes must write the same bytes, and the
+ * copy must share objects where the original did.  An ordered set comes
+ * back as an array, and in XML a symbol comes back as a string.  Each
+ * result is one line of JSON, like the benchmarks'.
+ */
+
+static OSDictionary *checkTree(void)
+{
+	OSString *shared = OSString::withCString("shared <&> string");
+	OSString *plain = OSString::withCString("plain");
+	OSString *empty = OSString::withCString("");
+	const OSSymbol *symbol = OSSymbol::withCString("IOProviderClass");
+	OSArray *array = OSArray::withCapacity(4);
+	OSArray *emptyArray = OSArray::withCapacity(0);
+	OSDictionary *child = OSDictionary::withCapacity(2);
+	OSDictionary *emptyDictionary = OSDictionary::withCapacity(0);
+	OSSet *set = OSSet::withCapacity(2);
+	OSSet *emptySet = OSSet::withCapacity(0);
+	OSOrderedSet *ordered = OSOrderedSet::withCapacity(3);
+	OSDictionary *root = OSDictionary::withCapacity(8);
+	bool ok;
+
+	ok = shared && plain && empty && symbol && array && emptyArray && child
+	  && emptyDictionary && set && emptySet && ordered && root;
+
+	ok = ok
+	  && child->setObject("value", plain)
+	  && child->setObject("shared", shared)
+	  && array->setObject(shared)
+	  && array->setObject(symbol)
+	  && array->setObject(child)
+	  && array->setObject(emptyArray)
+	  && set->setObject(plain)
+	  && set->setObject(symbol)
+	  && ordered->setObject(empty)
+	  && ordered->setObject(child)
+	  && ordered->setObject(shared)
+	  && root->setObject("array", array)
+	  && root->setObject("dictionary", child)
+	  && root->setObject("set", set)
+	  && root->setObject("ordered", ordered)
+	  && root->setObject("string", shared)
+	  && root->setObject("symbol", symbol)
+	  && root->setObject("empty-dictionary", emptyDictionary)
+	  && root->setObject("empty-set", emptySet);
+
+	OSSafeRelease(shared);
+	OSSafeRelease(plain);
+	OSSafeRelease(empty);
+	OSSafeRelease(symbol);
+	OSSafeRelease(array);
+	OSSafeRelease(emptyArray);
+	OSSafeRelease(child);
+	OSSafeRelease(emptyDictionary);
+	OSSafeRelease(set);
+	OSSafeRelease(emptySet);
+	OSSafeRelease(ordered);
+
+	if (!ok) {
+		OSSafeRelease(root);
+		return 0;
+	}
+
+	return root;
+}
+
+static bool checkSameText(const OSSerialize *s1, const OSSerialize *s2)
+{
+	const char *t1 = s1->text(), *t2 = s2->text();
+	unsigned int n = s1->getLength();
+
+	if (n != s2->getLength())
+		return false;
+	for (unsigned int i = 0; i < n; i++) {
+		if (t1[i] != t2[i])
+			return false;
+	}
+
+	return true;
+}
+
+// The copy has the shape checkTree() built, sharing what it shared.
+static bool checkCopy(const OSObject *copy, bool binary)
+{
+	OSDictionary *root = OSDynamicCast(OSDictionary, copy);
+	OSArray *array;
+	OSDictionary *child;
+
+	if (!root)
+		return false;
+	array = OSDynamicCast(OSArray, root->getObject("array"));
+	child = OSDynamicCast(OSDictionary, root->getObject("dictionary"));
+	if (!array || !child || array->getCount() != 4)
+		return false;
+
+	return OSDynamicCast(OSSet, root->getObject("set"))
+	    && OSDynamicCast(OSArray, root->getObject("ordered"))
+	    && OSDynamicCast(OSSet, root->getObject("empty-set"))
+	    && OSDynamicCast(OSDictionary, root->getObject("empty-dictionary"))
+	    && OSDynamicCast(OSString, root->getObject("string"))
+	    && (!binary || OSDynamicCast(OSSymbol, root->getObject("symbol")))
+	    && array->getObject(0) == root->getObject("string")
+	    && array->getObject(2) == child
+	    && child->getObject("shared") == root->getObject("string");
+}
+
+static bool checkRoundTrip(const OSDictionary *tree, bool binary)
+{
+	OSSerialize *first, *second;
+	OSString *error = 0;
+	OSObject *copy = 0;
+	bool ok;
+
+	first = (binary) ? OSSerialize::binaryWithCapacity(4096) : OSSerialize::withCapacity(4096);
+	second = (binary) ? OSSerialize::binaryWithCapacity(4096) : OSSerialize::withCapacity(4096);
+
+	ok = first && second && tree->serialize(first);
+	if (ok) {
+		if (binary)
+			copy = OSUnserializeBinary(first->text(), first->getLength(), &error);
+		else
+			copy = OSUnserializeXML(first->text(), &error);
+	}
+	ok = ok && copy && copy->serialize(second) && checkSameText(first, second)
+	  && checkCopy(copy, binary);
+
+	printk("{\"check\":\"roundtrip\",\"format\":\"%s\",\"ok\":%s,\"bytes\":%u,"
+	       "\"error\":\"%s\"}\n",
+	       (binary) ? "binary" : "xml", (ok) ? "true" : "false",
+	       (first) ? first->getLength() : 0,
+	       (error) ? error->getCStringNoCopy() : "");
+
+	OSSafeRelease(error);
+	OSSafeRelease(copy);
+	OSSafeRelease(second);
+	OSSafeRelease(first);
+
+	return ok;
+}
+
+/*
+ * Streaming.
+ *
+ * Streams a tree through rings of small and odd sizes, so that strings
+ * and records are split across chunks and flushes, and compares what the
+ * sink got with the buffered text, less the nul XML ends with.  The binary
+ * format only takes chunks that are a multiple of 4, and a ring smaller
+ * than minRing is skipped.
+ */
+
+typedef struct {
+	char         *bytes;
+	unsigned int  length;
+	unsigned int  capacity;
+} CheckSink;
+
+static const struct {
+	unsigned int chunkSize;
+	unsigned int chunkCount;
+} sCheckRings[] = {
+	{ 1, 1 }, { 3, 1 }, { 7, 3 }, { 13, 2 }, { 4, 1 }, { 12, 3 }, { 20, 2 }, { 64, 1 },
+};
+
+#define kCheckRings     (sizeof(sCheckRings) / sizeof(sCheckRings[0]))
+
+static bool checkSink(void *ref, const OSSerializeVector *vectors, unsigned int count)
+{
+	CheckSink *sink = (CheckSink *) ref;
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (vectors[i].length > sink->capacity - sink->length)
+			return false;
+		bcopy(vectors[i].base, sink->bytes + sink->length, vectors[i].length);
+		sink->length += vectors[i].length;
+	}
+
+	return true;
+}
+
+static bool checkStream(const char *name, const OSObject *tree, bool binary,
+                        unsigned int minRing)
+{
+	OSSerialize *buffered;
+	CheckSink sink;
+	unsigned int rings = 0, expected = 0;
+	bool ok;
+
+	bzero(&sink, sizeof(sink));
+	buffered = (binary) ? OSSerialize::binaryWithCapacity(4096) : OSSerialize::withCapacity(4096);
+	ok = buffered && tree->serialize(buffered);
+	if (ok) {
+		expected = buffered->getLength() - ((binary) ? 0 : 1);
+		sink.capacity = expected;
+		sink.bytes = (char *) kalloc(sink.capacity ? sink.capacity : 1);
+		ok = sink.bytes != 0;
+	}
+
+	for (unsigned int i = 0; ok && i < kCheckRings; i++) {
+		unsigned int chunkSize = sCheckRings[i].chunkSize;
+		unsigned int chunkCount = sCheckRings[i].chunkCount;
+		OSSerialize *s;
+
+		if ((binary && (chunkSize & 3)) || chunkSize * chunkCount < minRing)
+			continue;
+
+		sink.length = 0;
+		s = (binary) ? OSSerialize::binaryWithSink(checkSink, &sink, chunkSize, chunkCount)
+		             : OSSerialize::withSink(checkSink, &sink, chunkSize, chunkCount);
+		ok = s && tree->serialize(s) && s->flush() && sink.length == expected;
+		for (unsigned int j = 0; ok && j < expected; j++)
+			ok = sink.bytes[j] == buffered->text()[j];
+		OSSafeRelease(s);
+		rings++;
+	}
+
+	printk("{\"check\":\"%s\",\"format\":\"%s\",\"ok\":%s,\"rings\":%u,\"bytes\":%u}\n",
+	       name, (binary) ? "binary" : "xml", (ok) ? "true" : "false", rings, expected);
+
+	if (sink.bytes)
+		kfree(sink.bytes, sink.capacity ? sink.capacity : 1);
+	OSSafeRelease(buffered);
+
+	return ok;
+}
+
+/*
+ * Custom serializers.
+ *
+ * One OSSerializer hands over its text as fragments, another writes it
+ * straight into reserved space a few bytes at a time, reserving more than
+ * it writes.  Both only write XML.  The buffered text must be what they
+ * wrote, and streaming them next to the check tree must give the same
+ * bytes as buffering, in rings that hold a reserved span.
+ */
+#define kCheckSpan      3
+
+static const char sCheckBlob[] = "<data>AAECAwQFBgcICQ==</data>";
+
+static const OSSerializeVector sCheckVectors[] = {
+	{ "<data>", 6 }, { "AAECAwQF", 8 }, { "BgcICQ==", 8 }, { "</data>", 7 },
+};
+
+static const char sCheckWritten[] =
+	"<array ID=\"0\"><data>AAECAwQFBgcICQ==</data><data>AAECAwQFBgcICQ==</data></array>";
+
+static bool checkVectorWriter(void *target, void *ref,
+                              const OSSerializeVector **vectors, unsigned int *count)
+{
+	*vectors = sCheckVectors;
+	*count = sizeof(sCheckVectors) / sizeof(sCheckVectors[0]);
+	return true;
+}
+
+static bool checkSpanWriter(void *target, void *ref, OSSerialize *s)
+{
+	const char *text = (const char *) target;
+	unsigned int n = strlen(text);
+
+	for (unsigned int i = 0; i < n; i += kCheckSpan - 1) {
+		unsigned int written = (n - i < kCheckSpan - 1) ? n - i : kCheckSpan - 1;
+		char *span = s->reserveBytes(kCheckSpan);
+
+		if (!span)
+			return false;
+		bcopy(text + i, span, written);
+		if (!s->commitBytes(written))
+			return false;
+	}
+
+	return true;
+}
+
+static bool checkWriters(const OSDictionary *tree)
+{
+	OSSerializer *vectorWriter = OSSerializer::forTarget(0, checkVectorWriter);
+	OSSerializer *spanWriter = OSSerializer::forTarget((void *) sCheckBlob, checkSpanWriter);
+	OSArray *writers = OSArray::withCapacity(2);
+	OSArray *mixed = OSArray::withCapacity(3);
+	OSSerialize *s = OSSerialize::withCapacity(64);
+	bool ok;
+
+	ok = vectorWriter && spanWriter && writers && mixed && s
+	  && writers->setObject(vectorWriter)
+	  && writers->setObject(spanWriter)
+	  && mixed->setObject(vectorWriter)
+	  && mixed->setObject(tree)
+	  && mixed->setObject(spanWriter)
+	  && writers->serialize(s)
+	  && s->getLength() == sizeof(sCheckWritten)
+	  && !strcmp(s->text(), sCheckWritten);
+
+	printk("{\"check\":\"writers\",\"format\":\"xml\",\"ok\":%s,\"bytes\":%u}\n",
+	       (ok) ? "true" : "false", (s) ? s->getLength() - 1 : 0);
+
+	ok = ok && checkStream("writers-stream", mixed, false, kCheckSpan);
+
+	OSSafeRelease(s);
+	OSSafeRelease(mixed);
+	OSSafeRelease(writers);
+	OSSafeRelease(spanWriter);
+	OSSafeRelease(vectorWriter);
+
+	return ok;
+}
+
+/*
+ * Parallel serialization.
+ *
+ * An array whose members share strings, dictionaries and the check tree,
+ * so that references cross from one task's run of members into another's.
+ * serializeInParallel, on threads from smp_run, must write the bytes
+ * serialize() does, buffered in both formats and streaming, for task
+ * counts that do and do not divide the members evenly.
+ */
+#define kCheckParallelMembers   200
+
+static const unsigned int sCheckTaskCounts[] = { 2, 3, 7, 8 };
+
+#define kCheckTaskCounts    (sizeof(sCheckTaskCounts) / sizeof(sCheckTaskCounts[0]))
+
+static OSArray *checkParallelArray(const OSDictionary *tree)
+{
+	OSString *shared = OSString::withCString("shared between tasks");
+	OSArray *array = OSArray::withCapacity(kCheckParallelMembers);
+	bool ok = shared && array;
+
+	for (unsigned int i = 0; ok && i < kCheckParallelMembers; i++) {
+		OSDictionary *member;
+		OSString *value;
+		char name[20];
+
+		if (i % 50 == 0) {
+			ok = array->setObject(tree);
+			continue;
+		}
+		if (i % 10 == 5) {
+			// a member from earlier on, often in another task's run
+			ok = array->setObject(array->getObject(i - 5));
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "member%u", i);
+		member = OSDictionary::withCapacity(2);
+		value = OSString::withCString(name);
+		ok = member && value
+		  && member->setObject("name", value)
+		  && member->setObject("shared", shared)
+		  && array->setObject(member);
+		OSSafeRelease(value);
+		OSSafeRelease(member);
+	}
+
+	OSSafeRelease(shared);
+	if (!ok)
+		OSSafeRelease(array);
+
+	return array;
+}
+
+static bool checkParallelFormat(const OSArray *array, bool binary, bool stream)
+{
+	OSSerialize *sequential;
+	CheckSink sink;
+	unsigned int expected = 0;
+	bool ok;
+
+	bzero(&sink, sizeof(sink));
+	sequential = (binary) ? OSSerialize::binaryWithCapacity(4096) : OSSerialize::withCapacity(4096);
+	ok = sequential && array->serialize(sequential);
+	if (ok) {
+		expected = sequential->getLength() - ((binary) ? 0 : 1);
+		sink.capacity = expected;
+		sink.bytes = (char *) kalloc(sink.capacity);
+		ok = sink.bytes != 0;
+	}
+
+	for (unsigned int i = 0; ok && i < kCheckTaskCounts; i++) {
+		OSSerialize *s;
+
+		sink.length = 0;
+		if (stream) {
+			s = (binary) ? OSSerialize::binaryWithSink(checkSink, &sink, 64, 4)
+			             : OSSerialize::withSink(checkSink, &sink, 64, 4);
+		} else
+			s = (binary) ? OSSerialize::binaryWithCapacity(64) : OSSerialize::withCapacity(64);
+
+		ok = s && s->serializeInParallel(array, smpExecutor, 0, sCheckTaskCounts[i]) && s->flush();
+		if (ok && !stream)
+			ok = checkSameText(sequential, s);
+		if (ok && stream) {
+			ok = sink.length == expected;
+			for (unsigned int j = 0; ok && j < expected; j++)
+				ok = sink.bytes[j] == sequential->text()[j];
+		}
+		OSSafeRelease(s);
+	}
+
+	printk("{\"check\":\"parallel\",\"format\":\"%s%s\",\"ok\":%s,\"members\":%u,"
+	       "\"task_counts\":%u,\"bytes\":%u}\n",
+	       (binary) ? "binary" : "xml", (stream) ? "-stream" : "", (ok) ? "true" : "false",
+	       array->getCount(), (unsigned int) kCheckTaskCounts, expected);
+
+	if (sink.bytes)
+		kfree(sink.bytes, sink.capacity);
+	OSSafeRelease(sequential);
+
+	return ok;
+}
+
+static bool checkParallel(const OSDictionary *tree)
+{
+	OSArray *array = checkParallelArray(tree);
+	bool ok = true;
+
+	if (!array) {
+		printk("serialize check: no memory for the parallel array\n");
+		return false;
+	}
+
+	for (unsigned int format = 0; format < 4; format++)
+		ok = checkParallelFormat(array, format & 1, format & 2) && ok;
+	array->release();
+
+	return ok;
+}
+
+/*
+ * Cached serialization.
+ *
+ * The check tree with kImmutable and kCacheSerialization set, first on
+ * the collections inside the root and then on the root too.  In each
+ * format the first pass takes the copies and the second writes them,
+ * and both must write the bytes of the uncached tree.
+ */
+#define kCheckCacheOptions  (OSCollection::kImmutable | OSCollection::kCacheSerialization)
+
+static void checkCacheInside(OSDictionary *tree)
+{
+	OSCollectionIterator *iter = OSCollectionIterator::withCollection(tree);
+	const OSSymbol *key;
+
+	while (iter && (key = (const OSSymbol *) iter->getNextObject())) {
+		OSCollection *c = OSDynamicCast(OSCollection, tree->getObject(key));
+
+		if (c)
+			c->setOptions(kCheckCacheOptions, kCheckCacheOptions);
+	}
+	OSSafeRelease(iter);
+}
+
+static bool checkCache(OSDictionary *tree, bool binary)
+{
+	OSSerialize *uncached = (binary) ? OSSerialize::binaryWithCapacity(4096) : OSSerialize::withCapacity(4096);
+	unsigned int passes = 0;
+	bool ok = uncached && tree->serialize(uncached);
+
+	for (unsigned int stage = 0; ok && stage < 2; stage++) {
+		if (stage == 0)
+			checkCacheInside(tree);
+		else
+			tree->setOptions(kCheckCacheOptions, kCheckCacheOptions);
+
+		for (unsigned int pass = 0; ok && pass < 2; pass++) {
+			OSSerialize *s = (binary) ? OSSerialize::binaryWithCapacity(64) : OSSerialize::withCapacity(64);
+
+			ok = s && tree->serialize(s) && checkSameText(uncached, s);
+			OSSafeRelease(s);
+			passes++;
+		}
+	}
+
+	// set on the root first, so that clearing it reaches every collection
+	tree->setOptions(kCheckCacheOptions, kCheckCacheOptions);
+	tree->setOptions(0, kCheckCacheOptions);
+
+	printk("{\"check\":\"cache\",\"format\":\"%s\",\"ok\":%s,\"passes\":%u,\"bytes\":%u}\n",
+	       (binary) ? "binary" : "xml", (ok) ? "true" : "false", passes,
+	       (uncached) ? uncached->getLength() : 0);
+	OSSafeRelease(uncached);
+
+	return ok;
+}
+
+static bool checkSerialize(void)
+{
+	OSDictionary *tree = checkTree();
+	bool ok;
+
+	if (!tree) {
+		printk("serialize check: no memory for the tree\n");
+		return false;
+	}
+
+	ok = checkRoundTrip(tree, false);
+	ok = checkRoundTrip(tree, true) && ok;
+	ok = checkStream("stream", tree, false, 0) && ok;
+	ok = checkStream("stream", tree, true, 0) && ok;
+	ok = checkWriters(tree) && ok;
+	ok = checkParallel(tree) && ok;
+	ok = checkCache(tree, false) && ok;
+	ok = checkCache(tree, true) && ok;
+	tree->release();
+
+	return ok;
+}
+#endif /* SERIALIZE_CHECK */
+
 volatile int kmod_start(void)
 {
 	libkern_init0();
@@ -37,6 +1856,31 @@ volatile int kmod_start(void)
 	sexthings->serialize(ser);
 
 	printk("Serialized: %s \n", ser->text());
+
+#if SERIALIZE_CHECK
+	if (!checkSerialize())
+		printk("serialize round trip failed\n");
+#endif
+
+#if SERIALIZE_BENCHMARK
+	for (unsigned int i = 0; i < sizeof(sSerializeBenchConfigs) / sizeof(sSerializeBenchConfigs[0]); i++) {
+		if (!benchSerialize(&sSerializeBenchConfigs[i]))
+			printk("serialize benchmark %s failed\n", sSerializeBenchConfigs[i].name);
+	}
+	benchEscape();
+#endif
+
+#if COLLECTION_BENCHMARK
+	benchCollections();
+#endif
+
+#if SYMBOL_BENCHMARK
+	benchSymbols();
+#endif
+
+#if CAST_BENCHMARK
+	benchCasts();
+#endif
 	
 	return 0;
 }
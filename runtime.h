@@ -33,6 +33,22 @@ extern "C" {
 	int strcmp(const char *s1, const char *s2);
 	int strncmp(const char *s1, const char *s2, size_t n);
 	size_t strlen(const char *s);
+
+/* atomics */
+	bool OSAtomicCompareAndSwap32(u_int32_t oldValue, u_int32_t newValue, volatile u_int32_t *theValue);
+	int32_t OSAtomicAdd32(int32_t theAmount, volatile int32_t *theValue);
+	int64_t OSAtomicAdd64(int64_t theAmount, volatile int64_t *theValue);
+	bool OSCompareAndSwapPtr(void *oldValue, void *newValue, void * volatile *theValue);
+	void OSMemoryBarrier(void);
+
+/* smp */
+	int cpu_number(void);
+	/* runs work(context, i) for each i < count, each on its own thread, and returns once all have */
+	void smp_run(unsigned int count, void (*work)(void *context, unsigned int index), void *context);
+
+/* time */
+	u_int64_t mach_absolute_time(void);
+	void absolutetime_to_nanoseconds(u_int64_t abstime, u_int64_t *result);
 	
 #ifdef __cplusplus
 }
@@ -42,6 +58,6 @@ void kfree(void* ptr, size_t size);
 
 #endif
 
-#define assert(x) if (!x) { panic("[%s:%d] assertion failed '%s'", __FILE__, __LINE__, #x); }
+#define assert(x) do { if (!(x)) panic("[%s:%d] assertion failed '%s'", __FILE__, __LINE__, #x); } while (0)
 
 #endif